@@ -0,0 +1,118 @@
+#pragma once
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+using namespace std;
+
+// =========================================
+// Allocation tracking
+// ----------------------------------------
+// Counts heap allocations so that a frame
+// that allocates can be caught. Once the
+// buffers of a display and its structs have
+// grown to size, drawing a frame shouldn't
+// allocate at all.
+//
+// Counting is off unless the program is
+// built with -DASCII_COUNT_ALLOCS, which
+// replaces the global operator new. Since
+// the replacement is defined here, only one
+// .cpp file of a program may include this
+// header. Adding -DASCII_ASSERT_ALLOCS too
+// asserts that a frame allocated nothing.
+//
+//   AllocMeter allocs;
+//   ...
+//   allocs.begin();
+//   drawFrame();
+//   allocs.end();
+//   ...
+//   allocs.report(stderr);
+//
+// Without ASCII_COUNT_ALLOCS the meter does
+// nothing and reports nothing.
+// =========================================
+
+// Allocations made so far by every thread
+inline atomic<unsigned long long>& allocCount() {
+	static atomic<unsigned long long> count(0);
+	return count;
+}
+
+#ifdef ASCII_COUNT_ALLOCS
+// kept out of line, so the compiler doesn't pair the malloc and free
+// it can see at a call site and warn that they don't match new and delete
+__attribute__((noinline)) void* operator new(size_t n) {
+	allocCount().fetch_add(1, memory_order_relaxed);
+	void* p = malloc(n == 0 ? 1 : n);
+	if(p == NULL) throw bad_alloc();
+	return p;
+}
+__attribute__((noinline)) void* operator new[](size_t n) { return operator new(n); }
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void* p, size_t) noexcept { free(p); }
+#endif
+
+// Counts the allocations made between begin() and end() of each frame
+class AllocMeter {
+	unsigned long long at; // the count at begin()
+	unsigned long long frameCt, dirtyCt; // frames, and frames that allocated
+	unsigned long long total, most; // allocations in all frames, and in the worst
+	unsigned long long last;
+	unsigned int warmup; // frames not checked while buffers grow to size
+
+	public:
+		// warmupFrames - how many of the first frames can allocate,
+		//   the first frames size the buffers that later ones reuse
+		AllocMeter(const unsigned int warmupFrames = 8) {
+			at = 0;
+			frameCt = 0; dirtyCt = 0;
+			total = 0; most = 0; last = 0;
+			warmup = warmupFrames;
+		}
+
+		void begin() {
+#ifdef ASCII_COUNT_ALLOCS
+			at = allocCount().load(memory_order_relaxed);
+#endif
+		}
+
+		// Returns how many allocations the frame made
+		unsigned long long end() {
+#ifdef ASCII_COUNT_ALLOCS
+			last = allocCount().load(memory_order_relaxed) - at;
+			if(++frameCt <= warmup) return last;
+			total += last;
+			if(last > most) most = last;
+			if(last > 0) dirtyCt++;
+#ifdef ASCII_ASSERT_ALLOCS
+			assert(last == 0 && "a frame allocated after warming up");
+#endif
+#endif
+			return last;
+		}
+
+		// Writes how the frames did, if counting was built in
+		void report(FILE* out) {
+#ifdef ASCII_COUNT_ALLOCS
+			const unsigned long long checked = frameCt > warmup ? frameCt - warmup : 0;
+			fprintf(out, "allocations: %llu frames checked, %llu allocated, "
+				"%llu in total, %llu at most in one frame\n",
+				checked, dirtyCt, total, most);
+#endif
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		const unsigned long long frames() { return frameCt; }
+		// frames after the warmup that allocated
+		const unsigned long long allocatingFrames() { return dirtyCt; }
+		const unsigned long long lastFrame() { return last; }
+		const unsigned long long worstFrame() { return most; }
+};
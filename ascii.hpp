@@ -1,7 +1,18 @@
-#include <ncurses.h> // -lncurses
+#pragma once
+#define NCURSES_WIDECHAR 1 // wide character functions for UTF-8 output
+#include <ncurses.h> // -lncursesw
+#include <clocale>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include "cell.hpp"
+#include "latency.hpp"
 using namespace std;
 // Version of this program
 #define ASCIIWIN_VERSION "ALPHA_0.0";
@@ -28,6 +39,12 @@ enum Colors {
 	BBLK, BBLU, BGRN, BCYN, BRED, BMGT, BYLW, BWHT
 };
 
+// The terminal palette index of one of the Colors, for use in a Cell.
+// Terminals number the basic colors in a different order than Colors does.
+constexpr unsigned char paletteOf(const Colors c) {
+	return ((c & 1) << 2 | (c & 2) | (c & 4) >> 2) | (c & 8);
+}
+
 // A command line window that can be interfaced with to show ASCII images.
 class ASCIIWindow {
 	bool instanced; // whether the window is instanced or not
@@ -36,6 +53,59 @@ class ASCIIWindow {
 	unsigned short wd, ht; // window dimensions in chars
 	unsigned short posX, posY; // location of the cursor
 	WINDOW *cWindow; // C window
+	SCREEN *screen; // the terminal a headless window writes to, NULL otherwise
+	FILE *outFile, *inFile; // what a headless window writes to and reads from
+	int outFd; // where output goes, for checking how backed up it is
+	int inFd; // where keys come from, for waiting on them
+	vector<short> pairs; // color pair for each fg, bg combination, 0 if none yet
+	short nextPair; // next color pair number to hand out
+	LatencyTrace *trace; // told when frames reach the terminal, or NULL
+	bool traceShown; // whether the trace is drawn in the top right corner
+
+	// Finds or makes the color pair for a cell's colors.
+	// Pair 0 is the terminal's default colors, and is also
+	// used if the terminal runs out of color pairs.
+	short pairOf(const Cell c) {
+		if(!cellHasFg(c) && !cellHasBg(c)) return 0;
+		if(!has_colors()) return 0;
+		// 0 is the default color, so indices are shifted by one
+		const unsigned short fg = cellHasFg(c) ? cellFg(c) + 1 : 0,
+			bg = cellHasBg(c) ? cellBg(c) + 1 : 0;
+		const unsigned int key = fg * 257 + bg;
+		if(pairs.empty()) pairs.assign(257 * 257, 0);
+		if(pairs[key] != 0) return pairs[key];
+		if(nextPair >= COLOR_PAIRS || nextPair == 32767) return 0;
+		// colors the terminal doesn't have fall back to the basic eight
+		short f = fg - 1, b = bg - 1;
+		if(f >= COLORS) f &= 7;
+		if(b >= COLORS) b &= 7;
+		init_pair(nextPair, f, b);
+		pairs[key] = nextPair;
+		return nextPair++;
+	}
+
+	// ncurses attributes for a cell's attribute bits
+	static attr_t attrsOf(const Cell c) {
+		attr_t a = A_NORMAL;
+		if(c & CELL_BOLD) a |= A_BOLD;
+		if(c & CELL_DIM) a |= A_DIM;
+		if(c & CELL_UNDERLINE) a |= A_UNDERLINE;
+		if(c & CELL_REVERSE) a |= A_REVERSE;
+		if(c & CELL_BLINK) a |= A_BLINK;
+		return a;
+	}
+
+	// Draws the trace's percentiles in the top right corner
+	void showTrace() {
+		if(trace == NULL || !traceShown || !instanced) return;
+		char text[96];
+		trace -> describe(text, sizeof(text));
+		const size_t n = strlen(text) < wd ? strlen(text) : wd;
+		attr_set(A_REVERSE, 0, NULL);
+		mvwaddnstr(cWindow, 0, wd - n, text, n);
+		attr_set(A_NORMAL, 0, NULL);
+		move(posY, posX);
+	}
 
 	// error
 	class WindowError : public runtime_error {
@@ -50,10 +120,17 @@ class ASCIIWindow {
 			ht = h;
 			instanced = false;
 			realTime = false;
+			nextPair = 1;
+			screen = NULL;
+			outFile = NULL; inFile = NULL;
+			outFd = fileno(stdout);
+			inFd = fileno(stdin);
+			trace = NULL;
+			traceShown = false;
 		}
 		
 		~ASCIIWindow() {
-			if (instanced) endwin();
+			if (instanced) close();
 		}
 
 		// Returns true if the window was successfully built.
@@ -69,8 +146,10 @@ class ASCIIWindow {
 			//	throw WindowError(msg);
 			//}
 			// instance the window now
+			setlocale(LC_ALL, ""); // UTF-8 output if the terminal uses it
 			cWindow = initscr(); // initialize
 			start_color(); // Enable color in window
+			use_default_colors(); // let -1 mean the terminal's colors
 			cbreak();
 			noecho(); // do not echo
 			for(unsigned short y=0; y<ht; y++) {
@@ -83,6 +162,67 @@ class ASCIIWindow {
 			instanced = true;
 			return true;
 		}
+
+		// Builds the window on a terminal that isn't there, for benchmarks
+		// and tests. Everything is drawn like it would be on a term terminal
+		// and written to /dev/null, and no keys ever come in.
+		// Returns true if the window was successfully built.
+		bool buildHeadless(const char* term = "xterm-256color") {
+			if (instanced == true) return false;
+			outFile = fopen("/dev/null", "w");
+			inFile = fopen("/dev/null", "r");
+			if(outFile != NULL && inFile != NULL)
+				screen = newterm(term, outFile, inFile);
+			if(screen == NULL) {
+				if(outFile != NULL) fclose(outFile);
+				if(inFile != NULL) fclose(inFile);
+				outFile = NULL; inFile = NULL;
+				return false;
+			}
+			outFd = fileno(outFile);
+			resize_term(ht, wd); // /dev/null has no size
+			cWindow = stdscr;
+			start_color();
+			use_default_colors();
+			cbreak();
+			noecho();
+			instanced = true;
+			return true;
+		}
+		
+		// Builds the window on the terminal at path instead of stdin and
+		// stdout, for when those are a pipe, such as video fed in from
+		// another program. /dev/tty is the terminal the program runs in.
+		// Returns true if the window was successfully built.
+		bool buildOn(const char* path = "/dev/tty") {
+			if (instanced == true) return false;
+			setlocale(LC_ALL, "");
+			outFile = fopen(path, "w");
+			inFile = fopen(path, "r");
+			if(outFile != NULL && inFile != NULL)
+				screen = newterm(NULL, outFile, inFile);
+			if(screen == NULL) {
+				if(outFile != NULL) fclose(outFile);
+				if(inFile != NULL) fclose(inFile);
+				outFile = NULL; inFile = NULL;
+				return false;
+			}
+			outFd = fileno(outFile);
+			inFd = fileno(inFile);
+			cWindow = stdscr;
+			start_color();
+			use_default_colors();
+			cbreak();
+			noecho();
+			for(unsigned short y=0; y<ht; y++) {
+				for(unsigned short x=0; x<wd; x++)
+					addch(' ');
+				addch('\n');
+			}
+			refresh();
+			instanced = true;
+			return true;
+		}
 		
 		// Returns true if the window was successfully closed.
 		bool close() {
@@ -91,6 +231,15 @@ class ASCIIWindow {
 
 			// destroy the window
 			endwin();
+			if(screen != NULL) {
+				delscreen(screen);
+				fclose(outFile);
+				fclose(inFile);
+				screen = NULL;
+				outFile = NULL; inFile = NULL;
+				outFd = fileno(stdout);
+				inFd = fileno(stdin);
+			}
 			instanced = false;
 			return false;
 		}
@@ -109,6 +258,50 @@ class ASCIIWindow {
 		// If real time is enabled and no key is pressed then returns -1
 		char getKey() { return getch(); }
 		
+		// Sends everything written so far to the terminal
+		void present() {
+			showTrace();
+			refresh();
+			if(trace != NULL) trace -> flushed();
+		}
+
+		// Sends everything written so far to the terminal, which shows
+		// frame f of the trace, see Presenter
+		void present(const unsigned long long f) {
+			showTrace();
+			refresh();
+			if(trace != NULL) trace -> flushed(f);
+		}
+
+		// Tells a trace when frames reach the terminal, NULL to stop.
+		// With shown, the trace's percentiles are drawn in the top right
+		// corner, over whatever is there, every time a frame is sent.
+		void setTrace(LatencyTrace *latency, const bool shown = false) {
+			trace = latency;
+			traceShown = shown;
+		}
+
+		// How many bytes were sent to the terminal that it hasn't taken yet,
+		// such as when a slow serial line can't keep up, or -1 if it can't tell.
+		// Linux ptys, which SSH and terminal emulators use, always say 0.
+		int outputQueued() {
+			int n = 0;
+			if(ioctl(outFd, TIOCOUTQ, &n) == -1) return -1;
+			return n;
+		}
+
+		// Whether the terminal can take more output without blocking,
+		// false once a pty's buffer is full because the other end is slow
+		bool outputReady() {
+			pollfd p = {outFd, POLLOUT, 0};
+			// 0 means not writable, only a failed poll counts as ready
+			const int r = poll(&p, 1, 0);
+			return r < 0 || (p.revents & POLLOUT);
+		}
+		
+		// The fd keys are read from, stdin unless built with buildOn()
+		int inputFd() { return inFd; }
+
 		// Destroys the buffer by calling getch until it returns -1
 		unsigned short killBuf() {
 			char bufIn = 0; // The input character type
@@ -148,6 +341,22 @@ class ASCIIWindow {
 		void clearWin() {
 			clear();
 		}
+
+		// Scrolls the lines top to bot (inclusive) up by n lines,
+		// or down if n is negative, leaving blank lines behind.
+		// ncurses sends this to the terminal as a scroll region operation
+		// instead of rewriting every line in the region.
+		// Returns false if the region is out of window bounds.
+		bool scrollRegion(const unsigned short top, const unsigned short bot,
+		const short n) {
+			if(top > bot || bot >= ht) return false;
+			scrollok(cWindow, true);
+			wsetscrreg(cWindow, top, bot);
+			wscrl(cWindow, n);
+			wsetscrreg(cWindow, 0, getmaxy(cWindow) - 1);
+			scrollok(cWindow, false);
+			return true;
+		}
 		
 		// Stop real-time input so that the window waits for key input before cycling.
 		bool exitRealTime() {
@@ -192,19 +401,48 @@ class ASCIIWindow {
 			move(posY, posX); // return cursor
 		}
 
+		// Write a run of n cells starting from x, y and going right from that,
+		// without returning the cursor. Cells of the same style are written
+		// together, and the cell after a double width character is skipped
+		// since the character already covers it.
+		// Will throw an error if the run is beyond the window.
+		void writeCellsNR(const unsigned short x, const unsigned short y,
+		const Cell* cells, const unsigned short n) {
+			if(x >= wd || y >= ht || x + n > wd)
+				throw WindowError("Character out of window bounds");
+			if(n == 0) return;
+			wchar_t run[257]; // characters of the current run
+			unsigned short i = 0;
+			while(i < n) {
+				// gather cells with the same style as cells[i]
+				const Cell style = cellStyle(cells[i]);
+				const unsigned short start = i;
+				unsigned short len = 0;
+				while(i < n && cellStyle(cells[i]) == style && len < 256) {
+					const wchar_t ch = cellChar(cells[i]);
+					run[len++] = ch;
+					i += (ch > 0x7F && wcwidth(ch) == 2) ? 2 : 1;
+				}
+				run[len] = 0;
+				wattr_set(cWindow, attrsOf(style), pairOf(style), NULL);
+				mvwaddnwstr(cWindow, y, x + start, run, len);
+			}
+			wattr_set(cWindow, A_NORMAL, 0, NULL);
+			posX = x + n - 1;
+			posY = y;
+		}
+
 		// Write a string starting from x, y and going right from that.
 		// Will throw an error if the string is beyond the window.
-		void writeAt(const unsigned short x, const unsigned short y, const string str) {
+		// Takes a view so that literals and buffers aren't copied into a string.
+		void writeAt(const unsigned short x, const unsigned short y, const string_view str) {
 			// throw error if the string position is out of window bounds
 			bool outOfBounds = (x >= wd || y >= ht);
 			outOfBounds = outOfBounds || (x + str.length() > wd);
 			if(outOfBounds) throw WindowError("Character out of window bounds");
 
-			// write each letter
-			for(unsigned short i=0; i<str.length(); i++) {
-				move(y, x + i); // move to position to write
-				writeChar(str[i]); // write a character
-			}
+			// write the letters in one go
+			mvwaddnstr(cWindow, y, x, str.data(), str.length());
 
 			move(posY, posX); // return cursor to original position
 		}
@@ -266,6 +504,7 @@ class ASCIIWindow {
 		unsigned short cursPosY() { return posY; }
 		bool isInstanced() { return instanced; }
 		bool isRealTime() { return realTime; }
+		LatencyTrace* latencyTrace() { return trace; }
 
 };
 
@@ -333,11 +572,10 @@ void EX_cursorletters() {
 			}
 			
 			// cursor position
-			string info = "POS: " + to_string(window -> cursPosX());
-			info += " "; // write current position
-			info += to_string(window -> cursPosY());
-			info += "        ";
-			window -> writeAt(0, 0, info);
+			char info[24]; // write current position
+			const int n = snprintf(info, sizeof(info), "POS: %-5u %-5u",
+				window -> cursPosX(), window -> cursPosY());
+			window -> writeAt(0, 0, string_view(info, n));
 		}
 	}
 	
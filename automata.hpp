@@ -0,0 +1,426 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "engine.hpp"
+#include "jobs.hpp"
+using namespace std;
+
+// =========================================
+// Cellular automata
+// ----------------------------------------
+// A grid of cells that live and die by a
+// rule, such as Conway's Life or a fire that
+// burns out, drawn as one struct however big
+// the grid is.
+//
+// Cells are stored a bit each, 64 to a word,
+// so one step works on 64 cells at a time:
+// the eight neighbours of every cell in a
+// word are added up with bitwise adders and
+// the rule picks which sums are born and
+// which survive. Rows are split over the job
+// system's threads. Glyphs are only worked
+// out for the cells that are on the display,
+// when the grid is written.
+//
+// Rules are written like B3/S23, the counts
+// of live neighbours that give birth and let
+// a cell survive. A third part, such as in
+// B2/S/C3, gives the number of states: a cell
+// that dies goes through the states after 1
+// before it is dead, and counts as neither
+// alive nor dead until then. Those states are
+// kept in a few more bits per cell.
+//
+//   Automaton * life = new Automaton(0, 0, 0, 4096, 4096, "B3/S23", &jobs);
+//   life -> randomize(30, 1);
+//   display.addStruct(life);
+//   ...
+//   life -> step();
+//   display.redrawStructs();
+//
+// Live cells collide, and everything outside
+// of the grid is dead.
+// =========================================
+
+class Automaton : public CharStruct {
+	unsigned short wd, ht;
+	unsigned int stride; // words per row
+	uint64_t lastMask; // the bits of a row's last word that are in the grid
+	// Bit planes: the first holds the live cells, the rest how far along
+	// a dying cell is, as a binary number. Every plane is ht rows of stride words.
+	vector<vector<uint64_t>> cur, nxt;
+	vector<uint64_t> none; // a row of dead cells, above and below the grid
+	unsigned short birth, survive; // bit n set if n live neighbours does it
+	unsigned char states;
+	vector<unsigned char> bornSums, keptSums; // the bits of birth and survive
+	vector<Cell> glyphs; // what each state looks like, 0 is see-through
+	JobSystem* jobs;
+	unsigned long long gen;
+
+	// bits needed to count the dying states
+	static unsigned int ageBits(const unsigned int stateCt) {
+		unsigned int bits = 0;
+		while(stateCt > 2 && (1u << bits) < stateCt - 1u) bits++;
+		return bits;
+	}
+
+	void allocate() {
+		stride = (wd + 63) / 64;
+		lastMask = wd % 64 == 0 ? ~0ull : (1ull << (wd % 64)) - 1;
+		const unsigned int planes = 1 + ageBits(states);
+		cur.assign(planes, vector<uint64_t>((size_t)stride * ht, 0));
+		nxt = cur;
+		none.assign(stride, 0);
+	}
+
+	// Steps the rows [r0, r1) from cur into nxt
+	void stepRows(const unsigned int r0, const unsigned int r1) {
+		const unsigned int planes = cur.size();
+		const uint64_t* live = cur[0].data();
+		for(unsigned int r=r0; r<r1; r++) {
+			const uint64_t* up = r > 0 ? live + (size_t)(r - 1) * stride : none.data();
+			const uint64_t* mid = live + (size_t)r * stride;
+			const uint64_t* down = r + 1 < ht ? live + (size_t)(r + 1) * stride : none.data();
+			uint64_t* out = nxt[0].data() + (size_t)r * stride;
+			for(unsigned int j=0; j<stride; j++) {
+				// each neighbour lined up with the cell it neighbours
+				const uint64_t
+					u = up[j], d = down[j],
+					uw = u << 1 | (j > 0 ? up[j-1] >> 63 : 0),
+					ue = u >> 1 | (j + 1 < stride ? up[j+1] << 63 : 0),
+					mw = mid[j] << 1 | (j > 0 ? mid[j-1] >> 63 : 0),
+					me = mid[j] >> 1 | (j + 1 < stride ? mid[j+1] << 63 : 0),
+					dw = d << 1 | (j > 0 ? down[j-1] >> 63 : 0),
+					de = d >> 1 | (j + 1 < stride ? down[j+1] << 63 : 0);
+				// add the eight of them up, one bit of the sum at a time
+				const uint64_t s1 = uw ^ u ^ ue, c1 = (uw & u) | (ue & (uw ^ u));
+				const uint64_t s2 = mw ^ me ^ dw, c2 = (mw & me) | (dw & (mw ^ me));
+				const uint64_t s3 = d ^ de, c3 = d & de;
+				const uint64_t b0 = s1 ^ s2 ^ s3, ca = (s1 & s2) | (s3 & (s1 ^ s2));
+				const uint64_t t = c1 ^ c2 ^ c3, c4 = (c1 & c2) | (c3 & (c1 ^ c2));
+				const uint64_t b1 = t ^ ca, c5 = t & ca;
+				const uint64_t b2 = c4 ^ c5, b3 = c4 & c5;
+				uint64_t born = 0, kept = 0;
+				for(unsigned int k=0; k<bornSums.size(); k++) born |= sumIs(bornSums[k], b0, b1, b2, b3);
+				for(unsigned int k=0; k<keptSums.size(); k++) kept |= sumIs(keptSums[k], b0, b1, b2, b3);
+				const uint64_t alive = mid[j];
+				const uint64_t mask = j + 1 < stride ? ~0ull : lastMask;
+				if(planes == 1) {
+					out[j] = ((~alive & born) | (alive & kept)) & mask;
+					continue;
+				}
+				// Generations: dying cells count up, and can't be born until dead
+				const size_t at = (size_t)r * stride + j;
+				uint64_t dying = 0;
+				for(unsigned int p=1; p<planes; p++) dying |= cur[p][at];
+				out[j] = ((~alive & ~dying & born) | (alive & kept)) & mask;
+				uint64_t carry = dying, done = ~0ull;
+				for(unsigned int p=1; p<planes; p++) {
+					const uint64_t bit = cur[p][at];
+					nxt[p][at] = bit ^ carry;
+					carry &= bit;
+					done &= ((states - 1) >> (p - 1) & 1) ? nxt[p][at] : ~nxt[p][at];
+				}
+				// cells that reached the last state are dead, and cells that
+				// just died start dying
+				const uint64_t died = alive & ~kept & mask;
+				for(unsigned int p=1; p<planes; p++) {
+					nxt[p][at] &= ~done;
+					if(p == 1) nxt[p][at] |= died;
+				}
+			}
+		}
+	}
+
+	// the cells whose sum of neighbours is n
+	static uint64_t sumIs(const unsigned int n,
+	const uint64_t b0, const uint64_t b1, const uint64_t b2, const uint64_t b3) {
+		return (n & 1 ? b0 : ~b0) & (n & 2 ? b1 : ~b1)
+			& (n & 4 ? b2 : ~b2) & (n & 8 ? b3 : ~b3);
+	}
+
+	// Calls fn(a, b) for each run [a, b) of live cells in [c0, c1) of a row
+	template<class F>
+	void liveRuns(const uint64_t* row, const unsigned int c0, const unsigned int c1, const F &fn) {
+		unsigned int x = c0;
+		while(x < c1) {
+			// the next live cell
+			unsigned int j = x / 64;
+			uint64_t word = row[j] & (~0ull << (x % 64));
+			while(word == 0 && ++j < stride && j * 64 < c1) word = row[j];
+			if(word == 0) return;
+			const unsigned int a = j * 64 + __builtin_ctzll(word);
+			if(a >= c1) return;
+			// the next dead cell after it
+			j = a / 64;
+			word = ~row[j] & (~0ull << (a % 64));
+			while(word == 0 && ++j < stride && j * 64 < c1) word = ~row[j];
+			unsigned int b = word == 0 ? c1 : j * 64 + __builtin_ctzll(word);
+			if(b > c1) b = c1;
+			fn(a, b);
+			x = b;
+		}
+	}
+
+	public:
+		// collision - the collision code of live cells
+		// xPos, yPos - the top left corner
+		// width, height - the size of the grid in cells
+		// rule - see setRule(), Conway's Life if it isn't valid
+		// jobSystem - the threads to step on, NULL to step on the calling one
+		Automaton(const unsigned int collision,
+		const unsigned short xPos, const unsigned short yPos,
+		const unsigned short width, const unsigned short height,
+		const char* rule = "B3/S23", JobSystem* jobSystem = NULL)
+		: CharStruct(collision, xPos, yPos) {
+			wd = width; ht = height;
+			jobs = jobSystem;
+			gen = 0;
+			states = 2;
+			if(!setRule(rule)) setRule("B3/S23");
+		}
+
+		// =====
+		// Rules
+		// =====
+
+		// Sets the rule, such as "B3/S23" for Life, "B36/S23" for HighLife or
+		// "B2/S/C3" for Brian's Brain. Returns false if it can't be read.
+		// Changing the number of states clears the grid.
+		bool setRule(const char* rule) {
+			unsigned short b = 0, s = 0;
+			unsigned int c = 2;
+			unsigned short* digits = NULL;
+			bool sawB = false, sawS = false;
+			for(const char* p = rule; *p != 0; p++) {
+				if(*p == 'B' || *p == 'b') { digits = &b; sawB = true; }
+				else if(*p == 'S' || *p == 's') { digits = &s; sawS = true; }
+				else if(*p == 'C' || *p == 'c' || *p == 'G' || *p == 'g') {
+					digits = NULL;
+					c = 0;
+					for(p++; *p >= '0' && *p <= '9'; p++) c = c * 10 + (*p - '0');
+					p--;
+				} else if(*p == '/') digits = NULL;
+				else if(*p >= '0' && *p <= '8' && digits != NULL) *digits |= 1 << (*p - '0');
+				else return false;
+			}
+			if(!sawB || !sawS || c < 2 || c > 255) return false;
+			birth = b; survive = s;
+			bornSums.clear(); keptSums.clear();
+			for(unsigned int n=0; n<=8; n++) {
+				if(birth >> n & 1) bornSums.push_back(n);
+				if(survive >> n & 1) keptSums.push_back(n);
+			}
+			if(c != states || cur.empty()) {
+				states = c;
+				allocate();
+				glyphs.assign(c, 0);
+				glyphs[1] = 'O';
+				for(unsigned int i=2; i<c; i++) glyphs[i] = i == 2 ? 'o' : '.';
+			}
+			touch();
+			return true;
+		}
+
+		// Sets how a state looks, 0 for see-through
+		void setGlyph(const unsigned char state, const Cell c) {
+			if(state < glyphs.size()) glyphs[state] = c;
+			touch();
+		}
+
+		// ==========
+		// Simulation
+		// ==========
+
+		// Moves the whole grid on one generation
+		void step() {
+			if(jobs != NULL && ht > 64)
+				jobs -> parallelFor(0, ht, 64, [this](const unsigned int r0, const unsigned int r1) {
+					stepRows(r0, r1);
+				});
+			else stepRows(0, ht);
+			cur.swap(nxt);
+			gen++;
+			rev = tick();
+		}
+
+		// Sets the state of a cell, returns false if out of bounds
+		bool set(const unsigned short x, const unsigned short y, const unsigned char state) {
+			if(x >= wd || y >= ht || state >= states) return false;
+			const size_t at = (size_t)y * stride + x / 64;
+			const uint64_t bit = 1ull << (x % 64);
+			const unsigned int age = state >= 2 ? state - 1 : 0;
+			for(unsigned int p=0; p<cur.size(); p++) {
+				const bool on = p == 0 ? state == 1 : (age >> (p - 1) & 1);
+				if(on) cur[p][at] |= bit;
+				else cur[p][at] &= ~bit;
+			}
+			rev = tick();
+			return true;
+		}
+
+		// The state of a cell, 0 for dead or out of bounds
+		unsigned char get(const unsigned short x, const unsigned short y) {
+			if(x >= wd || y >= ht) return 0;
+			const size_t at = (size_t)y * stride + x / 64;
+			const unsigned int shift = x % 64;
+			if(cur[0][at] >> shift & 1) return 1;
+			unsigned int age = 0;
+			for(unsigned int p=1; p<cur.size(); p++) age |= (cur[p][at] >> shift & 1) << (p - 1);
+			return age == 0 ? 0 : age + 1;
+		}
+
+		// Makes about percent of the cells alive and the rest dead,
+		// the same every time for the same seed
+		void randomize(const unsigned int percent, unsigned long long seed) {
+			const uint64_t cut = percent >= 100 ? ~0ull : (~0ull / 100) * percent;
+			for(unsigned int p=1; p<cur.size(); p++) cur[p].assign(cur[p].size(), 0);
+			for(unsigned int r=0; r<ht; r++) {
+				for(unsigned int j=0; j<stride; j++) {
+					uint64_t word = 0;
+					for(unsigned int b=0; b<64; b++) {
+						seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+						if(seed * 0x2545F4914F6CDD1Dull < cut) word |= 1ull << b;
+					}
+					cur[0][(size_t)r * stride + j] = word & (j + 1 < stride ? ~0ull : lastMask);
+				}
+			}
+			rev = tick();
+		}
+
+		// Makes every cell dead
+		void clearCells() {
+			for(unsigned int p=0; p<cur.size(); p++) cur[p].assign(cur[p].size(), 0);
+			rev = tick();
+		}
+
+		// overrides for CharStruct funcs
+
+		void draw(ASCIIWindow &win,
+		const unsigned short xo, const unsigned short yo) override {
+			for(unsigned short y=0; y<ht; y++)
+				for(unsigned short x=0; x<wd; x++) {
+					const Cell c = glyphs[get(x, y)];
+					if(c != 0 && win.inBounds(xp + xo + x, yp + yo + y))
+						win.writeCellsNR(xp + xo + x, yp + yo + y, &c, 1);
+				}
+		}
+
+		// Only the cells inside of the region being written are looked at
+		void write(CharBuffer &buf) override {
+			if(!buf.overlaps(xp, yp, wd, ht)) return;
+			int x0, y0, x1, y1;
+			buf.region(x0, y0, x1, y1);
+			const unsigned int
+				c0 = x0 > xp ? x0 - xp : 0, c1 = x1 - xp < wd ? x1 - xp : wd,
+				r0 = y0 > yp ? y0 - yp : 0, r1 = y1 - yp < ht ? y1 - yp : ht;
+			for(unsigned int r=r0; r<r1; r++) {
+				if(glyphs[0] != 0) buf.hrun(xp + c0, yp + r, c1 - c0, glyphs[0]);
+				if(states == 2) {
+					liveRuns(cur[0].data() + (size_t)r * stride, c0, c1,
+					[&](const unsigned int a, const unsigned int b) {
+						buf.hrun(xp + a, yp + r, b - a, glyphs[1]);
+					});
+					continue;
+				}
+				// runs of cells in the same state
+				unsigned int a = c0;
+				unsigned char was = get(c0, r);
+				for(unsigned int x=c0 + 1; x<=c1; x++) {
+					const unsigned char now = x < c1 ? get(x, r) : 0;
+					if(x < c1 && now == was) continue;
+					if(was != 0 && glyphs[was] != 0) buf.hrun(xp + a, yp + r, x - a, glyphs[was]);
+					a = x; was = now;
+				}
+			}
+		}
+
+		Cell charAt(const unsigned short x, const unsigned short y) override {
+			const unsigned short gx = x - xp, gy = y - yp;
+			if(gx >= wd || gy >= ht) return 0;
+			return glyphs[get(gx, gy)];
+		}
+
+		bool inColl(const unsigned short x, const unsigned short y) override {
+			// unsigned underflow puts coordinates left or above of the grid out of it
+			const unsigned short gx = x - xp, gy = y - yp;
+			return gx < wd && gy < ht && (cur[0][(size_t)gy * stride + gx / 64] >> (gx % 64) & 1);
+		}
+
+		bool bounds(unsigned short &x, unsigned short &y,
+		unsigned short &w, unsigned short &h) override {
+			x = xp; y = yp; w = wd; h = ht;
+			return true;
+		}
+
+		const char* type() override { return "Automaton"; }
+		CharStruct* clone() override { return new Automaton(*this); }
+
+		void save(vector<uint8_t> &out) override {
+			saveBase(out);
+			putVarint(out, wd);
+			putVarint(out, ht);
+			putVarint(out, birth);
+			putVarint(out, survive);
+			putVarint(out, states);
+			putVarint(out, gen);
+			for(unsigned int i=0; i<glyphs.size(); i++) putVarint(out, glyphs[i]);
+			for(unsigned int p=0; p<cur.size(); p++)
+				for(size_t i=0; i<cur[p].size(); i++)
+					for(unsigned int b=0; b<64; b += 8) out.push_back(cur[p][i] >> b);
+		}
+
+		bool load(const uint8_t* &p, const uint8_t* end) override {
+			uint64_t w, h, b, s, c, g;
+			if(!loadBase(p, end) || !getVarint(p, end, w) || !getVarint(p, end, h) ||
+			!getVarint(p, end, b) || !getVarint(p, end, s) || !getVarint(p, end, c) ||
+			!getVarint(p, end, g) || c < 2 || c > 255) return false;
+			wd = w; ht = h;
+			birth = b; survive = s;
+			states = c;
+			gen = g;
+			bornSums.clear(); keptSums.clear();
+			for(unsigned int n=0; n<=8; n++) {
+				if(birth >> n & 1) bornSums.push_back(n);
+				if(survive >> n & 1) keptSums.push_back(n);
+			}
+			// each plane takes 8 bytes a word
+			const uint64_t words = (uint64_t)((wd + 63) / 64) * ht;
+			if(words * 8 * (1 + ageBits(c)) > (uint64_t)(end - p)) return false;
+			allocate();
+			glyphs.assign(c, 0);
+			for(unsigned int i=0; i<c; i++) {
+				uint64_t glyph;
+				if(!getVarint(p, end, glyph)) return false;
+				glyphs[i] = glyph;
+			}
+			if(words * 8 * cur.size() > (uint64_t)(end - p)) return false;
+			for(unsigned int pl=0; pl<cur.size(); pl++)
+				for(size_t i=0; i<cur[pl].size(); i++) {
+					uint64_t word = 0;
+					for(unsigned int bt=0; bt<64; bt += 8) word |= (uint64_t)*p++ << bt;
+					cur[pl][i] = word;
+				}
+			return true;
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		const unsigned short width() { return wd; }
+		const unsigned short height() { return ht; }
+		const unsigned int stateCt() { return states; }
+		// how many generations it has stepped
+		const unsigned long long generation() { return gen; }
+		// how many cells are alive
+		const unsigned long long population() {
+			unsigned long long n = 0;
+			for(size_t i=0; i<cur[0].size(); i++) n += __builtin_popcountll(cur[0][i]);
+			return n;
+		}
+
+	protected:
+		void assign(CharStruct &from) override { *this = (Automaton&)from; }
+};
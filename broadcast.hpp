@@ -0,0 +1,335 @@
+#pragma once
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "delta.hpp"
+using namespace std;
+
+// =========================================
+// Spectator broadcast
+// ----------------------------------------
+// A Broadcaster is a FrameSink that sends the
+// frames of a display to any number of
+// viewers over a Unix domain socket or a
+// localhost TCP port, in the same encoding
+// that recordings use (see delta.hpp).
+//
+//   Broadcaster cast("/tmp/game.sock", display.width(), display.height());
+//   display.addFrameSink(&cast);
+//
+// The frame thread only copies the delta
+// into a spare buffer, the same for one
+// viewer or a hundred. The broadcaster's own
+// thread encodes each frame once and every
+// viewer's queue points at that one copy.
+// A viewer joins at the next keyframe, and a
+// viewer that falls too far behind has its
+// queue dropped and picks up again at the
+// next keyframe instead of slowing anyone
+// else down.
+//
+// xviewer connects to a broadcast and shows
+// it in its own window.
+// =========================================
+
+// Opens a socket for an address, listening on it or connecting to it.
+// Addresses starting with '/' are Unix domain socket paths,
+// anything else is a TCP port on 127.0.0.1. Returns -1 on failure.
+inline int broadcastSocket(const string &address, const bool listening) {
+	int fd;
+	if(!address.empty() && address[0] == '/') {
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if(address.size() >= sizeof(addr.sun_path)) return -1;
+		strcpy(addr.sun_path, address.c_str());
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd == -1) return -1;
+		if(listening) unlink(address.c_str()); // left over from a crash
+		const int ok = listening
+			? ::bind(fd, (sockaddr*)&addr, sizeof(addr))
+			: connect(fd, (sockaddr*)&addr, sizeof(addr));
+		if(ok == -1) { ::close(fd); return -1; }
+	} else {
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(atoi(address.c_str()));
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if(fd == -1) return -1;
+		const int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		const int ok = listening
+			? ::bind(fd, (sockaddr*)&addr, sizeof(addr))
+			: connect(fd, (sockaddr*)&addr, sizeof(addr));
+		if(ok == -1) { ::close(fd); return -1; }
+	}
+	if(listening && listen(fd, 16) == -1) { ::close(fd); return -1; }
+	return fd;
+}
+
+class Broadcaster : public FrameSink {
+	typedef shared_ptr<const vector<uint8_t>> Chunk; // one encoded frame
+
+	// A connected viewer and the frames it hasn't been sent yet
+	struct Viewer {
+		int fd;
+		bool greeted; // whether it has been sent the stream header
+		bool synced; // whether it has been sent a keyframe to start from
+		deque<Chunk> out;
+		size_t sent; // bytes of out.front() already sent
+		size_t pending; // bytes in out not sent yet
+	};
+
+	string addr;
+	int listenFd;
+	int wakeFd[2]; // a pipe the frame thread pokes the sender thread with
+	unsigned short w, h;
+	uint64_t start; // time of the first frame
+	unsigned int keyEvery, sinceKey; // frames between keyframes
+	atomic<bool> needKey; // a viewer is waiting for a keyframe
+
+	// frames waiting to be encoded, and spare buffers to copy new ones into
+	vector<FrameDelta *> queue, spare;
+	unsigned int maxQueue;
+	mutex m;
+	atomic<bool> stopping;
+	thread sender;
+
+	// sender thread state
+	vector<Viewer> viewers;
+	Chunk header;
+	atomic<size_t> maxPending; // bytes a viewer can fall behind before it skips ahead
+
+	atomic<unsigned int> viewerCt;
+	atomic<unsigned long long> frameCt, skipCt, dropCt;
+
+	void closeViewer(const unsigned int i) {
+		::close(viewers[i].fd);
+		viewers.erase(viewers.begin() + i);
+		viewerCt = viewers.size();
+	}
+
+	void accept() {
+		int fd;
+		while((fd = ::accept(listenFd, NULL, NULL)) != -1) {
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			Viewer v;
+			v.fd = fd;
+			v.greeted = false;
+			v.synced = false;
+			v.sent = 0;
+			v.pending = 0;
+			viewers.push_back(v);
+			needKey = true;
+		}
+		viewerCt = viewers.size();
+	}
+
+	// Encodes a frame once and queues it for every viewer
+	void fanOut(const FrameDelta &d) {
+		vector<uint8_t>* bytes = new vector<uint8_t>();
+		encodeFrame(*bytes, d, d.time - start);
+		const Chunk chunk(bytes);
+		for(unsigned int i=0; i<viewers.size(); i++) {
+			Viewer &v = viewers[i];
+			if(v.synced && v.pending > maxPending) {
+				// too far behind, drop what hasn't started sending
+				// and wait for a keyframe like a new viewer
+				while(v.out.size() > (v.sent > 0 ? 1u : 0u)) {
+					v.pending -= v.out.back() -> size();
+					v.out.pop_back();
+				}
+				if(v.sent > 0) v.pending = v.out.front() -> size() - v.sent;
+				v.synced = false;
+				needKey = true;
+				skipCt++;
+			}
+			if(!v.synced) {
+				if(!d.key) continue;
+				// a new viewer gets the stream header first
+				if(!v.greeted) {
+					v.out.push_back(header);
+					v.pending += header -> size();
+					v.greeted = true;
+				}
+				v.synced = true;
+			}
+			v.out.push_back(chunk);
+			v.pending += chunk -> size();
+		}
+	}
+
+	// Sends what each viewer's socket will take without blocking
+	void flush() {
+		for(unsigned int i=0; i<viewers.size(); ) {
+			Viewer &v = viewers[i];
+			bool dead = false;
+			while(!v.out.empty()) {
+				const vector<uint8_t> &c = *v.out.front();
+				const ssize_t n = ::send(v.fd, c.data() + v.sent, c.size() - v.sent,
+					MSG_NOSIGNAL | MSG_DONTWAIT);
+				if(n < 0) {
+					dead = (errno != EAGAIN && errno != EWOULDBLOCK);
+					break;
+				}
+				v.sent += n;
+				v.pending -= n;
+				if(v.sent < c.size()) break;
+				v.out.pop_front();
+				v.sent = 0;
+			}
+			if(dead) closeViewer(i);
+			else i++;
+		}
+	}
+
+	// the sender thread, waits for frames, viewers and sockets with room
+	void serve() {
+		vector<FrameDelta *> batch;
+		vector<pollfd> fds;
+		while(!stopping) {
+			fds.clear();
+			fds.push_back(pollfd {wakeFd[0], POLLIN, 0});
+			fds.push_back(pollfd {listenFd, POLLIN, 0});
+			for(unsigned int i=0; i<viewers.size(); i++)
+				fds.push_back(pollfd {viewers[i].fd,
+					(short)(viewers[i].out.empty() ? 0 : POLLOUT), 0});
+			if(poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR) break;
+			if(fds[0].revents & POLLIN) {
+				char drain[64];
+				while(read(wakeFd[0], drain, sizeof(drain)) > 0) {}
+			}
+			// viewers that hung up
+			for(unsigned int i=viewers.size(); i-- > 0; )
+				if(fds[i + 2].revents & (POLLHUP | POLLERR)) closeViewer(i);
+			if(fds[1].revents & POLLIN) accept();
+
+			{
+				lock_guard<mutex> lock(m);
+				batch.swap(queue);
+			}
+			for(unsigned int i=0; i<batch.size(); i++)
+				fanOut(*batch[i]);
+			{
+				lock_guard<mutex> lock(m);
+				spare.insert(spare.end(), batch.begin(), batch.end());
+			}
+			batch.clear();
+			// ask again in case the keyframe asked for went out before a viewer joined
+			for(unsigned int i=0; i<viewers.size(); i++)
+				if(!viewers[i].synced) needKey = true;
+			flush();
+		}
+	}
+
+	void wake() {
+		const char c = 0;
+		if(write(wakeFd[1], &c, 1) < 0) {} // full means it is awake anyway
+	}
+
+	public:
+		// address - a Unix domain socket path starting with '/',
+		//   or a TCP port to listen on at 127.0.0.1
+		// width, height - the size of the display being broadcast
+		// keyframeEvery - frames between keyframes, more lets viewers
+		//   join and catch up sooner but costs more to send
+		Broadcaster(const string &address, const unsigned short width,
+		const unsigned short height, const unsigned int keyframeEvery = 120)
+		: needKey(false), stopping(false), viewerCt(0), frameCt(0), skipCt(0), dropCt(0) {
+			addr = address;
+			w = width; h = height;
+			start = 0;
+			keyEvery = keyframeEvery;
+			sinceKey = 0;
+			maxQueue = 256;
+			maxPending = 1 << 20;
+			vector<uint8_t>* head = new vector<uint8_t>();
+			encodeHeader(*head, w, h);
+			header = Chunk(head);
+			listenFd = broadcastSocket(address, true);
+			if(listenFd == -1) return;
+			prepareDeltaPool(queue, spare, maxQueue, w, h);
+			fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+			if(pipe(wakeFd) == -1) { ::close(listenFd); listenFd = -1; return; }
+			fcntl(wakeFd[0], F_SETFL, O_NONBLOCK);
+			fcntl(wakeFd[1], F_SETFL, O_NONBLOCK);
+			sender = thread(&Broadcaster::serve, this);
+		}
+
+		~Broadcaster() {
+			if(listenFd == -1) return;
+			stopping = true;
+			wake();
+			sender.join();
+			for(unsigned int i=0; i<viewers.size(); i++) ::close(viewers[i].fd);
+			::close(listenFd);
+			::close(wakeFd[0]);
+			::close(wakeFd[1]);
+			if(addr[0] == '/') unlink(addr.c_str());
+			for(unsigned int i=0; i<queue.size(); i++) delete queue[i];
+			for(unsigned int i=0; i<spare.size(); i++) delete spare[i];
+		}
+
+		// Queues a copy of the frame for the sender thread,
+		// the same work however many viewers there are
+		void frame(const FrameDelta &delta) override {
+			if(listenFd == -1 || viewerCt == 0) return;
+			if(start == 0) start = delta.time;
+			{
+				lock_guard<mutex> lock(m);
+				if(queue.size() >= maxQueue) {
+					// the sender can't keep up, so every viewer would miss
+					// this delta, the next keyframe repairs the gap
+					dropCt++;
+					needKey = true;
+					return;
+				}
+				FrameDelta* buf;
+				if(spare.empty()) buf = new FrameDelta();
+				else { buf = spare.back(); spare.pop_back(); }
+				*buf = delta;
+				queue.push_back(buf);
+			}
+			wake();
+			frameCt++;
+			if(delta.key) { sinceKey = 0; needKey = false; }
+			else sinceKey++;
+		}
+
+		// How many bytes a viewer can fall behind before it is skipped
+		// ahead to the next keyframe, 1 MB by default
+		void setMaxLag(const size_t bytes) { maxPending = bytes; }
+
+		bool wantsKeyframe() override {
+			return listenFd != -1 && (needKey || (viewerCt > 0 && sinceKey >= keyEvery));
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		// whether the address could be listened on
+		bool isOpen() { return listenFd != -1; }
+		const unsigned int viewerCount() { return viewerCt; }
+		const unsigned long long frames() { return frameCt; }
+		// how many times a viewer fell behind and skipped to a keyframe
+		const unsigned long long skips() { return skipCt; }
+		// frames dropped because the sender thread fell behind
+		const unsigned long long dropped() { return dropCt; }
+};
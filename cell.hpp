@@ -0,0 +1,101 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+using namespace std;
+
+// =========================================
+// Packed display cells
+// ----------------------------------------
+// A Cell is one character on the display
+// along with its colors and attributes,
+// packed into a single 64 bit word so that
+// comparing, copying and filling cells is
+// one integer operation per cell.
+//
+//  bits  0-20  Unicode codepoint
+//  bits 21-23  unused
+//  bits 24-31  attributes (CELL_BOLD, ...)
+//  bits 32-39  foreground terminal palette index
+//  bits 40-47  background terminal palette index
+//  bit  48     foreground color is set
+//  bit  49     background color is set
+//  bits 50-63  unused, always 0
+//
+// A cell whose color is not set uses the
+// terminal's default color, so a plain
+// character such as 'A' is already a Cell.
+// =========================================
+
+typedef uint64_t Cell;
+
+// Attribute bits
+const Cell CELL_BOLD = (Cell)0x01 << 24;
+const Cell CELL_DIM = (Cell)0x02 << 24;
+const Cell CELL_UNDERLINE = (Cell)0x04 << 24;
+const Cell CELL_REVERSE = (Cell)0x08 << 24;
+const Cell CELL_BLINK = (Cell)0x10 << 24;
+
+// Field masks
+const Cell CELL_CHAR = 0x1FFFFF;
+const Cell CELL_ATTRS = (Cell)0xFF << 24;
+const Cell CELL_FG = (Cell)0xFF << 32;
+const Cell CELL_BG = (Cell)0xFF << 40;
+const Cell CELL_FG_SET = (Cell)1 << 48;
+const Cell CELL_BG_SET = (Cell)1 << 49;
+
+// A blank cell, what the display is cleared to
+const Cell CELL_BLANK = ' ';
+
+// A character in the terminal's default colors
+constexpr Cell cellOf(const uint32_t codepoint) {
+	return codepoint & CELL_CHAR;
+}
+
+// A character with a foreground color from the terminal's palette
+constexpr Cell cellOf(const uint32_t codepoint, const unsigned char fg) {
+	return (codepoint & CELL_CHAR) | ((Cell)fg << 32) | CELL_FG_SET;
+}
+
+// A character with foreground and background colors and attribute bits
+constexpr Cell cellOf(const uint32_t codepoint, const unsigned char fg,
+const unsigned char bg, const Cell attrs = 0) {
+	return (codepoint & CELL_CHAR) | (attrs & CELL_ATTRS)
+		| ((Cell)fg << 32) | ((Cell)bg << 40) | CELL_FG_SET | CELL_BG_SET;
+}
+
+// ======
+// Fields
+// ======
+
+constexpr uint32_t cellChar(const Cell c) { return c & CELL_CHAR; }
+constexpr Cell cellAttrs(const Cell c) { return c & CELL_ATTRS; }
+constexpr unsigned char cellFg(const Cell c) { return (c >> 32) & 0xFF; }
+constexpr unsigned char cellBg(const Cell c) { return (c >> 40) & 0xFF; }
+constexpr bool cellHasFg(const Cell c) { return (c & CELL_FG_SET) != 0; }
+constexpr bool cellHasBg(const Cell c) { return (c & CELL_BG_SET) != 0; }
+
+// Everything but the character, two cells with equal styles
+// can be written to the terminal in the same run
+constexpr Cell cellStyle(const Cell c) { return c & ~CELL_CHAR; }
+
+// The same cell with a different character
+constexpr Cell cellWithChar(const Cell c, const uint32_t codepoint) {
+	return cellStyle(c) | (codepoint & CELL_CHAR);
+}
+
+// The character as a single byte, or '?' if it does not fit in one
+constexpr unsigned char cellByte(const Cell c) {
+	return cellChar(c) < 256 ? cellChar(c) : '?';
+}
+
+// Decodes the UTF-8 character at s[i] of an n byte string and moves i past it
+constexpr uint32_t utf8Decode(const char* s, const size_t n, size_t &i) {
+	const unsigned char c = s[i++];
+	if(c < 0x80) return c;
+	// number of continuation bytes from the lead byte
+	const int more = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+	uint32_t cp = c & (0x3F >> more);
+	for(int k=0; k<more && i<n; k++)
+		cp = (cp << 6) | (s[i++] & 0x3F);
+	return cp;
+}
@@ -0,0 +1,246 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "cell.hpp"
+#include "kernels.hpp"
+using namespace std;
+
+// =========================================
+// Frame deltas
+// ----------------------------------------
+// What a display sent to the terminal on one
+// update(): the runs of cells that changed,
+// and the scroll it did first, if any. Every
+// so often a keyframe holds the whole screen
+// instead, so a reader can start from it
+// without everything that came before.
+//
+// A CharDisplay hands a FrameDelta to each of
+// its FrameSinks after every update(). The
+// encoding below is what recordings and
+// broadcasts store and send:
+//
+//   stream: "AEFD" version width height frames...
+//   frame:  length flags time scroll runCt runs...
+//   run:    x y n cells...
+//   cell:   (char << 1 | newStyle) [style >> 24]
+//
+// Numbers are LEB128 varints, scroll is
+// zigzag encoded, and a cell only carries its
+// style when it differs from the last cell's.
+// =========================================
+
+const uint8_t DELTA_VERSION = 1;
+
+// =======
+// Varints
+// =======
+
+inline void putVarint(vector<uint8_t> &out, uint64_t v) {
+	while(v >= 0x80) {
+		out.push_back((uint8_t)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((uint8_t)v);
+}
+
+// Reads a varint at p and moves p past it. Returns false if it runs past end.
+inline bool getVarint(const uint8_t* &p, const uint8_t* end, uint64_t &v) {
+	v = 0;
+	for(int shift=0; p < end && shift < 64; shift += 7) {
+		const uint8_t b = *p++;
+		v |= (uint64_t)(b & 0x7F) << shift;
+		if(!(b & 0x80)) return true;
+	}
+	return false;
+}
+
+// microseconds on the steady clock, what frame times are measured in
+inline uint64_t deltaClock() {
+	return chrono::duration_cast<chrono::microseconds>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// ===========
+// Frame delta
+// ===========
+
+// The changes of one frame, in display coordinates
+struct FrameDelta {
+	uint64_t time; // microseconds, see deltaClock()
+	int scroll; // rows the screen moved down before the runs, negative for up
+	bool key; // whether the runs cover the whole screen
+	vector<unsigned short> runs; // x, y, n of every run
+	vector<Cell> cells; // the cells of every run, one after another
+
+	FrameDelta() { time = 0; scroll = 0; key = false; }
+
+	// empties the delta, keeping its memory
+	void clear() {
+		time = 0; scroll = 0; key = false;
+		runs.clear();
+		cells.clear();
+	}
+
+	void addRun(const unsigned short x, const unsigned short y,
+	const Cell* run, const unsigned short n) {
+		runs.push_back(x); runs.push_back(y); runs.push_back(n);
+		cells.insert(cells.end(), run, run + n);
+	}
+
+	// makes room for a whole w by h screen, so a keyframe doesn't allocate
+	void reserve(const unsigned short w, const unsigned short h) {
+		runs.reserve(3 * h);
+		cells.reserve((size_t)w * h);
+	}
+
+	// whether the frame changed anything
+	bool empty() const { return runs.empty() && scroll == 0 && !key; }
+};
+
+// Something that is told what every frame of a display changed, such as
+// a recorder. frame() is called on the thread that updates the display,
+// so it should copy what it needs and return.
+class FrameSink {
+	public:
+		virtual ~FrameSink() {}
+		// the changes of a frame, the delta is reused after this returns
+		virtual void frame(const FrameDelta &delta) = 0;
+		// whether the next frame should be a keyframe
+		virtual bool wantsKeyframe() { return false; }
+};
+
+// Sets up the frame queue and spare buffers of a sink that copies frames
+// for another thread. Room for maxQueue of each, and a few spares of a
+// whole w by h screen up front, so the first frames don't allocate them.
+inline void prepareDeltaPool(vector<FrameDelta *> &queue, vector<FrameDelta *> &spare,
+const unsigned int maxQueue, const unsigned short w, const unsigned short h) {
+	queue.reserve(maxQueue);
+	spare.reserve(maxQueue);
+	for(unsigned int i=0; i<4; i++) {
+		spare.push_back(new FrameDelta());
+		spare.back() -> reserve(w, h);
+	}
+}
+
+// Applies a delta to a w by h screen stored row by row
+inline void applyFrame(const FrameDelta &d, Cell* screen,
+const unsigned short w, const unsigned short h) {
+	if(d.scroll != 0) {
+		const int n = d.scroll;
+		if(n >= h || -n >= h) cellFill(screen, w * h, CELL_BLANK);
+		else if(n > 0) {
+			memmove(screen + n * w, screen, (h - n) * w * sizeof(Cell));
+			cellFill(screen, n * w, CELL_BLANK);
+		} else {
+			memmove(screen, screen - n * w, (h + n) * w * sizeof(Cell));
+			cellFill(screen + (h + n) * w, -n * w, CELL_BLANK);
+		}
+	}
+	const Cell* c = d.cells.data();
+	for(unsigned int i=0; i + 2 < d.runs.size(); i += 3) {
+		const unsigned short x = d.runs[i], y = d.runs[i+1], n = d.runs[i+2];
+		if(y < h && x < w)
+			cellCopy(screen + y * w + x, c, x + n > w ? w - x : n);
+		c += n;
+	}
+}
+
+// ========
+// Encoding
+// ========
+
+// The start of a stream, before its first frame
+inline void encodeHeader(vector<uint8_t> &out,
+const unsigned short w, const unsigned short h) {
+	const uint8_t magic[4] = {'A', 'E', 'F', 'D'};
+	out.insert(out.end(), magic, magic + 4);
+	out.push_back(DELTA_VERSION);
+	putVarint(out, w);
+	putVarint(out, h);
+}
+
+// Reads a stream's header and moves p past it
+inline bool decodeHeader(const uint8_t* &p, const uint8_t* end,
+unsigned short &w, unsigned short &h) {
+	if(end - p < 5 || memcmp(p, "AEFD", 4) != 0 || p[4] != DELTA_VERSION)
+		return false;
+	p += 5;
+	uint64_t vw, vh;
+	if(!getVarint(p, end, vw) || !getVarint(p, end, vh)) return false;
+	w = vw; h = vh;
+	return true;
+}
+
+// Appends a frame, length first so readers can skip it without decoding.
+// time is written as given, streams usually make it relative to their start.
+inline void encodeFrame(vector<uint8_t> &out, const FrameDelta &d, const uint64_t time) {
+	const size_t at = out.size();
+	out.push_back(d.key ? 1 : 0);
+	putVarint(out, time);
+	putVarint(out, d.scroll >= 0 ? (uint64_t)d.scroll << 1 : ((uint64_t)-d.scroll << 1) - 1);
+	putVarint(out, d.runs.size() / 3);
+	Cell style = 0;
+	const Cell* c = d.cells.data();
+	for(unsigned int i=0; i + 2 < d.runs.size(); i += 3) {
+		putVarint(out, d.runs[i]);
+		putVarint(out, d.runs[i+1]);
+		putVarint(out, d.runs[i+2]);
+		for(unsigned short k=0; k<d.runs[i+2]; k++, c++) {
+			const Cell s = cellStyle(*c);
+			putVarint(out, (uint64_t)cellChar(*c) << 1 | (s != style));
+			if(s != style) putVarint(out, s >> 24);
+			style = s;
+		}
+	}
+	// the body's length goes in front of it
+	uint8_t len[10];
+	int lenCt = 0;
+	for(uint64_t v = out.size() - at; ; v >>= 7) {
+		len[lenCt++] = (uint8_t)(v >= 0x80 ? (v | 0x80) : v);
+		if(v < 0x80) break;
+	}
+	out.insert(out.begin() + at, len, len + lenCt);
+}
+
+// Reads the length of the frame at p and moves p to its body.
+// Returns false if the whole frame isn't there yet.
+inline bool frameLength(const uint8_t* &p, const uint8_t* end, size_t &len) {
+	uint64_t v;
+	if(!getVarint(p, end, v) || v > (uint64_t)(end - p)) return false;
+	len = v;
+	return true;
+}
+
+// Decodes a frame body of len bytes, as found by frameLength()
+inline bool decodeFrame(const uint8_t* p, const size_t len, FrameDelta &d) {
+	const uint8_t* end = p + len;
+	d.clear();
+	if(p >= end) return false;
+	d.key = *p++ & 1;
+	uint64_t v, runCt;
+	if(!getVarint(p, end, v)) return false;
+	d.time = v;
+	if(!getVarint(p, end, v)) return false;
+	d.scroll = (v & 1) ? -(int)((v + 1) >> 1) : (int)(v >> 1);
+	if(!getVarint(p, end, runCt)) return false;
+	Cell style = 0;
+	for(uint64_t r=0; r<runCt; r++) {
+		uint64_t x, y, n;
+		if(!getVarint(p, end, x) || !getVarint(p, end, y) || !getVarint(p, end, n))
+			return false;
+		d.runs.push_back(x); d.runs.push_back(y); d.runs.push_back(n);
+		for(uint64_t k=0; k<n; k++) {
+			if(!getVarint(p, end, v)) return false;
+			if(v & 1) {
+				uint64_t s;
+				if(!getVarint(p, end, s)) return false;
+				style = s << 24;
+			}
+			d.cells.push_back(cellWithChar(style, v >> 1));
+		}
+	}
+	return true;
+}
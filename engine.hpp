@@ -1,7 +1,14 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <iostream>
 #include <string>
 #include <vector>
 #include "ascii.hpp"
+#include "cell.hpp"
+#include "delta.hpp"
+#include "kernels.hpp"
 using namespace std;
 // Version of this program
 #define ASCIIDISPLAY_VERSION "ALPHA_0.0";
@@ -33,6 +40,11 @@ class CharColorB {
 			g = grn;
 			b = blu;
 		}
+
+		// getter methods
+		const unsigned char red() const { return r; }
+		const unsigned char grn() const { return g; }
+		const unsigned char blu() const { return b; }
 };
 
 // A color that stores the RGB values as a short each.
@@ -45,6 +57,329 @@ class CharColor2B {
 			g = grn;
 			b = blu;
 		}
+
+		// getter methods
+		const unsigned short red() const { return r; }
+		const unsigned short grn() const { return g; }
+		const unsigned short blu() const { return b; }
+};
+
+// Which cells of a world region can be seen, one bit per cell.
+// A CharBuffer given a mask only writes struct cells that are visible,
+// so hidden cells are skipped rather than drawn and covered up after.
+// Cells outside of the region count as hidden. See fov.hpp.
+class VisMask {
+	unsigned short x0, y0, wd, ht; // world region covered
+	unsigned short words; // 64 bit words per row
+	vector<uint64_t> bits;
+
+	// the index of the first bit from p to end that is val, or end
+	unsigned int scan(const uint64_t* r, unsigned int p, const unsigned int end,
+	const bool val) const {
+		while(p < end) {
+			uint64_t word = r[p / 64] >> (p % 64);
+			if(!val) word = ~word;
+			if(p % 64 != 0) word &= ~(uint64_t)0 >> (p % 64);
+			if(word != 0) {
+				p += __builtin_ctzll(word);
+				return p < end ? p : end;
+			}
+			p = (p / 64 + 1) * 64;
+		}
+		return end;
+	}
+
+	public:
+		VisMask() { x0 = 0; y0 = 0; wd = 0; ht = 0; words = 0; }
+
+		VisMask(const unsigned short x, const unsigned short y,
+		const unsigned short width, const unsigned short height) {
+			resize(x, y, width, height);
+		}
+
+		// Moves the mask to cover another region, hiding every cell
+		void resize(const unsigned short x, const unsigned short y,
+		const unsigned short width, const unsigned short height) {
+			x0 = x; y0 = y;
+			wd = width; ht = height;
+			words = (wd + 63) / 64;
+			bits.assign(words * ht, 0);
+		}
+
+		// hides every cell
+		void clear() { bits.assign(bits.size(), 0); }
+
+		// shows a world cell, cells outside the region are ignored
+		void set(const unsigned short x, const unsigned short y) {
+			const unsigned short mx = x - x0, my = y - y0;
+			if(mx >= wd || my >= ht) return;
+			bits[my * words + mx / 64] |= (uint64_t)1 << (mx % 64);
+		}
+
+		// shows every cell that the other mask shows, the regions must match
+		void merge(const VisMask &other) {
+			if(other.bits.size() != bits.size()) return;
+			for(unsigned int i=0; i<bits.size(); i++) bits[i] |= other.bits[i];
+		}
+
+		// whether a world cell is visible
+		bool visible(const unsigned short x, const unsigned short y) const {
+			const unsigned short mx = x - x0, my = y - y0;
+			if(mx >= wd || my >= ht) return false;
+			return bits[my * words + mx / 64] >> (mx % 64) & 1;
+		}
+
+		// Calls fn(at, len) for every run of visible cells among the n cells
+		// going right from world x, y, with at counted from x
+		template<class F>
+		void runs(const unsigned short x, const unsigned short y, const int n, F &&fn) const {
+			const unsigned short my = y - y0;
+			if(my >= ht) return;
+			const int lx = (int)x - x0; // mask column of the first cell
+			if(lx + n <= 0 || lx >= wd) return;
+			const unsigned int a = lx < 0 ? 0 : lx,
+				b = lx + n > wd ? wd : lx + n;
+			const uint64_t* r = bits.data() + my * words;
+			unsigned int p = a;
+			while(p < b) {
+				const unsigned int on = scan(r, p, b, true);
+				if(on == b) break;
+				const unsigned int off = scan(r, on, b, false);
+				fn((int)on - lx, (int)(off - on));
+				p = off;
+			}
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		const unsigned short posX() const { return x0; }
+		const unsigned short posY() const { return y0; }
+		const unsigned short width() const { return wd; }
+		const unsigned short height() const { return ht; }
+};
+
+// A view of a CharDisplay's character buffer that CharStructs write through.
+//
+// Structs hand it world coordinates. The buffer applies the display's
+// scroll offsets, clips to the region currently being rasterized and
+// wraps into the display's ring storage, so a struct never needs to know
+// where the display's origin currently is or which strip is being redrawn.
+//
+// Display coordinates are the world coordinates plus the scroll offsets
+// read as a signed short, so anything scrolled off the top or left of
+// the display lands below 0 and is clipped like anything off the bottom.
+class CharBuffer {
+	Cell* chars; // ring storage, row-major, w*h
+	unsigned short w, h; // ring dimensions
+	unsigned short ox, oy; // storage coordinates of display cell 0, 0
+	unsigned short xs, ys; // scroll offsets added to world coordinates
+	int cx0, cy0, cx1, cy1; // clip rectangle in display coordinates
+	int lo, hi; // lowest and highest display rows written to
+	const VisMask* vis; // cells that may be written, NULL for all of them
+	unsigned short* ids; // who wrote each cell, laid out like chars, or NULL
+	unsigned short owner; // what is written to ids
+
+	// world to display coordinates
+	int dispX(const unsigned short x) { return (short)(unsigned short)(x + xs); }
+	int dispY(const unsigned short y) { return (short)(unsigned short)(y + ys); }
+
+	// pointer to the storage row holding display row y
+	Cell* row(const int y) {
+		int r = oy + y;
+		if(r >= h) r -= h;
+		return chars + r * w;
+	}
+
+	// marks a display row as written to
+	void touch(const int y0, const int y1) {
+		if(y0 < lo) lo = y0;
+		if(y1 > hi) hi = y1;
+	}
+
+	// Sets the owner of n cells of display row y from display column x
+	void ownRaw(const int x, const int y, const int n) {
+		int r = oy + y;
+		if(r >= h) r -= h;
+		unsigned short* o = ids + r * w;
+		int s = ox + x;
+		if(s >= w) s -= w;
+		const int first = (s + n > w) ? w - s : n;
+		fill_n(o + s, first, owner);
+		if(first < n) fill_n(o, n - first, owner);
+	}
+
+	// Fills n cells of display row y from display column x, unclipped.
+	// A run can wrap around the right edge of the ring at most once.
+	void fillRaw(const int x, const int y, const int n, const Cell c) {
+		Cell* r = row(y);
+		int s = ox + x;
+		if(s >= w) s -= w;
+		const int first = (s + n > w) ? w - s : n;
+		cellFill(r + s, first, c);
+		if(first < n) cellFill(r, n - first, c);
+		if(ids != NULL) ownRaw(x, y, n);
+	}
+
+	// Copies n cells to display row y from display column x, unclipped
+	void copyRaw(const int x, const int y, const Cell* cells, const int n) {
+		Cell* r = row(y);
+		int s = ox + x;
+		if(s >= w) s -= w;
+		const int first = (s + n > w) ? w - s : n;
+		cellCopy(r + s, cells, first);
+		if(first < n) cellCopy(r, cells + first, n - first);
+		if(ids != NULL) ownRaw(x, y, n);
+	}
+
+	public:
+		CharBuffer(Cell* storage,
+		const unsigned short width, const unsigned short height,
+		const unsigned short xOrigin, const unsigned short yOrigin,
+		const unsigned short xScroll, const unsigned short yScroll,
+		const int x0, const int y0, const int x1, const int y1) {
+			chars = storage;
+			w = width; h = height;
+			ox = xOrigin; oy = yOrigin;
+			xs = xScroll; ys = yScroll;
+			cx0 = x0 < 0 ? 0 : x0;
+			cy0 = y0 < 0 ? 0 : y0;
+			cx1 = x1 > w ? w : x1;
+			cy1 = y1 > h ? h : y1;
+			lo = h; hi = -1;
+			vis = NULL;
+			ids = NULL;
+			owner = 0;
+		}
+
+		// Only writes the cells a mask shows from now on, NULL to write all
+		void setMask(const VisMask* mask) { vis = mask; }
+
+		// Records who writes each cell in storage laid out like the cells,
+		// NULL to not record it. Everything written is owned by the last
+		// owner set, 0 for nobody.
+		void setIds(unsigned short* storage) { ids = storage; }
+		void setOwner(const unsigned short id) { owner = id; }
+
+		// =====================
+		// Display coordinate ops
+		// =====================
+
+		// Fills display cells [x0, x1) on display row y, clipped.
+		void spanAt(int x0, int x1, const int y, const Cell c) {
+			if(y < cy0 || y >= cy1) return;
+			if(x0 < cx0) x0 = cx0;
+			if(x1 > cx1) x1 = cx1;
+			if(x0 >= x1) return;
+			if(vis == NULL) fillRaw(x0, y, x1 - x0, c);
+			else vis -> runs(x0 - xs, y - ys, x1 - x0, [&](const int at, const int n) {
+				fillRaw(x0 + at, y, n, c);
+			});
+			touch(y, y);
+		}
+
+		// Copies n cells to display row y starting at display column x, clipped.
+		void copyAt(int x, const int y, const Cell* cells, int n) {
+			if(y < cy0 || y >= cy1) return;
+			if(x < cx0) { cells += cx0 - x; n -= cx0 - x; x = cx0; }
+			if(x + n > cx1) n = cx1 - x;
+			if(n <= 0) return;
+			if(vis == NULL) copyRaw(x, y, cells, n);
+			else vis -> runs(x - xs, y - ys, n, [&](const int at, const int len) {
+				copyRaw(x + at, y, cells + at, len);
+			});
+			touch(y, y);
+		}
+
+		// Fills the display rectangle [x0, x1) x [y0, y1), clipped.
+		void rectAt(const int x0, const int y0, const int x1, const int y1,
+		const Cell c) {
+			const int ya = y0 < cy0 ? cy0 : y0, yb = y1 > cy1 ? cy1 : y1;
+			for(int y=ya; y<yb; y++)
+				spanAt(x0, x1, y, c);
+		}
+
+		// =======================
+		// World coordinate writes
+		// =======================
+
+		// A single character
+		void put(const unsigned short x, const unsigned short y, const Cell c) {
+			const int dx = dispX(x);
+			spanAt(dx, dx + 1, dispY(y), c);
+		}
+
+		// A horizontal run of len characters going right from x, y
+		void hrun(const unsigned short x, const unsigned short y,
+		const unsigned short len, const Cell c) {
+			const int dx = dispX(x);
+			spanAt(dx, dx + len, dispY(y), c);
+		}
+
+		// A vertical run of len characters going down from x, y
+		void vrun(const unsigned short x, const unsigned short y,
+		const unsigned short len, const Cell c) {
+			const int dx = dispX(x), dy = dispY(y);
+			rectAt(dx, dy, dx + 1, dy + len, c);
+		}
+
+		// A run of n premade cells going right from x, y
+		void cells(const unsigned short x, const unsigned short y,
+		const Cell* run, const unsigned short n) {
+			copyAt(dispX(x), dispY(y), run, n);
+		}
+
+		// n single characters, c[i] at x[i], y[i], in one pass. For
+		// thousands of scattered points where put() per point adds up.
+		void scatter(const unsigned short* x, const unsigned short* y,
+		const Cell* c, const size_t n) {
+			int top = cy1, bottom = cy0 - 1;
+			for(size_t i=0; i<n; i++) {
+				const int dx = dispX(x[i]), dy = dispY(y[i]);
+				if(dx < cx0 || dx >= cx1 || dy < cy0 || dy >= cy1) continue;
+				if(vis != NULL && !vis -> visible(x[i], y[i])) continue;
+				int r = oy + dy, s = ox + dx;
+				if(r >= h) r -= h;
+				if(s >= w) s -= w;
+				chars[r * w + s] = c[i];
+				if(ids != NULL) ids[r * w + s] = owner;
+				if(dy < top) top = dy;
+				if(dy > bottom) bottom = dy;
+			}
+			if(top <= bottom) touch(top, bottom);
+		}
+
+		// A filled wd by ht rectangle with its top left corner at x, y
+		void fill(const unsigned short x, const unsigned short y,
+		const unsigned short wd, const unsigned short ht, const Cell c) {
+			const int dx = dispX(x), dy = dispY(y);
+			rectAt(dx, dy, dx + wd, dy + ht, c);
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		// Whether any of a wd by ht world rectangle at x, y is inside the
+		// region being written, so big structs can skip what can't show
+		bool overlaps(const unsigned short x, const unsigned short y,
+		const unsigned short wd, const unsigned short ht) {
+			const int dx = dispX(x), dy = dispY(y);
+			return dx < cx1 && dy < cy1 && dx + wd > cx0 && dy + ht > cy0;
+		}
+
+		// The world rectangle [x0, x1) x [y0, y1) being written, so a big
+		// struct can work out only the part of itself that can show
+		void region(int &x0, int &y0, int &x1, int &y1) {
+			x0 = cx0 - (short)xs; x1 = cx1 - (short)xs;
+			y0 = cy0 - (short)ys; y1 = cy1 - (short)ys;
+		}
+
+		// the first and last display rows that were written to,
+		// lowRow() > highRow() if nothing has been written yet
+		const int lowRow() { return lo; }
+		const int highRow() { return hi; }
 };
 
 // A data structure that contains information on
@@ -57,16 +392,60 @@ class CharStruct {
 		// This is intended to be used with hexadecimal digits.
 		unsigned int collCode;
 		unsigned short xp, yp;
+		// stamp of the last time the struct moved or its collision changed,
+		// subclasses that change their collision bounds should update it
+		unsigned long long rev;
+		// stamp of the last change of any kind, such as to how it looks
+		unsigned long long ed;
+		unsigned long long sid; // which struct this is, copies keep it
+
+		// Marks a change that isn't a move or a collision change
+		void touch() { ed = tick(); }
+
+		// Sets the struct to be the same as a copy of it of the same type
+		virtual void assign(CharStruct &from) {}
+
+		// What every struct saves: its collision code and position
+		void saveBase(vector<uint8_t> &out) {
+			putVarint(out, collCode);
+			putVarint(out, xp);
+			putVarint(out, yp);
+		}
+		bool loadBase(const uint8_t* &p, const uint8_t* end) {
+			uint64_t code, x, y;
+			if(!getVarint(p, end, code) || !getVarint(p, end, x) || !getVarint(p, end, y))
+				return false;
+			collCode = code; xp = x; yp = y;
+			rev = tick(); ed = rev;
+			return true;
+		}
+
+		// the last stamp that any struct changed its collision code at
+		static atomic<unsigned long long>& recodeStamp() {
+			static atomic<unsigned long long> stamp(0);
+			return stamp;
+		}
 	public:
 		CharStruct() {
 			collCode = 0;
 			xp = 0; yp = 0;
+			rev = 0; ed = 0;
+			sid = tick();
 		}
 
 		CharStruct(const unsigned int collision, 
 		const unsigned short xPos, const unsigned short yPos) {
 			collCode = collision;
 			xp = xPos; yp = yPos;
+			rev = 0; ed = 0;
+			sid = tick();
+		}
+
+		// A clock shared by every struct and display, so that change stamps
+		// can be compared to each other. Every call returns a later stamp.
+		static unsigned long long tick() {
+			static atomic<unsigned long long> clock(0);
+			return ++clock;
 		}
 
 		virtual ~CharStruct() {};
@@ -76,36 +455,65 @@ class CharStruct {
 
 		// draw the structure on the ASCIIWindow screen 
 		virtual void draw(ASCIIWindow &win, const unsigned short xo, const unsigned short yo) {}
-		// write the structure to a char array
-		virtual void write(unsigned char** chars, 
-		const unsigned short xo, const unsigned short yo,
-		const unsigned short xMax, const unsigned short yMax) {}
+		// write the structure to a display's char buffer
+		virtual void write(CharBuffer &buf) {}
 		// what character is at a certain position, or ' ' if there is none
-		virtual unsigned char charAt(const unsigned short x, const unsigned short y) 
+		virtual Cell charAt(const unsigned short x, const unsigned short y) 
 		{ return 0; } // null default
 		// whether a given coordinate intersects with the structure's collision boundaries
 		virtual bool inColl(const unsigned short x, const unsigned short y) { return false; }
+		// the rectangle that the collision boundaries are inside of,
+		// or false if the struct can't tell and could be anywhere
+		virtual bool bounds(unsigned short &x, unsigned short &y,
+		unsigned short &w, unsigned short &h) { return false; }
 		// This should be the exact name of the class
-		virtual const string type() { return "CharStruct"; } 
+		virtual const char* type() { return "CharStruct"; }
+		// A copy that holds copies of everything the struct holds, with the
+		// same id, or NULL if the struct can't be copied. See snapshot.hpp
+		virtual CharStruct* clone() { return NULL; }
+		// Writes what the struct holds, for a save. load() reads it back
+		// into a struct of the same type, and returns false if it is bad
+		virtual void save(vector<uint8_t> &out) { saveBase(out); }
+		virtual bool load(const uint8_t* &p, const uint8_t* end) { return loadBase(p, end); }
 
 		// ===================
 		// Getters and setters
 		// ===================
 		
 		// collision code
-		void setCollisionCode(const unsigned int code)
-		{ collCode =  code; }
+		void setCollisionCode(const unsigned int code) {
+			collCode =  code;
+			rev = tick();
+			recodeStamp() = rev;
+		}
 		const unsigned int collisionCode() { return collCode; }
 		
 		// set position, returns false if no change
 		bool setX(const unsigned short x) {
 			if(x == xp) return false;
-			xp = x; return true; 
+			xp = x; rev = tick(); return true; 
 		}
 		bool setY(const unsigned short y) { 
 			if(y == yp) return false;
-			yp = y; return true;
+			yp = y; rev = tick(); return true;
+		}
+		// when the struct last moved or changed its collision
+		virtual const unsigned long long changed() { return rev; }
+		// when the struct last changed in any way
+		virtual const unsigned long long edited() { return ed > rev ? ed : rev; }
+		// which struct this is, unique to it and the copies of it
+		const unsigned long long id() { return sid; }
+
+		// Sets the struct to be the same as a copy of it taken earlier,
+		// as a change, so anything that tracks the struct looks again
+		void restoreFrom(CharStruct &copy) {
+			const unsigned int code = collCode;
+			assign(copy);
+			rev = tick(); ed = rev;
+			if(collCode != code) recodeStamp() = rev;
 		}
+		// when any struct last changed its collision code
+		static const unsigned long long recoded() { return recodeStamp(); }
 		// x and y positions
 		const unsigned short posX() { return xp; }
 		const unsigned short posY() { return yp; }
@@ -115,7 +523,7 @@ class CharStruct {
 // Useful for single tile obstructions, doorways, events, etc.
 class CollChar : public CharStruct {
 	protected:
-		unsigned char chr;
+		Cell chr;
 	public:
 		CollChar() : CharStruct() {
 			chr = '0';
@@ -143,19 +551,14 @@ class CollChar : public CharStruct {
 				x = (xp + xo),
 				y = (yp + yo);
 			if(win.inBounds(x, y))
-				win.writeAtNR(x, y, chr);
+				win.writeCellsNR(x, y, &chr, 1);
 		}
 
-		void write(unsigned char** chars, const unsigned short xo, const unsigned short yo,
-		const unsigned short xMax, const unsigned short yMax) override {
-			const unsigned short
-				x = (xp + xo),
-				y = (yp + yo);
-			if(x < xMax && y < yMax)
-				chars[x][y] = chr;
+		void write(CharBuffer &buf) override {
+			buf.put(xp, yp, chr);
 		}
 
-		unsigned char charAt(const unsigned short x, const unsigned short y) override {
+		Cell charAt(const unsigned short x, const unsigned short y) override {
 			if(inColl(x, y)) return chr;
 			else return 0; // null char if none
 		}
@@ -165,7 +568,26 @@ class CollChar : public CharStruct {
 			return (x == xp && y == yp);
 		}
 
-		const string type() override { return "CollChar"; }
+		bool bounds(unsigned short &x, unsigned short &y,
+		unsigned short &w, unsigned short &h) override {
+			x = xp; y = yp; w = 1; h = 1;
+			return true;
+		}
+
+		const char* type() override { return "CollChar"; }
+		CharStruct* clone() override { return new CollChar(*this); }
+
+		void save(vector<uint8_t> &out) override {
+			saveBase(out);
+			putVarint(out, chr);
+		}
+
+		bool load(const uint8_t* &p, const uint8_t* end) override {
+			uint64_t c;
+			if(!loadBase(p, end) || !getVarint(p, end, c)) return false;
+			chr = c;
+			return true;
+		}
 
 		// operator overload
 
@@ -174,9 +596,14 @@ class CollChar : public CharStruct {
 		}
 		
 		// Get and set
-		const unsigned char getChar() { return chr; }
-		void setChar(const unsigned char ch) { chr = ch; }
+		// setChar keeps the cell's colors and attributes
+		const unsigned char getChar() { return cellByte(chr); }
+		void setChar(const unsigned char ch) { chr = cellWithChar(chr, ch); touch(); }
+		const Cell cell() { return chr; }
+		void setCell(const Cell c) { chr = c; touch(); }
 
+	protected:
+		void assign(CharStruct &from) override { *this = (CollChar&)from; }
 };
 
 // A line of chars, such as for a wall or ceiling.
@@ -184,7 +611,7 @@ class Line : public CharStruct {
 	protected:
 		// character to draw the line out of.
 		// this actually is an ASCII char and not a byte int
-		unsigned char chr;
+		Cell chr;
 		unsigned short len;
 		bool vert; // if false then horizontal
 	public:
@@ -226,26 +653,18 @@ class Line : public CharStruct {
 			// if it is within window bounds
 			for(unsigned short i=0; i<len; i++) {
 				if(win.inBounds(x, y))
-					win.writeAtNR(x, y, chr);
+					win.writeCellsNR(x, y, &chr, 1);
 				vert ? y++ : x++;
 			}
 		}
 
-		void write(unsigned char** chars, const unsigned short xo, const unsigned short yo,
-		const unsigned short xMax, const unsigned short yMax) override {
-			unsigned short
-				x = (xo + xp),
-				y = (yo + yp);
-			// always increment the pos but only write to it
-			// if it is within window bounds
-			for(unsigned short i=0; i<len; i++) {
-				if(x < xMax && y < yMax)
-					chars[x][y] = chr;
-				vert ? y++ : x++;
-			}
+		// the buffer clips the run, so the line is written in one go
+		void write(CharBuffer &buf) override {
+			if(vert) buf.vrun(xp, yp, len, chr);
+			else buf.hrun(xp, yp, len, chr);
 		}
 
-		unsigned char charAt(const unsigned short x, const unsigned short y) override {
+		Cell charAt(const unsigned short x, const unsigned short y) override {
 			if(inColl(x,y)) return chr;
 			else return 0;
 		}
@@ -263,12 +682,38 @@ class Line : public CharStruct {
 			return false;
 		}
 
-		const string type() override { return "Line"; }
+		bool bounds(unsigned short &x, unsigned short &y,
+		unsigned short &w, unsigned short &h) override {
+			x = xp; y = yp;
+			w = vert ? 1 : len;
+			h = vert ? len : 1;
+			return true;
+		}
+
+		const char* type() override { return "Line"; }
+		CharStruct* clone() override { return new Line(*this); }
+
+		void save(vector<uint8_t> &out) override {
+			saveBase(out);
+			putVarint(out, chr);
+			putVarint(out, len);
+			putVarint(out, vert);
+		}
+
+		bool load(const uint8_t* &p, const uint8_t* end) override {
+			uint64_t c, l, v;
+			if(!loadBase(p, end) || !getVarint(p, end, c) ||
+			!getVarint(p, end, l) || !getVarint(p, end, v)) return false;
+			chr = c; len = l; vert = v;
+			return true;
+		}
 		
 		// getter methods
 		const unsigned short length() { return len; }
 		const bool vertical() { return vert; }
 		const bool horizontal() { return !vert; }
+		const Cell cell() { return chr; }
+		void setCell(const Cell c) { chr = c; touch(); }
 
 		// operator overload
 
@@ -277,6 +722,9 @@ class Line : public CharStruct {
 				(f.xp == l.xp) && (f.yp == l.yp) &&
 				(f.vert == l.vert));
 		}
+
+	protected:
+		void assign(CharStruct &from) override { *this = (Line&)from; }
 };
 
 // A box of a single character.
@@ -286,7 +734,7 @@ class Box : public CharStruct {
 	// collIn - whether the collision checks the inside,
 	// if false then it only collides with the borders
 	bool fill, collIn;
-	unsigned char chr;
+	Cell chr;
 	unsigned short wd, ht;
 	public:
 		Box(const unsigned int collision, const unsigned char charac, const bool filled)
@@ -348,49 +796,35 @@ class Box : public CharStruct {
 				for(unsigned short i=x; i<x+wd; i++)
 					for(unsigned short j=y; j<y+ht; j++)
 						if(win.inBounds(i, j))
-							win.writeAtNR(i, j, chr);
+							win.writeCellsNR(i, j, &chr, 1);
 			} else { // O(x+y) otherwise
 				// draw the horizontal edges
 				for(unsigned short i=x; i<x+wd; i++) {
 					if(win.inBounds(i, y)) 
-						win.writeAtNR(i, y, chr);
+						win.writeCellsNR(i, y, &chr, 1);
 					if(win.inBounds(i, y+ht-1))
-						win.writeAtNR(i, y+ht-1, chr);
+						win.writeCellsNR(i, y+ht-1, &chr, 1);
 				}
 				// draw the vertical edges
 				for(unsigned short j=y; j<y+ht; j++) {
 					if(win.inBounds(x, j))
-						win.writeAtNR(x, j, chr);
+						win.writeCellsNR(x, j, &chr, 1);
 					if(win.inBounds(x+wd-1, j))
-						win.writeAtNR(x+wd-1, j, chr);
+						win.writeCellsNR(x+wd-1, j, &chr, 1);
 				}
 			}
 		}
 
-		void write(unsigned char** chars, const unsigned short xo, const unsigned short yo,
-		const unsigned short xMax, const unsigned short yMax) override {
-			const unsigned short
-				x = (xp + xo),
-				y = (yp + yo);
-			if(fill) {// O(xy) if filled
-				for(unsigned short i=x; i<x+wd; i++)
-					for(unsigned short j=y; j<y+ht; j++)
-						if(i < xMax && j < yMax)
-							chars[i][j] = chr;
-			} else { // O(x+y) otherwise
-				// draw the horizontal edges
-				for(unsigned short i=x; i<x+wd; i++) {
-					if(i < xMax && y < yMax) 
-						chars[i][y] = chr;
-					if(i < xMax && y+ht-1 < yMax)
-						chars[i][y+ht-1] = chr;
-				}
-				// draw the vertical edges
-				for(unsigned short j=y; j<y+ht; j++) {
-					if(x < xMax && j < yMax)
-						chars[x][j] = chr;
-					if(x+wd-1 < xMax && j < yMax)
-						chars[x+wd-1][j] = chr;
+		void write(CharBuffer &buf) override {
+			if(wd == 0 || ht == 0) return;
+			if(fill) { // one span per row if filled
+				buf.fill(xp, yp, wd, ht, chr);
+			} else { // two spans and two columns otherwise
+				buf.hrun(xp, yp, wd, chr);
+				if(ht > 1) buf.hrun(xp, yp+ht-1, wd, chr);
+				if(ht > 2) {
+					buf.vrun(xp, yp+1, ht-2, chr);
+					buf.vrun(xp+wd-1, yp+1, ht-2, chr);
 				}
 			}
 		}
@@ -403,8 +837,14 @@ class Box : public CharStruct {
 			&& (y >= yp && y < (yp + ht));
 			if(collIn) return inBox;
 			bool onBorder = (x == xp || y == yp) || 
-			(x == (xp + wd - 1) || y == (yp + wd - 1));
-			return onBorder;
+			(x == (xp + wd - 1) || y == (yp + ht - 1));
+			return inBox && onBorder;
+		}
+
+		bool bounds(unsigned short &x, unsigned short &y,
+		unsigned short &w, unsigned short &h) override {
+			x = xp; y = yp; w = wd; h = ht;
+			return true;
 		}
 	
 		// Not an override, but placed it here because it has a similar function
@@ -414,11 +854,35 @@ class Box : public CharStruct {
 			&& (y >= yp && y < (yp + ht));
 			if(fill) return inBox;
 			bool onBorder = (x == xp || y == yp) || 
-			(x == (xp + wd - 1) || y == (yp + wd - 1));
-			return onBorder;
+			(x == (xp + wd - 1) || y == (yp + ht - 1));
+			return inBox && onBorder;
+		}
+
+		const char* type() override { return "Box"; }
+		CharStruct* clone() override { return new Box(*this); }
+
+		void save(vector<uint8_t> &out) override {
+			saveBase(out);
+			putVarint(out, chr);
+			putVarint(out, wd);
+			putVarint(out, ht);
+			putVarint(out, fill | collIn << 1);
 		}
 
-		const string type() override { return "Box"; }
+		bool load(const uint8_t* &p, const uint8_t* end) override {
+			uint64_t c, w, h, flags;
+			if(!loadBase(p, end) || !getVarint(p, end, c) || !getVarint(p, end, w) ||
+			!getVarint(p, end, h) || !getVarint(p, end, flags)) return false;
+			chr = c; wd = w; ht = h;
+			fill = flags & 1;
+			collIn = flags & 2;
+			return true;
+		}
+
+		// get and set the cell the box is drawn with
+		const Cell cell() { return chr; }
+		void setCell(const Cell c) { chr = c; touch(); }
+
 		// operator overloads
 
 		friend bool operator==(const Box& f, const Box& l) {
@@ -426,16 +890,152 @@ class Box : public CharStruct {
 				(f.xp == l.xp) && (f.yp == l.yp) &&
 				(f.fill == l.fill) && (f.collIn == l.collIn));
 		}
+
+	protected:
+		void assign(CharStruct &from) override { *this = (Box&)from; }
 };
 
 // A grid of a certain size where each individual character
 // is stored seperately. Use for more detailed patterns
 // of which it is inefficient to use many different charstructs.
+//
+// A cell of 0 is see-through. The runs of visible cells are worked out
+// once after the grid changes, so writing it costs one copy per run.
 class StoredGrid : public CharStruct {
-	char** chrs;
-	bool** coll;
+	unsigned short wd, ht;
+	vector<Cell> chrs; // row-major, wd*ht
+	vector<bool> coll; // whether each cell collides
+	vector<unsigned short> runs; // x, y, length of each visible run
+	bool stale; // whether the runs need to be worked out again
+
+	void findRuns() {
+		runs.clear();
+		for(unsigned short y=0; y<ht; y++) {
+			const Cell* r = chrs.data() + y * wd;
+			unsigned short x = 0;
+			while(x < wd) {
+				while(x < wd && r[x] == 0) x++;
+				const unsigned short start = x;
+				while(x < wd && r[x] != 0) x++;
+				if(x > start) {
+					runs.push_back(start);
+					runs.push_back(y);
+					runs.push_back(x - start);
+				}
+			}
+		}
+		stale = false;
+	}
+
 	public:
-		const string type() override { return "StoredGrid"; }
+		StoredGrid(const unsigned int collision,
+		const unsigned short xPos, const unsigned short yPos,
+		const unsigned short width, const unsigned short height)
+		: CharStruct(collision, xPos, yPos) {
+			wd = width;
+			ht = height;
+			chrs.assign(wd * ht, 0);
+			coll.assign(wd * ht, false);
+			stale = true;
+		}
+
+		// overrides for CharStruct funcs
+
+		void draw(ASCIIWindow &win,
+		const unsigned short xo, const unsigned short yo) override {
+			for(unsigned short y=0; y<ht; y++)
+				for(unsigned short x=0; x<wd; x++)
+					if(chrs[y * wd + x] != 0 && win.inBounds(xp + xo + x, yp + yo + y))
+						win.writeCellsNR(xp + xo + x, yp + yo + y, &chrs[y * wd + x], 1);
+		}
+
+		void write(CharBuffer &buf) override {
+			if(stale) findRuns();
+			for(unsigned int i=0; i<runs.size(); i += 3)
+				buf.cells(xp + runs[i], yp + runs[i+1],
+					chrs.data() + runs[i+1] * wd + runs[i], runs[i+2]);
+		}
+
+		Cell charAt(const unsigned short x, const unsigned short y) override {
+			const unsigned short gx = x - xp, gy = y - yp;
+			if(gx >= wd || gy >= ht) return 0;
+			return chrs[gy * wd + gx];
+		}
+
+		bool inColl(const unsigned short x, const unsigned short y) override {
+			// unsigned underflow puts coordinates left or above of the grid out of it
+			const unsigned short gx = x - xp, gy = y - yp;
+			return gx < wd && gy < ht && coll[gy * wd + gx];
+		}
+
+		bool bounds(unsigned short &x, unsigned short &y,
+		unsigned short &w, unsigned short &h) override {
+			x = xp; y = yp; w = wd; h = ht;
+			return true;
+		}
+
+		const char* type() override { return "StoredGrid"; }
+		CharStruct* clone() override { return new StoredGrid(*this); }
+
+		void save(vector<uint8_t> &out) override {
+			saveBase(out);
+			putVarint(out, wd);
+			putVarint(out, ht);
+			for(unsigned int i=0; i<chrs.size(); i++) putVarint(out, chrs[i]);
+			// the collision as bits, 8 cells a byte
+			for(unsigned int i=0; i<coll.size(); i += 8) {
+				uint8_t bits = 0;
+				for(unsigned int b=0; b<8 && i + b < coll.size(); b++)
+					if(coll[i + b]) bits |= 1 << b;
+				out.push_back(bits);
+			}
+		}
+
+		bool load(const uint8_t* &p, const uint8_t* end) override {
+			uint64_t w, h;
+			if(!loadBase(p, end) || !getVarint(p, end, w) || !getVarint(p, end, h))
+				return false;
+			// every cell takes at least a byte, so bigger can't be right
+			if(w * h > (uint64_t)(end - p)) return false;
+			wd = w; ht = h;
+			chrs.assign(wd * ht, 0);
+			coll.assign(wd * ht, false);
+			for(unsigned int i=0; i<chrs.size(); i++) {
+				uint64_t c;
+				if(!getVarint(p, end, c)) return false;
+				chrs[i] = c;
+			}
+			for(unsigned int i=0; i<coll.size(); i += 8) {
+				if(p >= end) return false;
+				const uint8_t bits = *p++;
+				for(unsigned int b=0; b<8 && i + b < coll.size(); b++)
+					coll[i + b] = bits >> b & 1;
+			}
+			stale = true;
+			return true;
+		}
+
+		// Unique methods
+
+		// Sets a cell in grid coordinates, and whether it collides.
+		// Returns false if out of bounds
+		bool set(const unsigned short x, const unsigned short y,
+		const Cell c, const bool collides) {
+			if(x >= wd || y >= ht) return false;
+			chrs[y * wd + x] = c;
+			if(coll[y * wd + x] != collides) rev = tick();
+			coll[y * wd + x] = collides;
+			stale = true;
+			touch();
+			return true;
+		}
+
+		// getter methods
+		const unsigned short width() { return wd; }
+		const unsigned short height() { return ht; }
+
+	protected:
+		void assign(CharStruct &from) override { *this = (StoredGrid&)from; }
 };
 
 // A group of char structs, used when building rooms or levels.
@@ -459,10 +1059,9 @@ class CharStructGroup : public CharStruct {
 		}
 
 		// Draw every structure in the group
-		void write(unsigned char** chars, const unsigned short xo, const unsigned short yo,
-		const unsigned short xMax, const unsigned short yMax) override {
+		void write(CharBuffer &buf) override {
 			for(unsigned short i=0; i<structs.size(); i++)
-				structs[i] -> write(chars, xo, yo, xMax, yMax);
+				structs[i] -> write(buf);
 		}
 
 		// Check every structure in the group
@@ -473,25 +1072,72 @@ class CharStructGroup : public CharStruct {
 			return false;
 		}
 		
+		// The rectangle around every struct in the group,
+		// false if any of them can't tell
+		bool bounds(unsigned short &x, unsigned short &y,
+		unsigned short &w, unsigned short &h) override {
+			if(structs.size() == 0) return false;
+			int x0 = 65535, y0 = 65535, x1 = 0, y1 = 0;
+			for(unsigned short i=0; i<structs.size(); i++) {
+				unsigned short sx, sy, sw, sh;
+				if(!structs[i] -> bounds(sx, sy, sw, sh)) return false;
+				if(sx < x0) x0 = sx;
+				if(sy < y0) y0 = sy;
+				if(sx + sw > x1) x1 = sx + sw;
+				if(sy + sh > y1) y1 = sy + sh;
+			}
+			x = x0; y = y0; w = x1 - x0; h = y1 - y0;
+			return true;
+		}
+
+		// the latest change of the group or any struct in it
+		const unsigned long long changed() override {
+			unsigned long long last = rev;
+			for(unsigned short i=0; i<structs.size(); i++)
+				if(structs[i] -> changed() > last) last = structs[i] -> changed();
+			return last;
+		}
+
+		// the latest edit of the group or any struct in it
+		const unsigned long long edited() override {
+			unsigned long long last = CharStruct::edited();
+			for(unsigned short i=0; i<structs.size(); i++)
+				if(structs[i] -> edited() > last) last = structs[i] -> edited();
+			return last;
+		}
+
 		// Returns the first visible char at the coordinates or 0 if none exist
-		unsigned char charAt(const unsigned short x, const unsigned short y) override {
+		Cell charAt(const unsigned short x, const unsigned short y) override {
 			for(unsigned short i=0; i<structs.size(); i++) {
-				unsigned char chr = structs[i] -> charAt(x, y);
+				Cell chr = structs[i] -> charAt(x, y);
 				if(chr != 0) return chr;
 			} return 0;
 		}
 
-		const string type() override { return "CharStructGroup"; }
+		const char* type() override { return "CharStructGroup"; }
+
+		// copies every struct in the group, leaving out any that can't be
+		CharStruct* clone() override {
+			CharStructGroup* copy = new CharStructGroup();
+			(CharStruct&)*copy = *this;
+			for(unsigned short i=0; i<structs.size(); i++) {
+				CharStruct* s = structs[i] -> clone();
+				if(s != NULL) copy -> structs.push_back(s);
+			}
+			return copy;
+		}
 
 		// Unique methods
 
 		void add(CharStruct * structure) {
 			structs.push_back(structure);
+			rev = tick();
 		}
 
 		bool remove(const unsigned short index) {
 			if(index > structs.size()) return false;
 			structs.erase(structs.begin() + index);
+			rev = tick();
 			return true;
 		}
 
@@ -508,6 +1154,34 @@ class CharStructGroup : public CharStruct {
 		unsigned short size() {
 			return structs.size();
 		}
+
+		// Gets a struct in the group, or NULL if index is out of bounds.
+		// The group owns it.
+		CharStruct * getPtr(const unsigned short index) {
+			if(index >= structs.size()) return NULL;
+			return structs[index];
+		}
+
+	protected:
+		// The structs that are still in the group are set in place, so
+		// pointers to them stay good. Otherwise they are copied again.
+		void assign(CharStruct &from) override {
+			CharStructGroup &g = (CharStructGroup&)from;
+			(CharStruct&)*this = g;
+			bool same = g.structs.size() == structs.size();
+			for(unsigned short i=0; same && i<structs.size(); i++)
+				same = structs[i] -> id() == g.structs[i] -> id();
+			if(same) {
+				for(unsigned short i=0; i<structs.size(); i++)
+					structs[i] -> restoreFrom(*g.structs[i]);
+				return;
+			}
+			for(unsigned short i=0; i<structs.size(); i++)
+				delete(structs[i]);
+			structs.clear();
+			for(unsigned short i=0; i<g.structs.size(); i++)
+				structs.push_back(g.structs[i] -> clone());
+		}
 };
 
 // The class that deals with writing the character structures to the screen
@@ -517,33 +1191,231 @@ class CharDisplay {
 	// xs, ys: x and y scroll offsets 
 	unsigned short w, h, xo, yo, xs, ys;
 	bool up; // whether the screen is updated or not
-	unsigned char** winChars; // has to be dynamically allocated
+
+	// The chars are kept in a toroidal ring of w*h chars, row-major.
+	// ox, oy is where display cell 0, 0 is stored, so scrolling only moves
+	// the origin and rasterizes the rows or columns that it exposes.
+	Cell* winChars; // has to be dynamically allocated
+	unsigned short ox, oy;
+	vector<bool> dirty; // storage rows that changed since the last update
+	bool repaint; // whether every row has to be compared on the next update
+	int scrollPend; // rows to scroll the terminal by on the next update
+
+	// What the terminal currently shows, so update() only writes the runs
+	// of cells that changed. Rows are in display order from row fy on,
+	// wrapping like the ring so a terminal scroll only moves fy.
+	Cell* front;
+	unsigned short fy;
 
 	// These CharStruct vectors are read from front to back meaning
 	// a size 4 loadedStructs will load [0] first and [3] last,
 	// where 0 will appear on the bottom and 3 will be on the top visually.
 	vector<CharStruct *> structs; // Structures stored in the screen
+	unsigned long long structsRev; // stamp of the last add or remove
 	ASCIIWindow *win;
+	function<void()> beforeWrite; // called before structs are rasterized
+	const VisMask* visMask; // cells structs may be drawn to, NULL for all
+	vector<FrameSink *> sinks; // told what every update() changed, not owned
+	FrameDelta delta; // what the current update() changed, for the sinks
+	// bytes the terminal can have waiting before update() holds frames back,
+	// 0 to never hold back
+	int maxBacklog;
+	// when a frame had to wait for the terminal, the time (see deltaClock())
+	// until which the next ones are held back so the link can catch up
+	uint64_t stallUntil;
+	bool painting; // whether the rows being compared are written to the window
+	unsigned long long heldCt, shownCt; // frames held back and frames sent
+	// Which struct drew each cell, laid out like winChars, as its index + 1
+	// or 0 for none. NULL unless tracked, see trackIds()
+	unsigned short* idMap;
 
 	protected:
 		void initChars(const unsigned short width, const unsigned short height) {
 			// allocate space for window characters
-			cout << width << " " << height;
-			winChars = new unsigned char*[width]; // create columns
-			for(unsigned short i=0; i<width; i++) // create rows
-				winChars[i] = new unsigned char[height];
-			for(unsigned short x = 0; x<width; x++) {
-				for(unsigned short y = 0; y<height; y++) {
-					winChars[x][y] = ' '; // default chars are spaces
+			winChars = new Cell[width * height];
+			cellFill(winChars, width * height, CELL_BLANK); // default chars are spaces
+			// the window starts out blank when it is built
+			front = new Cell[width * height];
+			cellFill(front, width * height, CELL_BLANK);
+			fy = 0;
+			ox = 0; oy = 0;
+			dirty.assign(height, false);
+			repaint = true;
+			scrollPend = 0;
+		}
+
+		// Sends the window to the terminal. If that had to wait for the
+		// terminal to take it, frames are held back for as long again.
+		void present() {
+			const uint64_t start = deltaClock();
+			win -> present();
+			const uint64_t end = deltaClock();
+			stallUntil = end - start > 2000 ? end + (end - start) : 0;
+		}
+
+		// A buffer that clips to the display rectangle [x0, x1) x [y0, y1)
+		CharBuffer buffer(const int x0, const int y0, const int x1, const int y1) {
+			CharBuffer buf(winChars, w, h, ox, oy, xs, ys, x0, y0, x1, y1);
+			buf.setMask(visMask);
+			buf.setIds(idMap);
+			return buf;
+		}
+
+		// Writes every struct, the first one on top
+		void writeAll(CharBuffer &buf) {
+			// you'd better HOPE that a short stores 2 bytes on your pc
+			for(unsigned short i=structs.size() - 1; i < 65535; i--) {
+				buf.setOwner(i + 1);
+				structs[i] -> write(buf);
+			}
+			buf.setOwner(0);
+		}
+
+		// Writes one struct on top of everything else
+		void writeOne(const unsigned short index) {
+			if(beforeWrite) beforeWrite();
+			CharBuffer buf = buffer(0, 0, w, h);
+			buf.setOwner(index + 1);
+			structs[index] -> write(buf);
+			markRows(buf);
+		}
+
+		// Fixes up the ids after the struct at index left the list,
+		// its cells belong to nobody until they are redrawn
+		void forgetId(const unsigned short index) {
+			if(idMap == NULL) return;
+			const unsigned short id = index + 1;
+			for(size_t i=0; i<(size_t)w * h; i++) {
+				if(idMap[i] == id) idMap[i] = 0;
+				else if(idMap[i] > id) idMap[i]--;
+			}
+		}
+
+		// the storage row of a display row
+		unsigned short storeRow(const int y) {
+			int r = oy + y;
+			if(r >= h) r -= h;
+			return r;
+		}
+
+		// flags the display rows that a buffer wrote to as changed
+		void markRows(CharBuffer &buf) {
+			for(int y=buf.lowRow(); y<=buf.highRow(); y++)
+				dirty[storeRow(y)] = true;
+			up = false;
+		}
+
+		// Blanks the display rectangle [x0, x1) x [y0, y1) and writes every
+		// struct that falls inside of it, leaving the rest of the ring alone.
+		void rasterize(const int x0, const int y0, const int x1, const int y1) {
+			if(beforeWrite) beforeWrite();
+			CharBuffer buf = buffer(x0, y0, x1, y1);
+			// hidden cells are blanked too
+			buf.setMask(NULL);
+			buf.rectAt(x0, y0, x1, y1, CELL_BLANK);
+			buf.setMask(visMask);
+			writeAll(buf);
+			markRows(buf);
+		}
+
+		// Hands what the last update() changed to the sinks,
+		// or the whole screen if any of them wants a keyframe
+		void sendFrame() {
+			bool key = false;
+			for(unsigned int i=0; i<sinks.size(); i++)
+				if(sinks[i] -> wantsKeyframe()) key = true;
+			if(key) {
+				const uint64_t time = delta.time;
+				delta.clear();
+				delta.time = time;
+				delta.key = true;
+				for(unsigned short y=0; y<h; y++)
+					delta.addRun(0, y, frontRow(y), w);
+			}
+			if(delta.empty()) return;
+			for(unsigned int i=0; i<sinks.size(); i++)
+				sinks[i] -> frame(delta);
+		}
+
+		// the front buffer row holding display row y
+		Cell* frontRow(const int y) {
+			int r = fy + y;
+			if(r >= h) r -= h;
+			return front + r * w;
+		}
+
+		// Moves the front buffer along with a terminal scroll of n rows,
+		// blanking the rows the terminal scrolled in like it does.
+		void scrollFront(const int n) {
+			fy = (fy + h - n) % h;
+			const int y0 = n > 0 ? 0 : h + n, y1 = n > 0 ? n : h;
+			for(int y=y0; y<y1; y++)
+				cellFill(frontRow(y), w, CELL_BLANK);
+		}
+
+		// Writes the runs of n cells starting at display column x of row y
+		// that differ from what the terminal shows, and records them as shown.
+		// Runs only a few cells apart are joined, moving the cursor over
+		// the gap costs about as much as rewriting it.
+		void paintSpan(const unsigned short x, const unsigned short y,
+		const Cell* cells, Cell* shown, const unsigned short n) {
+			size_t i = cellMismatch(cells, shown, n);
+			while(i < n) {
+				size_t j = i + cellMatch(cells + i, shown + i, n - i);
+				size_t next = j + cellMismatch(cells + j, shown + j, n - j);
+				while(next < n && next - j < 4) {
+					j = next + cellMatch(cells + next, shown + next, n - next);
+					next = j + cellMismatch(cells + j, shown + j, n - j);
 				}
+				if(painting) win -> writeCellsNR(xo + x + i, yo + y, cells + i, j - i);
+				if(!sinks.empty()) delta.addRun(x + i, y, cells + i, j - i);
+				cellCopy(shown + i, cells + i, j - i);
+				i = next;
 			}
 		}
 
+		// Compares the rows that changed with the front buffer, writing what
+		// differs to the window if toWindow, and starts the sinks' delta.
+		// Without the window a scroll just moves the front buffer.
+		void settle(const bool toWindow) {
+			if(!sinks.empty()) {
+				delta.clear();
+				delta.time = deltaClock();
+			}
+			if(scrollPend != 0) {
+				// The terminal scrolls whole lines, so this only works if the
+				// display spans the window, otherwise every row is compared.
+				bool spans = !toWindow || (xo == 0 && w >= win -> width());
+				bool within = (scrollPend < h && -scrollPend < h);
+				if(spans && within
+				&& (!toWindow || win -> scrollRegion(yo, yo + h - 1, -scrollPend))) {
+					scrollFront(scrollPend);
+					delta.scroll = scrollPend;
+				}
+				else repaint = true;
+			}
+			painting = toWindow;
+			for(unsigned short j=0; j<h; j++)
+				if(repaint || dirty[storeRow(j)]) paintRow(j);
+			dirty.assign(h, false);
+			repaint = false;
+			scrollPend = 0;
+			up = true;
+		}
+
+		// Writes the changed cells of one display row to the window,
+		// in two spans when the row wraps around the right edge of the ring
+		void paintRow(const unsigned short y) {
+			const Cell* r = winChars + storeRow(y) * w;
+			Cell* f = frontRow(y);
+			paintSpan(0, y, r + ox, f, w - ox);
+			if(ox > 0) paintSpan(w - ox, y, r, f + w - ox, ox);
+		}
+
 	public:
 		CharDisplay(const unsigned short width, const unsigned short height, 
 			const unsigned short xOffset, const unsigned short yOffset,
 			ASCIIWindow *window) {
-			cout << width << " " << height;
 			w = width;
 			h = height;
 			xo = xOffset;
@@ -551,6 +1423,13 @@ class CharDisplay {
 			xs = 0; ys = 0;
 			win = window;
 			up = true;
+			structsRev = 0;
+			visMask = NULL;
+			maxBacklog = width * height; // about one plain screen
+			stallUntil = 0;
+			painting = true;
+			heldCt = 0; shownCt = 0;
+			idMap = NULL;
 			initChars(width, height);
 		}
 
@@ -560,22 +1439,61 @@ class CharDisplay {
 		~CharDisplay() {
 			for(unsigned int i=0; i<structs.size(); i++)
 				delete(structs[i]);
-			// TODO test memory leak with winchars
-			for(unsigned short i=0; i<w; i++)
-				delete[] winChars[i];
 			delete[] winChars;
+			delete[] front;
+			delete[] idMap;
 		}
 		
-		// Redraws the screen if update is false
-		void update() {
-			if(up == false) {
-				for(unsigned short i=0; i<w; i++) {
-					for(unsigned short j=0; j<h; j++) {
-						win -> writeAtNR(i, j, winChars[i][j]);			
-					}
-				}
-			up = true;
+		// Redraws the changed cells of the screen if update is false,
+		// and sends them to the terminal.
+		// Pending vertical scrolls are sent to the terminal as a scroll of
+		// the display's rows, so only the rows they exposed get written.
+		// If the terminal hasn't taken what was sent before, such as over a
+		// slow link, the frame is held back and returns false. Its changes
+		// stay marked and go out with the next update that isn't held back,
+		// so the terminal never falls more than a frame or so behind.
+		bool update() {
+			if(backedUp()) {
+				heldCt++;
+				return false;
 			}
+			if(up == true) {
+				present(); // things written to the window directly
+				return true;
+			}
+			settle(true);
+			present();
+			shownCt++;
+			if(!sinks.empty()) sendFrame();
+			return true;
+		}
+
+		// Works out what changed since the last frame like update() and
+		// tells the sinks, but leaves the window alone. For when another
+		// thread presents the display, see Presenter in present.hpp.
+		// Returns false if nothing changed.
+		bool commit() {
+			if(up == true) return false;
+			settle(false);
+			if(!sinks.empty()) sendFrame();
+			return true;
+		}
+
+		// Copies the display as of the last update() or commit() into
+		// rows of cells stride cells apart
+		void copyShown(Cell* out, const unsigned int stride) {
+			for(unsigned short y=0; y<h; y++)
+				cellCopy(out + (size_t)y * stride, frontRow(y), w);
+		}
+
+		// Whether the terminal has more bytes waiting than the backlog allows,
+		// is too full to take more at all, or is still catching up with a
+		// frame it made wait. Linux ptys don't say how much is waiting, so
+		// there a frame that waited is the sign that the link is behind.
+		bool backedUp() {
+			if(maxBacklog <= 0) return false;
+			if(stallUntil != 0 && deltaClock() < stallUntil) return true;
+			return !win -> outputReady() || win -> outputQueued() > maxBacklog;
 		}
 		
 		// ===============
@@ -588,6 +1506,49 @@ class CharDisplay {
 			bool done = rt ? win -> initRealTime() : win -> exitRealTime();
 			return done;
 		}
+
+		// Sets a function to call before any struct is rasterized,
+		// such as joining the frame's jobs (see JobSystem::joinBefore)
+		void setBeforeWrite(function<void()> fn) { beforeWrite = fn; }
+
+		// Keeps track of which struct drew each cell from now on, so that
+		// structAt() can answer what is under the cursor without asking every
+		// struct. It costs two bytes a cell and a little on every write.
+		// Cells drawn before it was turned on belong to nobody until redrawn.
+		void trackIds(const bool track) {
+			if(track && idMap == NULL) {
+				idMap = new unsigned short[(size_t)w * h];
+				fill_n(idMap, (size_t)w * h, 0);
+			} else if(!track) {
+				delete[] idMap;
+				idMap = NULL;
+			}
+		}
+
+		// Only draws the struct cells that a mask shows, such as what the
+		// player can see, NULL to draw everything. The mask is read whenever
+		// structs are written, so redraw after it or the mask changes.
+		void setVisibility(const VisMask* mask) { visMask = mask; }
+
+		// How many bytes the terminal can have waiting before update()
+		// holds frames back, 0 to always send them. The default is about
+		// one screen, which bounds how far behind the terminal can get.
+		void setMaxBacklog(const int bytes) { maxBacklog = bytes; }
+
+		// Tells a sink what every update() changes from now on, such as
+		// a Recorder. The display doesn't delete its sinks.
+		void addFrameSink(FrameSink *sink) { sinks.push_back(sink); }
+
+		// Stops telling a sink about frames, returns true if it was added
+		bool removeFrameSink(FrameSink *sink) {
+			for(unsigned int i=0; i<sinks.size(); i++) {
+				if(sinks[i] == sink) {
+					sinks.erase(sinks.begin() + i);
+					return true;
+				}
+			}
+			return false;
+		}
 		
 		// ==============================
 		// Data coordinate retrieve funcs
@@ -611,14 +1572,17 @@ class CharDisplay {
 		// add a struct pointer to the vector
 		void addStruct(CharStruct* ptr) {
 			structs.push_back(ptr);
+			structsRev = CharStruct::tick();
 		}
 		
 		// remove a struct pointer from the vector
 		// return false if the index is out of bounds
 		bool removeStruct(const unsigned short index) {
-			if(index > structs.size()) return false;
+			if(index >= structs.size()) return false;
 			delete(structs[index]); // delete the object at the pointer
 			structs.erase(structs.begin() + index); // remove the pointer
+			structsRev = CharStruct::tick();
+			forgetId(index);
 			return true;
 		}
 
@@ -629,6 +1593,9 @@ class CharDisplay {
 				if(ptr == structs[i]) {
 					delete(structs[i]); // delete the object at the pointer
 					structs.erase(structs.begin() + i); // remove the pointer
+					structsRev = CharStruct::tick();
+					forgetId(i);
+					return true;
 				}
 			}
 			return false;
@@ -637,17 +1604,33 @@ class CharDisplay {
 		// Gets a pointer at an index, or NULL if index is out of bounds.
 		// Do NOT delete the pointer directly, use removeStruct instead
 		CharStruct * getPtr(const unsigned short index) {
-			if(index > structs.size()) return NULL;
+			if(index >= structs.size()) return NULL;
 			return structs[index]; // get the pointer
 		}
 
+		// Swaps in a whole new list of structs, in drawing order, such as when
+		// restoring a snapshot. Structs in the old list but not in the new one
+		// are deleted. Call writeStructs() or redrawStructs() after.
+		void replaceStructs(const vector<CharStruct *> &list) {
+			vector<CharStruct *> kept(list);
+			sort(kept.begin(), kept.end());
+			for(unsigned int i=0; i<structs.size(); i++)
+				if(!binary_search(kept.begin(), kept.end(), structs[i]))
+					delete(structs[i]);
+			structs = list;
+			structsRev = CharStruct::tick();
+			if(idMap != NULL) fill_n(idMap, (size_t)w * h, 0);
+		}
+
 		// Removes a struct from the list, but does NOT delete the pointer.
 		// Returns the pointer instead. If index is out of bounds returns null
 		// MEMORY MANAGEMENT IS UP TO YOU WHEN YOU USE THIS
 		CharStruct * popStruct(const unsigned int index) {
-			if(index > structs.size()) return NULL;
+			if(index >= structs.size()) return NULL;
 			CharStruct* ptr = structs[index]; // get the pointer
 			structs.erase(structs.begin() + index); // remove the pointer
+			structsRev = CharStruct::tick();
+			forgetId(index);
 			return ptr;
 		}
 		
@@ -657,18 +1640,29 @@ class CharDisplay {
 
 		// Writes the structs on top of whatever is already on it
 		void writeStructs() {
-			// you'd better HOPE that a short stores 2 bytes on your pc
-			for(unsigned short i=structs.size() - 1; i < 65535; i--) 
-				structs[i] -> write(winChars, dx(), dy(), dlx(), dly());
-			up = false;
+			if(beforeWrite) beforeWrite();
+			CharBuffer buf = buffer(0, 0, w, h);
+			writeAll(buf);
+			markRows(buf);
+		}
+
+		// Writes with any callable taking a CharBuffer&, on top of everything
+		// else, without it having to be one of the stored structs. The call is
+		// resolved at compile time, use it for content that is drawn every
+		// frame such as HUDs (see staticshape.hpp).
+		template<class Writer>
+		void writeWith(Writer &&writer) {
+			if(beforeWrite) beforeWrite();
+			CharBuffer buf = buffer(0, 0, w, h);
+			writer(buf);
+			markRows(buf);
 		}
 
 		// Writes a single struct on top of everything else 
 		// Return false if out of bounds
 		bool writeStruct(const unsigned short index) {
-			if(index > structs.size()) return false;
-			structs[index] -> write(winChars, dx(), dy(), dlx(), dly());
-			up = false;
+			if(index >= structs.size()) return false;
+			writeOne(index);
 			return true;
 		}
 		
@@ -677,9 +1671,7 @@ class CharDisplay {
 		bool writeStruct(CharStruct* ptr) {
 			for(unsigned short i=0; i<structs.size(); i++) {
 				if(ptr == structs[i]) {
-					// draw the structs
-					structs[i] -> write(winChars, dx(), dy(), dlx(), dly());
-					up = false; // not updated if this is true
+					writeOne(i);
 					return true;
 				}
 			}
@@ -688,11 +1680,18 @@ class CharDisplay {
 		
 		// Wipes the char 2d array, leaving a blank screen when refreshed
 		void clear() {
-			for(unsigned short i=0; i<w; i++) {
-				for(unsigned short j=0; j<h; j++) {
-					winChars[i][j] = ' ';			
-				}
-			}
+			cellFill(winChars, (size_t)w * h, CELL_BLANK);
+			if(idMap != NULL) fill_n(idMap, (size_t)w * h, 0);
+			repaint = true;
+			up = false;
+		}
+
+		// Forgets what the terminal shows so the next update() rewrites
+		// every cell, for when something else has drawn over the display.
+		void invalidate() {
+			// no real cell has its top bits set so nothing will match this
+			cellFill(front, (size_t)w * h, ~(Cell)0);
+			repaint = true;
 			up = false;
 		}
 
@@ -701,6 +1700,16 @@ class CharDisplay {
 			clear();
 			writeStructs();
 		}
+
+		// Redraws only the structs inside a wd by ht world rectangle at x, y,
+		// for when a small part of the screen changed. The next update()
+		// only compares and paints the rows the rectangle covers.
+		void redrawRect(const unsigned short x, const unsigned short y,
+		const unsigned short wd, const unsigned short ht) {
+			const int dx = (short)(unsigned short)(x + xs),
+				dy = (short)(unsigned short)(y + ys);
+			rasterize(dx, dy, dx + wd, dy + ht);
+		}
 		
 
 		// =======================
@@ -709,27 +1718,83 @@ class CharDisplay {
 		
 		// whether the display is updated or not
 		const bool updated() { return up; }
+		// frames update() held back for a slow terminal, and frames it sent
+		const unsigned long long held() { return heldCt; }
+		const unsigned long long shown() { return shownCt; }
 		// number of character structures stored by the display
 		const unsigned short structCt() { return structs.size(); }
-		// character at certain coordinate
+		// stamp of the last time a struct was added or removed,
+		// compare with CharStruct::changed() and CharStruct::tick()
+		const unsigned long long structsChanged() { return structsRev; }
+		// cell at certain display coordinate
+		const Cell cellAt(const unsigned short x, const unsigned short y) { 
+			unsigned short c = ox + x;
+			if(c >= w) c -= w;
+			return winChars[storeRow(y) * w + c];
+		}
+		// character at certain display coordinate
 		const unsigned char charAt(const unsigned short x, const unsigned short y) 
-		{ return winChars[x][y]; }
-		// the x and y coordinates to feed to writeStructs as the max limits
-		// this is the width/height plus the display offset coordinate
-		const unsigned short dlx() { return w + xo; }
-		const unsigned short dly() { return h + yo; }
-		// the x and y coordinates to feed to writeStructs as the offsets
+		{ return cellByte(cellAt(x, y)); }
+		// The index of the struct on top at a display coordinate, as of when
+		// the cell was last drawn, or -1 if none is or ids aren't tracked
+		const int structIndexAt(const unsigned short x, const unsigned short y) {
+			if(idMap == NULL || x >= w || y >= h) return -1;
+			unsigned short c = ox + x;
+			if(c >= w) c -= w;
+			return (int)idMap[storeRow(y) * w + c] - 1;
+		}
+		// The struct on top at a display coordinate, or NULL, see trackIds()
+		CharStruct * structAt(const unsigned short x, const unsigned short y) {
+			const int i = structIndexAt(x, y);
+			return i < 0 ? NULL : structs[i];
+		}
+		// where the world origin lands on the ASCIIWindow
 		// this is the scroll offset plus the display screen offset
 		const unsigned short dx() { return xs + xo; }
 		const unsigned short dy() { return ys + yo; }
+		// how far the display has scrolled, a display coordinate is the
+		// world coordinate plus these
+		const short scrolledX() { return (short)xs; }
+		const short scrolledY() { return (short)ys; }
+		// where the display's top left corner is on the ASCIIWindow
+		const unsigned short offsetX() { return xo; }
+		const unsigned short offsetY() { return yo; }
 		//  the width and the length of the display
 		const unsigned short width() { return w; }
 		const unsigned short height() { return h; }
 
-		// scroll the display in the x or y direction
-		// this does not visually change anything until the structs are redrawn
-		void scrollX(const short chrCt) { xs += chrCt; }
-		void scrollY(const short chrCt) { ys += chrCt; }
+		// Scroll the display in the x or y direction, positive moves the
+		// structs right or down. The chars already on the display move with
+		// the ring's origin and only the rows or columns that scrolled into
+		// view are rasterized. Nothing changes on screen until update().
+		void scrollX(const short chrCt) {
+			if(chrCt == 0) return;
+			xs += chrCt;
+			if(chrCt >= w || -chrCt >= w) {
+				rasterize(0, 0, w, h);
+				repaint = true;
+				return;
+			}
+			ox = (ox + w - chrCt) % w;
+			// the terminal can't scroll sideways so every row is rewritten
+			if(chrCt > 0) rasterize(0, 0, chrCt, h);
+			else rasterize(w + chrCt, 0, w, h);
+			repaint = true;
+		}
+
+		void scrollY(const short chrCt) {
+			if(chrCt == 0) return;
+			ys += chrCt;
+			scrollPend += chrCt;
+			if(chrCt >= h || -chrCt >= h) {
+				rasterize(0, 0, w, h);
+				repaint = true;
+				return;
+			}
+			oy = (oy + h - chrCt) % h;
+			if(chrCt > 0) rasterize(0, 0, w, chrCt);
+			else rasterize(0, h + chrCt, w, h);
+		}
 	protected:
 		class GuiWindow {
 			// width, height, x position of topleft corner, y position of such
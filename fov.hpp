@@ -0,0 +1,319 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+#include "engine.hpp"
+#include "jobs.hpp"
+using namespace std;
+
+// =========================================
+// Field of view and lighting
+// ----------------------------------------
+// Works out which cells can be seen from a
+// point, with walls taken from the structs
+// of a display that have chosen collision
+// codes, like NavGrid does for movement.
+//
+// Every viewer and light is a source that
+// is cast with recursive shadowcasting over
+// its radius. A source is only cast again
+// when it moves or when a wall changes
+// inside of its radius, so a frame where
+// nothing moved costs nothing. The cells
+// that viewers see become a VisMask to hand
+// to CharDisplay::setVisibility(), and the
+// lights add up into a light level per cell.
+//
+// Casting many sources can be spread over a
+// JobSystem, each source is cast on its own.
+// =========================================
+
+// How fields of view are cast and combined
+class FieldOfView {
+	// A viewer or a light and the cells it reached the last time it was cast
+	struct Source {
+		unsigned short x, y, radius;
+		unsigned char intensity; // light at the source, 0 for viewers
+		bool live; // false once removed, so ids stay the same
+		bool dirty; // whether it has to be cast again
+		vector<unsigned int> cells; // region indices reached, may repeat
+		vector<unsigned char> levels; // light reaching each of cells
+	};
+
+	CharDisplay *display;
+	vector<unsigned int> codes; // collision codes that block sight
+	unsigned short x0, y0, wd, ht; // world region covered
+	vector<unsigned char> opaque; // 1 where a wall is
+	unsigned long long built; // stamp the walls were read at
+
+	vector<Source> sources;
+	VisMask seen; // union of what the viewers see
+	vector<unsigned char> light; // light level of every region cell
+	// the last source to add light to each cell, since octants share edges
+	vector<unsigned int> lastLit;
+	JobSystem *jobs;
+	unsigned int castCt; // how many times sources were cast
+
+	bool blocks(const unsigned int code) {
+		return find(codes.begin(), codes.end(), code) != codes.end();
+	}
+
+	// the latest stamp of anything that could have moved a wall
+	unsigned long long lastChange() {
+		unsigned long long last = display -> structsChanged();
+		if(CharStruct::recoded() > last) last = CharStruct::recoded();
+		for(unsigned short i=0; i<display -> structCt(); i++) {
+			CharStruct* s = display -> getPtr(i);
+			if(blocks(s -> collisionCode()) && s -> changed() > last)
+				last = s -> changed();
+		}
+		return last;
+	}
+
+	// Reads the walls into grid, checking each struct within its bounds only
+	void readWalls(vector<unsigned char> &grid) {
+		grid.assign(wd * ht, 0);
+		for(unsigned short i=0; i<display -> structCt(); i++) {
+			CharStruct* s = display -> getPtr(i);
+			if(!blocks(s -> collisionCode())) continue;
+			int bx0 = x0, by0 = y0, bx1 = x0 + wd, by1 = y0 + ht;
+			unsigned short sx, sy, sw, sh;
+			if(s -> bounds(sx, sy, sw, sh)) {
+				bx0 = max(bx0, (int)sx); by0 = max(by0, (int)sy);
+				bx1 = min(bx1, sx + sw); by1 = min(by1, sy + sh);
+			}
+			for(int y=by0; y<by1; y++)
+				for(int x=bx0; x<bx1; x++)
+					if(s -> inColl(x, y)) grid[(y - y0) * wd + (x - x0)] = 1;
+		}
+	}
+
+	// Rereads the walls if any changed, and marks the sources whose
+	// radius reaches a cell that changed. Returns true if any did.
+	bool refreshWalls() {
+		if(lastChange() <= built) return false;
+		vector<unsigned char> grid;
+		readWalls(grid);
+		built = CharStruct::tick();
+		int cx0 = wd, cy0 = ht, cx1 = -1, cy1 = -1;
+		for(unsigned int i=0; i<grid.size(); i++) {
+			if(grid[i] == opaque[i]) continue;
+			const int x = i % wd, y = i / wd;
+			cx0 = min(cx0, x); cy0 = min(cy0, y);
+			cx1 = max(cx1, x); cy1 = max(cy1, y);
+		}
+		opaque.swap(grid);
+		if(cx1 == -1) return false;
+		for(unsigned int i=0; i<sources.size(); i++) {
+			Source &s = sources[i];
+			const int sx = s.x - x0, sy = s.y - y0, r = s.radius;
+			if(sx + r >= cx0 && sx - r <= cx1 && sy + r >= cy0 && sy - r <= cy1)
+				s.dirty = true;
+		}
+		return true;
+	}
+
+	// whether a region cell blocks sight, outside of the region does
+	bool wall(const int x, const int y) {
+		if(x < 0 || y < 0 || x >= wd || y >= ht) return true;
+		return opaque[y * wd + x];
+	}
+
+	// Recursive shadowcasting over one octant, rows going out from the
+	// source. start and end are the slopes still lit, xx to yy map the
+	// octant's columns and rows onto the grid.
+	void castOctant(Source &s, const int row, float start, const float end,
+	const int xx, const int xy, const int yx, const int yy) {
+		if(start < end) return;
+		const int cx = s.x - x0, cy = s.y - y0, r = s.radius, r2 = r * r;
+		float nextStart = 0;
+		for(int j=row; j<=r; j++) {
+			bool blocked = false;
+			for(int dx=-j, dy=-j; dx<=0; dx++) {
+				const int gx = cx + dx * xx + dy * xy, gy = cy + dx * yx + dy * yy;
+				const float lSlope = (dx - 0.5f) / (dy + 0.5f),
+					rSlope = (dx + 0.5f) / (dy - 0.5f);
+				if(start < rSlope) continue;
+				if(end > lSlope) break;
+				const int d2 = dx * dx + dy * dy;
+				if(d2 <= r2 && gx >= 0 && gy >= 0 && gx < wd && gy < ht) {
+					s.cells.push_back(gy * wd + gx);
+					s.levels.push_back(s.intensity * (r2 - d2) / r2);
+				}
+				if(blocked) {
+					if(wall(gx, gy)) { nextStart = rSlope; continue; }
+					blocked = false;
+					start = nextStart;
+				} else if(wall(gx, gy) && j < r) {
+					blocked = true;
+					castOctant(s, j + 1, start, lSlope, xx, xy, yx, yy);
+					nextStart = rSlope;
+				}
+			}
+			if(blocked) break;
+		}
+	}
+
+	// Casts a source over its radius
+	void cast(Source &s) {
+		static const int oct[8][4] = {
+			{1, 0, 0, 1}, {0, 1, 1, 0}, {0, -1, 1, 0}, {-1, 0, 0, 1},
+			{-1, 0, 0, -1}, {0, -1, -1, 0}, {0, 1, -1, 0}, {1, 0, 0, -1}};
+		s.cells.clear();
+		s.levels.clear();
+		const int cx = s.x - x0, cy = s.y - y0;
+		if(cx >= 0 && cy >= 0 && cx < wd && cy < ht) {
+			s.cells.push_back(cy * wd + cx);
+			s.levels.push_back(s.intensity);
+			for(int o=0; o<8; o++)
+				castOctant(s, 1, 1.0f, 0.0f, oct[o][0], oct[o][1], oct[o][2], oct[o][3]);
+		}
+		s.dirty = false;
+	}
+
+	public:
+		// display - the display whose structs are the walls
+		// blockCodes - the collision codes that can't be seen through
+		// x, y, width, height - the world region to cast in,
+		//   everything outside of it is dark and hidden
+		// jobSystem - casts the sources in parallel when given
+		FieldOfView(CharDisplay *disp, const vector<unsigned int> &blockCodes,
+		const unsigned short x, const unsigned short y,
+		const unsigned short width, const unsigned short height,
+		JobSystem *jobSystem = NULL) {
+			display = disp;
+			codes = blockCodes;
+			x0 = x; y0 = y;
+			wd = width; ht = height;
+			jobs = jobSystem;
+			castCt = 0;
+			readWalls(opaque);
+			built = CharStruct::tick();
+			seen.resize(x0, y0, wd, ht);
+			light.assign(wd * ht, 0);
+			lastLit.assign(wd * ht, 0);
+		}
+
+		// =======
+		// Sources
+		// =======
+
+		// Adds something that sees radius cells around it. Returns its id.
+		unsigned int addViewer(const unsigned short x, const unsigned short y,
+		const unsigned short radius) {
+			return addLight(x, y, radius, 0);
+		}
+
+		// Adds a light that is intensity bright at x, y and fades out
+		// to nothing radius cells away. Returns its id.
+		unsigned int addLight(const unsigned short x, const unsigned short y,
+		const unsigned short radius, const unsigned char intensity) {
+			Source s;
+			s.x = x; s.y = y;
+			s.radius = radius;
+			s.intensity = intensity;
+			s.live = true;
+			s.dirty = true;
+			sources.push_back(s);
+			return sources.size() - 1;
+		}
+
+		// Moves a source, it is cast again on the next update() if it moved
+		void move(const unsigned int id, const unsigned short x, const unsigned short y) {
+			if(id >= sources.size()) return;
+			Source &s = sources[id];
+			if(s.x == x && s.y == y) return;
+			s.x = x; s.y = y;
+			s.dirty = true;
+		}
+
+		// Removes a source, its id is not reused
+		bool remove(const unsigned int id) {
+			if(id >= sources.size() || !sources[id].live) return false;
+			Source &s = sources[id];
+			s.live = false;
+			s.dirty = true;
+			return true;
+		}
+
+		// Casts every source that moved or had a wall change in its radius,
+		// and rebuilds the mask and light levels if any was cast.
+		// Call this once a frame before drawing. Returns true if the
+		// mask or the light changed, meaning the display should be redrawn.
+		bool update() {
+			refreshWalls();
+			vector<unsigned int> todo;
+			bool changed = false;
+			for(unsigned int i=0; i<sources.size(); i++) {
+				if(!sources[i].dirty) continue;
+				changed = true;
+				if(sources[i].live) todo.push_back(i);
+				else {
+					sources[i].dirty = false;
+					sources[i].cells.clear();
+					sources[i].levels.clear();
+				}
+			}
+			if(!changed) return false;
+			if(jobs != NULL && todo.size() > 1)
+				jobs -> parallelEach(0, todo.size(), 1, [this, &todo](const unsigned int k) {
+					cast(sources[todo[k]]);
+				});
+			else
+				for(unsigned int k=0; k<todo.size(); k++) cast(sources[todo[k]]);
+			castCt += todo.size();
+
+			// combine, viewers into the mask and lights into the levels
+			seen.clear();
+			fill(light.begin(), light.end(), 0);
+			fill(lastLit.begin(), lastLit.end(), 0);
+			for(unsigned int i=0; i<sources.size(); i++) {
+				const Source &s = sources[i];
+				if(!s.live) continue;
+				if(s.intensity == 0) {
+					for(unsigned int k=0; k<s.cells.size(); k++)
+						seen.set(x0 + s.cells[k] % wd, y0 + s.cells[k] / wd);
+					continue;
+				}
+				for(unsigned int k=0; k<s.cells.size(); k++) {
+					if(lastLit[s.cells[k]] == i + 1) continue;
+					lastLit[s.cells[k]] = i + 1;
+					unsigned char &l = light[s.cells[k]];
+					l = (l + s.levels[k] > 255) ? 255 : l + s.levels[k];
+				}
+			}
+			return true;
+		}
+
+		// Casts every source again on the next update(), for walls changed
+		// in ways the stamps can't see, such as a subclass changing its shape
+		void invalidate() {
+			built = 0;
+			for(unsigned int i=0; i<sources.size(); i++) sources[i].dirty = true;
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		// what the viewers can see, for CharDisplay::setVisibility()
+		const VisMask& visibility() { return seen; }
+		// whether any viewer can see a world cell
+		bool visible(const unsigned short x, const unsigned short y) {
+			return seen.visible(x, y);
+		}
+		// how much light reaches a world cell, 0 to 255
+		const unsigned char lightAt(const unsigned short x, const unsigned short y) {
+			const unsigned short gx = x - x0, gy = y - y0;
+			if(gx >= wd || gy >= ht) return 0;
+			return light[gy * wd + gx];
+		}
+		// whether a world cell blocks sight
+		bool opaqueAt(const unsigned short x, const unsigned short y) {
+			const unsigned short gx = x - x0, gy = y - y0;
+			return gx < wd && gy < ht && opaque[gy * wd + gx];
+		}
+		// how many times a source has been cast, to check that only
+		// the sources that had to be were
+		const unsigned int casts() { return castCt; }
+		const unsigned int sourceCt() { return sources.size(); }
+};
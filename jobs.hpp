@@ -0,0 +1,290 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "engine.hpp"
+using namespace std;
+
+// =========================================
+// Job system
+// ----------------------------------------
+// Spreads per-frame game logic, such as
+// updating every entity, over every core.
+//
+// Each worker thread has its own queue of
+// jobs. It takes new work from the back of
+// its own queue and, when that runs dry,
+// steals from the front of someone else's.
+// A thread that waits on a JobCounter runs
+// jobs while it waits instead of blocking,
+// so the game thread works too.
+//
+// Jobs are small: a callable of up to 48
+// bytes copied into the job itself, so
+// scheduling one never allocates. Lambdas
+// capturing a few pointers, references or
+// numbers all fit.
+// =========================================
+
+class JobSystem;
+class JobCounter;
+
+// A unit of work and the counter to tick down when it is done
+class Job {
+	alignas(16) unsigned char store[48]; // the callable, copied in
+	void (*call)(void*);
+	JobCounter* counter;
+
+	friend class JobSystem;
+	public:
+		Job() { call = NULL; counter = NULL; }
+
+		template<class F>
+		Job(const F &f, JobCounter* done) {
+			static_assert(sizeof(F) <= sizeof(store), "job callable is too big");
+			static_assert(is_trivially_copyable<F>::value,
+				"job callables are copied as bytes, capture pointers or references");
+			memcpy(store, (const void*)&f, sizeof(F));
+			call = [](void* p) { (*(F*)p)(); };
+			counter = done;
+		}
+};
+
+// Counts the jobs that are still to be done. A job can also be
+// scheduled to start only once a counter reaches zero.
+class JobCounter {
+	atomic<int> left;
+	mutex m;
+	vector<Job> next; // jobs waiting for this counter to reach zero
+
+	friend class JobSystem;
+	public:
+		JobCounter() : left(0) {}
+
+		// whether every job counted has finished
+		bool done() { return left.load(memory_order_acquire) == 0; }
+		// how many are left
+		int pending() { return left.load(memory_order_acquire); }
+};
+
+class JobSystem {
+	// one queue per worker, plus queue 0 for threads outside the system.
+	// A ring that only allocates when it grows, so a steady frame doesn't.
+	struct WorkQueue {
+		mutex m;
+		vector<Job> ring; // size is a power of two
+		unsigned int head, count;
+
+		WorkQueue() : ring(64) { head = 0; count = 0; }
+
+		bool empty() { return count == 0; }
+
+		void push(const Job &job) {
+			if(count == ring.size()) {
+				vector<Job> bigger(ring.size() * 2);
+				for(unsigned int i=0; i<count; i++)
+					bigger[i] = ring[(head + i) & (ring.size() - 1)];
+				ring.swap(bigger);
+				head = 0;
+			}
+			ring[(head + count++) & (ring.size() - 1)] = job;
+		}
+
+		Job& back() { return ring[(head + count - 1) & (ring.size() - 1)]; }
+		void popBack() { count--; }
+
+		Job& front() { return ring[head]; }
+		void popFront() { head = (head + 1) & (ring.size() - 1); count--; }
+	};
+	vector<unique_ptr<WorkQueue>> queues;
+	vector<thread> workers;
+	atomic<bool> running;
+	atomic<int> queued; // jobs sitting in any queue
+	mutex sleepM;
+	condition_variable wake;
+	JobCounter frameJobs; // jobs that have to finish before rasterizing
+
+	// which queue the current thread owns
+	inline static thread_local JobSystem* tlsSystem = NULL;
+	inline static thread_local unsigned int tlsQueue = 0;
+
+	unsigned int mine() { return tlsSystem == this ? tlsQueue : 0; }
+
+	void push(const Job &job) {
+		WorkQueue &q = *queues[mine()];
+		{
+			lock_guard<mutex> lock(q.m);
+			q.push(job);
+		}
+		queued.fetch_add(1, memory_order_release);
+		// a worker checks queued under sleepM before it sleeps,
+		// so taking it here means the notify can't land in between
+		{ lock_guard<mutex> lock(sleepM); }
+		wake.notify_one();
+	}
+
+	// Own queue from the back first, newest work is still in cache,
+	// then the oldest work of every other queue.
+	bool pop(Job &out) {
+		if(queued.load(memory_order_acquire) == 0) return false;
+		const unsigned int self = mine(), n = queues.size();
+		for(unsigned int k=0; k<n; k++) {
+			WorkQueue &q = *queues[(self + k) % n];
+			lock_guard<mutex> lock(q.m);
+			if(q.empty()) continue;
+			if(k == 0) { out = q.back(); q.popBack(); }
+			else { out = q.front(); q.popFront(); }
+			queued.fetch_sub(1, memory_order_relaxed);
+			return true;
+		}
+		return false;
+	}
+
+	void execute(Job &job) {
+		job.call(job.store);
+		finish(job.counter);
+	}
+
+	// Ticks a counter down, and starts the jobs waiting on it at zero.
+	// The counter is only touched under its lock, see wait(). The jobs
+	// are queued under it too, which keeps the list's room for next time.
+	void finish(JobCounter* c) {
+		if(c == NULL) return;
+		lock_guard<mutex> lock(c -> m);
+		if(c -> left.fetch_sub(1, memory_order_acq_rel) != 1) return;
+		for(unsigned int i=0; i<c -> next.size(); i++)
+			push(c -> next[i]);
+		c -> next.clear();
+	}
+
+	void work(const unsigned int index) {
+		tlsSystem = this;
+		tlsQueue = index;
+		Job job;
+		while(running.load(memory_order_acquire)) {
+			if(pop(job)) { execute(job); continue; }
+			// spin briefly before sleeping, more jobs usually follow
+			bool found = false;
+			for(int i=0; i<64 && !found; i++) {
+				this_thread::yield();
+				found = queued.load(memory_order_acquire) > 0;
+			}
+			if(found) continue;
+			unique_lock<mutex> lock(sleepM);
+			wake.wait(lock, [this]() {
+				return queued.load(memory_order_acquire) > 0 || !running.load();
+			});
+		}
+	}
+
+	public:
+		// threads - how many worker threads to start, by default
+		// one less than the cores so the game thread has one too
+		JobSystem(unsigned int threads = 0) : running(true), queued(0) {
+			if(threads == 0) {
+				const unsigned int cores = thread::hardware_concurrency();
+				threads = cores > 1 ? cores - 1 : 1;
+			}
+			for(unsigned int i=0; i<=threads; i++)
+				queues.emplace_back(new WorkQueue());
+			for(unsigned int i=1; i<=threads; i++)
+				workers.emplace_back(&JobSystem::work, this, i);
+		}
+
+		~JobSystem() {
+			wait(frameJobs);
+			{
+				lock_guard<mutex> lock(sleepM);
+				running = false;
+			}
+			wake.notify_all();
+			for(unsigned int i=0; i<workers.size(); i++)
+				workers[i].join();
+		}
+
+		// ==========
+		// Scheduling
+		// ==========
+
+		// Runs f on some thread and ticks done down when it finishes.
+		// If after is given, f doesn't start until after reaches zero.
+		template<class F>
+		void run(const F &f, JobCounter &done, JobCounter* after = NULL) {
+			done.left.fetch_add(1, memory_order_relaxed);
+			Job job(f, &done);
+			if(after != NULL) {
+				lock_guard<mutex> lock(after -> m);
+				if(after -> left.load(memory_order_acquire) > 0) {
+					after -> next.push_back(job);
+					return;
+				}
+			}
+			push(job);
+		}
+
+		// Runs jobs until the counter reaches zero
+		void wait(JobCounter &c) {
+			Job job;
+			while(!c.done()) {
+				if(pop(job)) execute(job);
+				else this_thread::yield();
+			}
+			// the last finish() may still hold the lock,
+			// and the counter can go out of scope after this
+			lock_guard<mutex> lock(c.m);
+		}
+
+		// Calls fn(begin, end) over [first, last) in chunks of grain
+		// spread across the threads, and returns once every chunk is done
+		template<class F>
+		void parallelFor(const unsigned int first, const unsigned int last,
+		const unsigned int grain, const F &fn) {
+			JobCounter done;
+			const unsigned int step = grain > 0 ? grain : 1;
+			for(unsigned int i=first; i<last; i += step) {
+				const unsigned int end = (last - i > step) ? i + step : last;
+				run([&fn, i, end]() { fn(i, end); }, done);
+			}
+			wait(done);
+		}
+
+		// Calls fn(i) for every i in [first, last), see parallelFor
+		template<class F>
+		void parallelEach(const unsigned int first, const unsigned int last,
+		const unsigned int grain, const F &fn) {
+			parallelFor(first, last, grain, [&fn](const unsigned int b, const unsigned int e) {
+				for(unsigned int i=b; i<e; i++) fn(i);
+			});
+		}
+
+		// ===============
+		// Frame functions
+		// ===============
+
+		// Runs f as part of the current frame, see endFrame()
+		template<class F>
+		void runFrame(const F &f, JobCounter* after = NULL) {
+			run(f, frameJobs, after);
+		}
+
+		// Waits for every job of the current frame to finish
+		void endFrame() { wait(frameJobs); }
+
+		// Makes the display finish the frame's jobs before it rasterizes
+		// anything, so game code can't forget to join before drawing
+		void joinBefore(CharDisplay &display) {
+			display.setBeforeWrite([this]() { endFrame(); });
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		// worker threads, not counting threads that help while waiting
+		const unsigned int threads() { return workers.size(); }
+};
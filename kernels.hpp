@@ -0,0 +1,200 @@
+#pragma once
+#include <cstddef>
+#include "cell.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CELLKERNELS_X86
+#endif
+using namespace std;
+
+// =========================================
+// Cell kernels
+// ----------------------------------------
+// The loops that every frame runs over the
+// whole display: clearing, filling spans,
+// copying spans and comparing the new frame
+// to the one the terminal already shows.
+//
+// Each kernel has an AVX2, an SSE2 and a
+// plain version, and the fastest one the
+// CPU supports is picked the first time the
+// kernels are used. Call them through the
+// cellFill, cellCopy, cellMismatch and
+// cellMatch functions at the bottom.
+// =========================================
+
+// ==============
+// Plain versions
+// ==============
+
+inline void cellFillScalar(Cell* dst, size_t n, const Cell c) {
+	for(size_t i=0; i<n; i++) dst[i] = c;
+}
+
+inline void cellCopyScalar(Cell* dst, const Cell* src, size_t n) {
+	for(size_t i=0; i<n; i++) dst[i] = src[i];
+}
+
+// index of the first cell that differs, or n if none do
+inline size_t cellMismatchScalar(const Cell* a, const Cell* b, size_t n) {
+	size_t i = 0;
+	while(i < n && a[i] == b[i]) i++;
+	return i;
+}
+
+// index of the first cell that is the same, or n if none are
+inline size_t cellMatchScalar(const Cell* a, const Cell* b, size_t n) {
+	size_t i = 0;
+	while(i < n && a[i] != b[i]) i++;
+	return i;
+}
+
+#ifdef CELLKERNELS_X86
+
+// =============================
+// SSE2 versions, 2 cells a step
+// =============================
+
+__attribute__((target("sse2")))
+inline void cellFillSSE2(Cell* dst, size_t n, const Cell c) {
+	const __m128i v = _mm_set1_epi64x(c);
+	size_t i = 0;
+	for(; i + 2 <= n; i += 2)
+		_mm_storeu_si128((__m128i*)(dst + i), v);
+	for(; i<n; i++) dst[i] = c;
+}
+
+__attribute__((target("sse2")))
+inline void cellCopySSE2(Cell* dst, const Cell* src, size_t n) {
+	size_t i = 0;
+	for(; i + 2 <= n; i += 2)
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_loadu_si128((const __m128i*)(src + i)));
+	for(; i<n; i++) dst[i] = src[i];
+}
+
+// SSE2 has no 64 bit compare, so compare 32 bit halves
+// and treat a cell as equal when all 8 of its mask bits are set
+__attribute__((target("sse2")))
+inline size_t cellMismatchSSE2(const Cell* a, const Cell* b, size_t n) {
+	size_t i = 0;
+	for(; i + 2 <= n; i += 2) {
+		const int m = _mm_movemask_epi8(_mm_cmpeq_epi32(
+			_mm_loadu_si128((const __m128i*)(a + i)),
+			_mm_loadu_si128((const __m128i*)(b + i))));
+		if(m != 0xFFFF) return i + ((m & 0xFF) == 0xFF ? 1 : 0);
+	}
+	return i + cellMismatchScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+inline size_t cellMatchSSE2(const Cell* a, const Cell* b, size_t n) {
+	size_t i = 0;
+	for(; i + 2 <= n; i += 2) {
+		const int m = _mm_movemask_epi8(_mm_cmpeq_epi32(
+			_mm_loadu_si128((const __m128i*)(a + i)),
+			_mm_loadu_si128((const __m128i*)(b + i))));
+		if((m & 0xFF) == 0xFF) return i;
+		if((m & 0xFF00) == 0xFF00) return i + 1;
+	}
+	return i + cellMatchScalar(a + i, b + i, n - i);
+}
+
+// =============================
+// AVX2 versions, 4 cells a step
+// =============================
+
+__attribute__((target("avx2")))
+inline void cellFillAVX2(Cell* dst, size_t n, const Cell c) {
+	const __m256i v = _mm256_set1_epi64x(c);
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4)
+		_mm256_storeu_si256((__m256i*)(dst + i), v);
+	for(; i<n; i++) dst[i] = c;
+}
+
+__attribute__((target("avx2")))
+inline void cellCopyAVX2(Cell* dst, const Cell* src, size_t n) {
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4)
+		_mm256_storeu_si256((__m256i*)(dst + i),
+			_mm256_loadu_si256((const __m256i*)(src + i)));
+	for(; i<n; i++) dst[i] = src[i];
+}
+
+// one mask bit per cell, set where the cells are equal
+__attribute__((target("avx2")))
+inline int cellEqMaskAVX2(const Cell* a, const Cell* b) {
+	return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(
+		_mm256_loadu_si256((const __m256i*)a),
+		_mm256_loadu_si256((const __m256i*)b))));
+}
+
+__attribute__((target("avx2")))
+inline size_t cellMismatchAVX2(const Cell* a, const Cell* b, size_t n) {
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) {
+		const int m = cellEqMaskAVX2(a + i, b + i);
+		if(m != 0xF) return i + __builtin_ctz(~m);
+	}
+	return i + cellMismatchScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline size_t cellMatchAVX2(const Cell* a, const Cell* b, size_t n) {
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4) {
+		const int m = cellEqMaskAVX2(a + i, b + i);
+		if(m != 0) return i + __builtin_ctz(m);
+	}
+	return i + cellMatchScalar(a + i, b + i, n - i);
+}
+
+#endif
+
+// =================
+// Runtime dispatch
+// =================
+
+// The set of kernels in use
+struct CellKernels {
+	void (*fill)(Cell*, size_t, const Cell);
+	void (*copy)(Cell*, const Cell*, size_t);
+	size_t (*mismatch)(const Cell*, const Cell*, size_t);
+	size_t (*match)(const Cell*, const Cell*, size_t);
+	const char* name; // "avx2", "sse2" or "scalar"
+};
+
+// Picks the kernels once, by what the CPU supports
+inline const CellKernels& cellKernels() {
+	static const CellKernels k = []() {
+#ifdef CELLKERNELS_X86
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2"))
+			return CellKernels { cellFillAVX2, cellCopyAVX2,
+				cellMismatchAVX2, cellMatchAVX2, "avx2" };
+		if(__builtin_cpu_supports("sse2"))
+			return CellKernels { cellFillSSE2, cellCopySSE2,
+				cellMismatchSSE2, cellMatchSSE2, "sse2" };
+#endif
+		return CellKernels { cellFillScalar, cellCopyScalar,
+			cellMismatchScalar, cellMatchScalar, "scalar" };
+	}();
+	return k;
+}
+
+// Sets n cells starting at dst to c
+inline void cellFill(Cell* dst, const size_t n, const Cell c)
+{ cellKernels().fill(dst, n, c); }
+
+// Copies n cells from src to dst, the spans must not overlap
+inline void cellCopy(Cell* dst, const Cell* src, const size_t n)
+{ cellKernels().copy(dst, src, n); }
+
+// Index of the first of n cells where a and b differ, or n if none do
+inline size_t cellMismatch(const Cell* a, const Cell* b, const size_t n)
+{ return cellKernels().mismatch(a, b, n); }
+
+// Index of the first of n cells where a and b are the same, or n if none are.
+// Together with cellMismatch this walks the changed runs between two frames.
+inline size_t cellMatch(const Cell* a, const Cell* b, const size_t n)
+{ return cellKernels().match(a, b, n); }
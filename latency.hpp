@@ -0,0 +1,201 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <vector>
+using namespace std;
+
+// =========================================
+// Input latency tracing
+// ----------------------------------------
+// Measures what a player feels: the time
+// from a key being read until the frame it
+// changed has been written to the terminal.
+//
+// Each batch of keys read is stamped as an
+// input. The next frame that is drawn takes
+// every input waiting, and when the window
+// sends a frame to the terminal every input
+// taken by that frame or an earlier one is
+// done. Its latency goes in a histogram that
+// gives percentiles.
+//
+// The EventLoop stamps inputs and frames and
+// the window records flushes, so all it
+// takes is handing both the same trace:
+//
+//   LatencyTrace trace;
+//   window -> setTrace(&trace, true); // true to show it in the corner
+//   loop.setTrace(&trace);
+//   ...
+//   printf("%s\n", trace.describe(text, sizeof(text)));
+//
+// A Presenter numbers the frames it publishes
+// with the window's trace, so with one a frame
+// is only done once the render thread has
+// shown it. Programs with their own loop call
+// input() and frame() themselves.
+// =========================================
+
+// Counts of durations in buckets that grow with the duration, 8 for each
+// power of two, so any percentile is within an eighth of the real one
+class LatencyHistogram {
+	static const unsigned int SUB = 8;
+	vector<uint64_t> counts;
+	uint64_t total, sum, lowest, highest; // in microseconds
+
+	static unsigned int bucketOf(const uint64_t us) {
+		if(us < SUB) return us;
+		const unsigned int top = 63 - __builtin_clzll(us);
+		return (top - 2) * SUB + ((us >> (top - 3)) & (SUB - 1));
+	}
+
+	// the largest duration in a bucket
+	static uint64_t upperOf(const unsigned int b) {
+		if(b < SUB) return b;
+		const unsigned int top = b / SUB + 2;
+		return (((uint64_t)(SUB + b % SUB) + 1) << (top - 3)) - 1;
+	}
+
+	public:
+		LatencyHistogram() : counts(64 * SUB, 0) { reset(); }
+
+		void add(const uint64_t us) {
+			counts[bucketOf(us)]++;
+			total++;
+			sum += us;
+			if(us < lowest) lowest = us;
+			if(us > highest) highest = us;
+		}
+
+		void reset() {
+			fill(counts.begin(), counts.end(), 0);
+			total = 0; sum = 0;
+			lowest = UINT64_MAX; highest = 0;
+		}
+
+		// The duration p percent of samples are at or under, in microseconds
+		const uint64_t percentile(const double p) const {
+			if(total == 0) return 0;
+			uint64_t want = (uint64_t)(p / 100.0 * total + 0.5);
+			if(want < 1) want = 1;
+			uint64_t seen = 0;
+			for(unsigned int b=0; b<counts.size(); b++) {
+				seen += counts[b];
+				if(seen >= want) return upperOf(b) < highest ? upperOf(b) : highest;
+			}
+			return highest;
+		}
+
+		// getter methods
+		const uint64_t count() const { return total; }
+		const uint64_t min() const { return total == 0 ? 0 : lowest; }
+		const uint64_t max() const { return highest; }
+		const double mean() const { return total == 0 ? 0 : (double)sum / total; }
+};
+
+class LatencyTrace {
+	// an input and the frame that took it, 0 until one does
+	struct Input {
+		uint64_t at; // nanoseconds on the monotonic clock
+		unsigned long long frame;
+	};
+
+	mutex m; // flushes can come from a render thread
+	deque<Input> inputs; // oldest first, the ones taken by a frame first
+	size_t taken; // how many of inputs a frame has taken
+	unsigned long long frameSeq;
+	LatencyHistogram hist;
+	unsigned long long dropped;
+
+	static uint64_t now() {
+		timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+	}
+
+	// Records the inputs taken by frame f and those before it as done at t
+	void done(const unsigned long long f, const uint64_t t) {
+		while(taken > 0 && inputs.front().frame <= f) {
+			hist.add((t - inputs.front().at) / 1000);
+			inputs.pop_front();
+			taken--;
+		}
+	}
+
+	public:
+		LatencyTrace() {
+			taken = 0;
+			frameSeq = 0;
+			dropped = 0;
+		}
+
+		// Stamps an input as read just now
+		void input() {
+			const uint64_t t = now();
+			lock_guard<mutex> lock(m);
+			// inputs that never get a frame, such as keys a menu ignores
+			// while nothing redraws, aren't kept forever
+			if(inputs.size() >= 4096) {
+				inputs.pop_front();
+				if(taken > 0) taken--;
+				dropped++;
+			}
+			inputs.push_back({t, 0});
+		}
+
+		// A frame is being drawn and takes every input waiting.
+		// Returns the frame's number for flushed().
+		unsigned long long frame() {
+			lock_guard<mutex> lock(m);
+			frameSeq++;
+			for(; taken<inputs.size(); taken++) inputs[taken].frame = frameSeq;
+			return frameSeq;
+		}
+
+		// Frame f, and any before it, has been written to the terminal
+		void flushed(const unsigned long long f) {
+			const uint64_t t = now();
+			lock_guard<mutex> lock(m);
+			done(f, t);
+		}
+
+		// Every frame so far has been written to the terminal
+		void flushed() {
+			const uint64_t t = now();
+			lock_guard<mutex> lock(m);
+			done(frameSeq, t);
+		}
+
+		void reset() {
+			lock_guard<mutex> lock(m);
+			hist.reset();
+			dropped = 0;
+		}
+
+		// Writes a line like "key to screen p50 4.1 ms p99 9.8 ms (120)"
+		// into out, n bytes at most, and returns out
+		const char* describe(char* out, const size_t n) {
+			lock_guard<mutex> lock(m);
+			snprintf(out, n, "key to screen p50 %.1f ms p99 %.1f ms (%llu)",
+				hist.percentile(50) / 1000.0, hist.percentile(99) / 1000.0,
+				(unsigned long long)hist.count());
+			return out;
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		// A copy of the histogram of input to flush times so far
+		LatencyHistogram histogram() {
+			lock_guard<mutex> lock(m);
+			return hist;
+		}
+		// inputs that were given up on because no frame took them in time
+		const unsigned long long droppedCt() { lock_guard<mutex> lock(m); return dropped; }
+		const unsigned long long frames() { lock_guard<mutex> lock(m); return frameSeq; }
+};
@@ -0,0 +1,249 @@
+#pragma once
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "engine.hpp"
+using namespace std;
+
+// =========================================
+// Level importer
+// ----------------------------------------
+// Builds the structs of a level out of a
+// map drawn as text, so levels don't have
+// to be written out as code.
+//
+// Each glyph in the map is looked up in a
+// legend that says which collision code
+// and cell it stands for. Rather than one
+// CollChar per cell, cells are coalesced:
+// maximal runs and rectangles of the same
+// glyph become Lines and filled Boxes, and
+// a connected area of one collision code
+// that would still take many structs
+// becomes a single StoredGrid instead.
+// Fewer structs make every writeStructs()
+// and hasCollCode() after that cheaper.
+// =========================================
+
+// What a glyph in a map stands for
+struct LevelGlyph {
+	uint32_t glyph; // the character as it appears in the map
+	unsigned int collCode; // collision code of the structs made from it
+	Cell cell; // what is drawn for it, 0 to draw the glyph itself
+};
+
+// The structs imported from a map. They belong to the import until
+// they are handed to a display with addTo().
+class LevelImport {
+	vector<CharStruct *> structs;
+	unsigned int cellCt; // cells in the map that were in the legend
+	unsigned int skipCt; // cells in the map that were not, spaces aside
+	unsigned int charCt, lineCt, boxCt, gridCt; // structs of each type made
+
+	unsigned short wd, ht; // size of the map in cells
+	vector<int> ids; // legend index of each map cell, -1 if empty
+	vector<LevelGlyph> legend;
+
+	int idAt(const int x, const int y) {
+		if(x < 0 || y < 0 || x >= wd || y >= ht) return -1;
+		return ids[y * wd + x];
+	}
+
+	// Reads the map into ids, one UTF-8 character per column
+	void parse(const string &map) {
+		vector<vector<int>> rows(1);
+		size_t i = 0;
+		while(i < map.size()) {
+			const uint32_t cp = utf8Decode(map.data(), map.size(), i);
+			if(cp == '\n') { rows.emplace_back(); continue; }
+			int id = -1;
+			for(unsigned int k=0; k<legend.size(); k++)
+				if(legend[k].glyph == cp) { id = k; break; }
+			if(id == -1 && cp != ' ') skipCt++;
+			if(id != -1) cellCt++;
+			rows.back().push_back(id);
+		}
+		if(rows.back().empty()) rows.pop_back();
+		wd = 0;
+		ht = rows.size();
+		for(unsigned int y=0; y<rows.size(); y++)
+			if(rows[y].size() > wd) wd = rows[y].size();
+		ids.assign(wd * ht, -1);
+		for(unsigned int y=0; y<rows.size(); y++)
+			for(unsigned int x=0; x<rows[y].size(); x++)
+				ids[y * wd + x] = rows[y][x];
+	}
+
+	// The cell that a legend entry draws
+	Cell cellOfId(const int id) {
+		return legend[id].cell != 0 ? legend[id].cell : cellOf(legend[id].glyph);
+	}
+
+	// Makes the struct for a rectangle of one glyph, in map coordinates
+	void emitRect(const int id, const unsigned short x, const unsigned short y,
+	const unsigned short w, const unsigned short h,
+	const unsigned short xPos, const unsigned short yPos) {
+		const unsigned int code = legend[id].collCode;
+		const Cell c = cellOfId(id);
+		if(w == 1 && h == 1) {
+			CollChar* cc = new CollChar(code, cellByte(c), xPos + x, yPos + y);
+			cc -> setCell(c);
+			structs.push_back(cc);
+			charCt++;
+		} else if(w == 1 || h == 1) {
+			Line* ln = new Line(code, cellByte(c), w == 1 ? h : w,
+				xPos + x, yPos + y, w == 1);
+			ln -> setCell(c);
+			structs.push_back(ln);
+			lineCt++;
+		} else {
+			Box* bx = new Box(code, cellByte(c), xPos + x, yPos + y, true, true, w, h);
+			bx -> setCell(c);
+			structs.push_back(bx);
+			boxCt++;
+		}
+	}
+
+	// Splits the cells of one connected area into rectangles of the same glyph.
+	// From each cell it tries growing right then down and down then right,
+	// and keeps whichever rectangle is bigger. Rectangles are x, y, w, h.
+	vector<unsigned short> rects(const vector<unsigned int> &area, vector<bool> &used) {
+		vector<unsigned short> out;
+		for(unsigned int k=0; k<area.size(); k++) {
+			const unsigned int at = area[k];
+			if(used[at]) continue;
+			const int x = at % wd, y = at / wd, id = ids[at];
+			auto fits = [&](const int cx, const int cy) {
+				return idAt(cx, cy) == id && !used[cy * wd + cx];
+			};
+			// right then down
+			int wA = 1, hA = 1;
+			while(fits(x + wA, y)) wA++;
+			for(bool ok = true; ok; ) {
+				for(int i=0; i<wA && ok; i++) ok = fits(x + i, y + hA);
+				if(ok) hA++;
+			}
+			// down then right
+			int wB = 1, hB = 1;
+			while(fits(x, y + hB)) hB++;
+			for(bool ok = true; ok; ) {
+				for(int j=0; j<hB && ok; j++) ok = fits(x + wB, y + j);
+				if(ok) wB++;
+			}
+			const int w = (wA * hA >= wB * hB) ? wA : wB,
+				h = (wA * hA >= wB * hB) ? hA : hB;
+			for(int j=0; j<h; j++)
+				for(int i=0; i<w; i++)
+					used[(y + j) * wd + x + i] = true;
+			out.push_back(x); out.push_back(y);
+			out.push_back(w); out.push_back(h);
+		}
+		return out;
+	}
+
+	public:
+		// map - the level drawn as text, rows separated by newlines
+		// glyphs - what each glyph in the map stands for, spaces are empty
+		// xPos, yPos - where the top left of the map goes in the world
+		// gridMin - how many structs a connected area of one collision code
+		//   has to take before it is stored as a StoredGrid instead
+		LevelImport(const string &map, const vector<LevelGlyph> &glyphs,
+		const unsigned short xPos = 0, const unsigned short yPos = 0,
+		const unsigned short gridMin = 3) {
+			cellCt = 0; skipCt = 0;
+			charCt = 0; lineCt = 0; boxCt = 0; gridCt = 0;
+			legend = glyphs;
+			parse(map);
+
+			vector<bool> seen(wd * ht, false), used(wd * ht, false);
+			vector<unsigned int> area;
+			for(unsigned int start=0; start<ids.size(); start++) {
+				if(ids[start] == -1 || seen[start]) continue;
+				// flood the connected area of this collision code
+				const unsigned int code = legend[ids[start]].collCode;
+				area.clear();
+				area.push_back(start);
+				seen[start] = true;
+				unsigned short x0 = wd, y0 = ht, x1 = 0, y1 = 0;
+				for(unsigned int k=0; k<area.size(); k++) {
+					const int x = area[k] % wd, y = area[k] / wd;
+					if(x < x0) x0 = x;
+					if(y < y0) y0 = y;
+					if(x > x1) x1 = x;
+					if(y > y1) y1 = y;
+					const int nx[4] = {x + 1, x - 1, x, x}, ny[4] = {y, y, y + 1, y - 1};
+					for(int n=0; n<4; n++) {
+						const int id = idAt(nx[n], ny[n]);
+						const unsigned int at = ny[n] * wd + nx[n];
+						if(id != -1 && !seen[at] && legend[id].collCode == code) {
+							seen[at] = true;
+							area.push_back(at);
+						}
+					}
+				}
+				// rect order follows the map, so sort the area back into it
+				sort(area.begin(), area.end());
+				vector<unsigned short> rs = rects(area, used);
+				if(rs.size() / 4 >= gridMin) {
+					StoredGrid* grid = new StoredGrid(code, xPos + x0, yPos + y0,
+						x1 - x0 + 1, y1 - y0 + 1);
+					for(unsigned int k=0; k<area.size(); k++)
+						grid -> set(area[k] % wd - x0, area[k] / wd - y0,
+							cellOfId(ids[area[k]]), true);
+					structs.push_back(grid);
+					gridCt++;
+				} else {
+					for(unsigned int k=0; k<rs.size(); k += 4)
+						emitRect(ids[rs[k+1] * wd + rs[k]],
+							rs[k], rs[k+1], rs[k+2], rs[k+3], xPos, yPos);
+				}
+			}
+		}
+
+		~LevelImport() {
+			for(unsigned int i=0; i<structs.size(); i++)
+				delete(structs[i]);
+		}
+
+		// Hands every imported struct over to a display, which deletes them.
+		// Returns how many were added.
+		unsigned int addTo(CharDisplay &display) {
+			const unsigned int ct = structs.size();
+			for(unsigned int i=0; i<structs.size(); i++)
+				display.addStruct(structs[i]);
+			structs.clear();
+			return ct;
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		// structs that are still held by the import
+		const vector<CharStruct *> &imported() { return structs; }
+		// how many structs the map became
+		const unsigned int structCt() { return charCt + lineCt + boxCt + gridCt; }
+		// how many structs it would have taken with one per cell
+		const unsigned int cells() { return cellCt; }
+		// glyphs in the map that were not in the legend
+		const unsigned int skipped() { return skipCt; }
+		const unsigned int collChars() { return charCt; }
+		const unsigned int lines() { return lineCt; }
+		const unsigned int boxes() { return boxCt; }
+		const unsigned int grids() { return gridCt; }
+		// how many times fewer structs there are than cells
+		const double reduction() {
+			return structCt() ? (double)cellCt / structCt() : 0;
+		}
+
+		// A line saying what the map became, for logs
+		string summary() {
+			char line[160];
+			snprintf(line, sizeof(line),
+				"%u cells -> %u structs (%u Lines, %u Boxes, %u StoredGrids, "
+				"%u CollChars), %.1fx fewer",
+				cellCt, structCt(), lineCt, boxCt, gridCt, charCt, reduction());
+			return line;
+		}
+};
@@ -0,0 +1,284 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <functional>
+#include <vector>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include "ascii.hpp"
+#include "timers.hpp"
+using namespace std;
+
+// =========================================
+// Event loop
+// ----------------------------------------
+// Runs a program off of what happens instead
+// of waking every few milliseconds to check.
+// The loop sleeps in poll() on the terminal,
+// a timer and a wake up fd, and does nothing
+// at all until a key is pressed, a scheduled
+// event comes due, or another thread calls
+// wake(). It draws a frame only after one of
+// those asked for it with redraw().
+//
+//   EventLoop loop(window);
+//   loop.onKeys([&](const char* keys, unsigned int n) { ...; loop.redraw(); });
+//   loop.onFrame([&]() { display.redrawStructs(); display.update(); });
+//   loop.every(125, [&]() { moveMonsters(); loop.redraw(); });
+//   loop.run();
+//
+// A menu or a turn based game sleeps until
+// the next key and wakes within a fraction
+// of a millisecond of it.
+//
+// after() and every() are for the program's
+// own handful of events. Game events, as many
+// as there are, go on the loop's timing wheel,
+// see wheel() and timers.hpp.
+// =========================================
+
+class EventLoop {
+	// A scheduled event
+	struct Timer {
+		uint64_t due; // nanoseconds on the monotonic clock
+		uint64_t every; // nanoseconds between repeats, 0 to run once
+		unsigned int id;
+		function<void()> fn;
+	};
+
+	ASCIIWindow *win;
+	int timerFd, wakeFd;
+	bool running;
+	bool dirty; // whether a frame was asked for
+	bool raw; // whether keys are read from the terminal instead of the window
+	vector<Timer> timers;
+	unsigned int nextId;
+	TimerWheel timerWheel; // game events, in milliseconds since started
+	uint64_t started;
+	function<void(const char*, unsigned int)> keyFn;
+	function<void()> frameFn;
+	LatencyTrace *trace; // stamped with keys read and frames drawn, or NULL
+	unsigned long long wakeCt, frameCt;
+
+	static uint64_t now() {
+		timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+	}
+
+	// Sets the timer fd to go off when the earliest event is due
+	void arm() {
+		itimerspec spec = {};
+		uint64_t due = 0;
+		for(unsigned int i=0; i<timers.size(); i++)
+			if(due == 0 || timers[i].due < due) due = timers[i].due;
+		const uint64_t tick = timerWheel.nextDue();
+		if(tick != UINT64_MAX) {
+			const uint64_t wheelDue = started + tick * 1000000;
+			if(due == 0 || wheelDue < due) due = wheelDue;
+		}
+		if(due != 0) {
+			spec.it_value.tv_sec = due / 1000000000ull;
+			spec.it_value.tv_nsec = due % 1000000000ull;
+		}
+		// an all zero value disarms it
+		timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+	}
+
+	// Runs the events that are due, in the order they were due
+	void fire() {
+		const uint64_t t = now();
+		while(true) {
+			int first = -1;
+			for(unsigned int i=0; i<timers.size(); i++)
+				if(timers[i].due <= t && (first == -1 || timers[i].due < timers[first].due))
+					first = i;
+			if(first == -1) break;
+			// moved out, since fn can add or cancel events,
+			// and moved back after so a repeat never copies it
+			function<void()> fn;
+			fn.swap(timers[first].fn);
+			const unsigned int id = timers[first].id;
+			const bool repeats = timers[first].every != 0;
+			if(repeats) {
+				// skip repeats missed while the program was busy
+				Timer &tm = timers[first];
+				while(tm.due <= t) tm.due += tm.every;
+			} else timers.erase(timers.begin() + first);
+			fn();
+			if(repeats) {
+				for(unsigned int i=0; i<timers.size(); i++)
+					if(timers[i].id == id) timers[i].fn.swap(fn); // unless it was cancelled
+			}
+		}
+	}
+
+	// Reads every key waiting at the terminal
+	void readKeys() {
+		char keys[64];
+		if(raw) {
+			// poll() said there is input, so this doesn't block
+			const ssize_t n = read(win -> inputFd(), keys, sizeof(keys));
+			if(n > 0 && trace != NULL) trace -> input();
+			if(n > 0 && keyFn) keyFn(keys, n);
+			return;
+		}
+		unsigned int n = 0;
+		char key;
+		while((key = win -> getKey()) != -1) {
+			if(n == 0 && trace != NULL) trace -> input();
+			keys[n++] = key;
+			if(n == sizeof(keys)) {
+				if(keyFn) keyFn(keys, n);
+				n = 0;
+			}
+		}
+		if(n > 0 && keyFn) keyFn(keys, n);
+	}
+
+	unsigned int add(const uint64_t delay, const uint64_t every, const function<void()> &fn) {
+		Timer t;
+		t.due = now() + delay;
+		t.every = every;
+		t.id = nextId++;
+		t.fn = fn;
+		timers.push_back(t);
+		return t.id;
+	}
+
+	public:
+		// window - the window whose keys are read, it is set to
+		//   real time so reading keys never blocks
+		EventLoop(ASCIIWindow *window) {
+			win = window;
+			timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			running = false;
+			dirty = true; // the first frame
+			raw = false;
+			nextId = 1;
+			started = now();
+			trace = NULL;
+			wakeCt = 0; frameCt = 0;
+		}
+
+		~EventLoop() {
+			close(timerFd);
+			close(wakeFd);
+		}
+
+		// ==========
+		// Callbacks
+		// ==========
+
+		// Called with the keys read each time the terminal has input, in order.
+		// Escape sequences such as arrow keys come in as one batch.
+		void onKeys(const function<void(const char*, unsigned int)> &fn) { keyFn = fn; }
+
+		// Called to draw a frame, once per wake up that asked for one
+		void onFrame(const function<void()> &fn) { frameFn = fn; }
+
+		// Runs fn once, ms milliseconds from now. Returns an id for cancel().
+		unsigned int after(const unsigned int ms, const function<void()> &fn) {
+			return add((uint64_t)ms * 1000000, 0, fn);
+		}
+
+		// Runs fn every ms milliseconds from now on. Returns an id for cancel().
+		unsigned int every(const unsigned int ms, const function<void()> &fn) {
+			const uint64_t ns = (uint64_t)(ms > 0 ? ms : 1) * 1000000;
+			return add(ns, ns, fn);
+		}
+
+		// The timing wheel for game events, in milliseconds. It is run
+		// whenever the loop wakes and the loop wakes for it.
+		TimerWheel& wheel() { return timerWheel; }
+
+		// Stops a scheduled event, returns true if it was still scheduled
+		bool cancel(const unsigned int id) {
+			for(unsigned int i=0; i<timers.size(); i++) {
+				if(timers[i].id == id) {
+					timers.erase(timers.begin() + i);
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// =======
+		// Control
+		// =======
+
+		// Asks for a frame once the current wake up is handled
+		void redraw() { dirty = true; }
+
+		// Wakes the loop from any thread and asks for a frame,
+		// such as when a job or a network thread changed the scene
+		void wake() {
+			const uint64_t one = 1;
+			if(write(wakeFd, &one, sizeof(one)) < 0) {} // full means it will wake
+		}
+
+		// Reads keys straight from the terminal instead of through the
+		// window, for when another thread owns the window (see Presenter).
+		// The window has to be set to real time before that thread starts.
+		void setRawKeys(const bool readRaw) { raw = readRaw; }
+
+		// Stamps a trace with every batch of keys read and every frame drawn,
+		// NULL to stop. See latency.hpp.
+		void setTrace(LatencyTrace *latency) { trace = latency; }
+
+		// Makes run() return after the current wake up
+		void stop() { running = false; }
+
+		// Sleeps until something happens, handles it, and draws a frame
+		// if anything asked for one, until stop() is called
+		void run() {
+			if(!raw) win -> initRealTime();
+			running = true;
+			pollfd fds[3] = {
+				{win -> inputFd(), POLLIN, 0}, {timerFd, POLLIN, 0}, {wakeFd, POLLIN, 0}};
+			// keys typed before the loop started
+			if(!raw) readKeys();
+			while(running) {
+				if(dirty && frameFn) {
+					dirty = false;
+					if(trace != NULL) trace -> frame();
+					frameFn();
+					frameCt++;
+				}
+				dirty = false;
+				if(!running) break;
+				arm();
+				if(poll(fds, 3, -1) < 0) continue; // a signal, go around
+				wakeCt++;
+				uint64_t count;
+				if(fds[1].revents & POLLIN) {
+					if(read(timerFd, &count, sizeof(count)) < 0) {}
+					fire();
+				}
+				timerWheel.advanceTo((now() - started) / 1000000);
+				if(fds[2].revents & POLLIN) {
+					if(read(wakeFd, &count, sizeof(count)) < 0) {}
+					dirty = true;
+				}
+				if(fds[0].revents & POLLIN) readKeys();
+				// nothing more will ever be typed
+				if(fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)) running = false;
+			}
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		// how many times the loop woke up and how many frames it drew,
+		// an idle program should see neither go up
+		const unsigned long long wakeups() { return wakeCt; }
+		const unsigned long long frames() { return frameCt; }
+		// scheduled events still to come
+		const unsigned int scheduled() { return timers.size(); }
+};
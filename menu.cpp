@@ -1,39 +1,70 @@
-#include <engine.hpp>
+#include <cstdio>
+#include <cstdlib>
 #include <string>
-#include <vector>
-
-class Menu {
-	string title; // Title of the screen
-	unsigned char opts; // How many options you can select
-	vector<unsigned short> opX; // x position of cursor for option [n]
-	vector<unsigned short> opY; // y position of cursor for option [n]
-	
+#include "ascii.hpp"
+#include "engine.hpp"
+#include "loop.hpp"
+#include "ui.hpp"
+using namespace std;
+
+
+// A long menu in a bordered panel, built with the widgets in ui.hpp.
+//
+//   menu [items]
+//
+// The up and down arrow keys move the selection, enter picks an
+// item and q quits. Moving the selection only redraws the two
+// lines that changed, unless the list has to scroll.
+
+// A menu that shows what was picked on a label
+class LevelMenu : public Menu {
+	Label *status;
+
 	public:
-		// Constructors, destructors
-		Menu() {
-			opts = 0;
-		}
+		LevelMenu(const unsigned short rowsShown, Label *statusLabel)
+		: Menu(rowsShown) { status = statusLabel; }
 
-		~Menu() {
+		bool onSelect(const unsigned int option) override {
+			status -> setText("Picked level " + to_string(option + 1));
+			return true;
 		}
+};
 
-		// Returns the index of the added entry
-		unsigned char addEntry(unsigned short x, unsigned short y) {
-			const unsigned char index = opts; // Index is 1 less than options
-			opX.push_back(x);
-			opY.push_back(y);
-			return index;
-		}
+int main(int argc, char** argv) {
+	const unsigned int items = argc > 1 ? atoi(argv[1]) : 1000;
+	ASCIIWindow * window = new ASCIIWindow(80, 24);
+	window -> build();
+	window -> cursVis(0);
+	CharDisplay display(80, 24, window);
 
-		// Return true if option operation was performed successfully
-		// Return false if it failed
-		virtual bool onSelect(unsigned char option) {
-			// Example
-			switch (option) {
-				case 0: return true;
-				case 1: return true;
-				default: return false;
-			}
+	UI * ui = new UI(2, 1); // the display deletes it
+	Panel * panel = new Panel("Levels");
+	Label * status = new Label("Nothing picked yet");
+	LevelMenu * menu = new LevelMenu(18, status);
+	for(unsigned int i=0; i<items; i++)
+		menu -> addItem("Level " + to_string(i + 1));
+	panel -> add(menu);
+	panel -> add(status);
+	ui -> setRoot(panel);
+	display.addStruct(ui);
+	display.writeStructs();
 
+	EventLoop loop(window);
+	unsigned int retry = 0; // a frame held back for a slow terminal
+	loop.onKeys([&](const char* keys, const unsigned int n) {
+		for(unsigned int i=0; i<n; i++) {
+			if(keys[i] == 'q') loop.stop();
+			else if(menu -> key(keys[i])) loop.redraw();
 		}
-};
+	});
+	loop.onFrame([&]() {
+		ui -> flush(display);
+		if(!display.update() && retry == 0)
+			retry = loop.after(5, [&]() { retry = 0; loop.redraw(); });
+	});
+	loop.run();
+
+	window -> close();
+	delete window;
+	return 0;
+}
@@ -0,0 +1,327 @@
+#pragma once
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <vector>
+#include "engine.hpp"
+using namespace std;
+
+// =========================================
+// Navigation
+// ----------------------------------------
+// Pathfinding over the walls that a display's
+// collision codes define.
+//
+// A NavGrid turns the structs with chosen
+// collision codes into one blocked flag per
+// cell, once, instead of asking every struct
+// with hasCollCode for every cell a search
+// visits. It answers A* queries for single
+// agents, and builds flow fields that point
+// every cell toward the nearest of a set of
+// targets, so a crowd chasing the same thing
+// costs one field rather than one search per
+// agent. Fields are cached until the walls
+// change, which refresh() checks for.
+// =========================================
+
+// A cell in world coordinates
+struct NavPoint {
+	unsigned short x, y;
+};
+
+// distance of cells that can't reach a target
+const unsigned short NAV_FAR = 65535;
+
+// Which way to step from every cell to get to the nearest target.
+// Shared between agents and kept alive by whoever still holds it,
+// even after the NavGrid that built it moves on.
+class FlowField {
+	unsigned short x0, y0, wd, ht; // world region the field covers
+	vector<unsigned short> dist; // steps to the nearest target
+	vector<unsigned char> dir; // 0 stay, 1 right, 2 left, 3 down, 4 up
+
+	friend class NavGrid;
+	public:
+		FlowField(const unsigned short x, const unsigned short y,
+		const unsigned short width, const unsigned short height) {
+			x0 = x; y0 = y;
+			wd = width; ht = height;
+			dist.assign(wd * ht, NAV_FAR);
+			dir.assign(wd * ht, 0);
+		}
+
+		// Steps to the nearest target from x, y, or NAV_FAR if there is no way
+		const unsigned short distance(const unsigned short x, const unsigned short y) const {
+			// unsigned underflow puts coordinates left or above the field out of it
+			const unsigned short fx = x - x0, fy = y - y0;
+			if(fx >= wd || fy >= ht) return NAV_FAR;
+			return dist[fy * wd + fx];
+		}
+
+		// Moves x, y one cell toward the nearest target.
+		// Returns false if already there or if no target can be reached.
+		bool step(unsigned short &x, unsigned short &y) const {
+			const unsigned short fx = x - x0, fy = y - y0;
+			if(fx >= wd || fy >= ht) return false;
+			switch(dir[fy * wd + fx]) {
+				case 1: x++; return true;
+				case 2: x--; return true;
+				case 3: y++; return true;
+				case 4: y--; return true;
+				default: return false;
+			}
+		}
+};
+
+// The blocked cells of a region of the world, and searches over them
+class NavGrid {
+	CharDisplay *display;
+	vector<unsigned int> codes; // collision codes that block movement
+	unsigned short x0, y0, wd, ht; // world region covered
+	vector<unsigned char> blocked; // 1 where a wall is
+	unsigned long long built; // stamp the grid was built at
+
+	// A* scratch space, only cells whose seen matches gen are valid
+	vector<unsigned int> seen, gScore, from;
+	unsigned int gen;
+
+	// cached flow fields, the least recently used is dropped when full
+	struct CachedFlow {
+		vector<unsigned int> targets; // sorted cell indices
+		shared_ptr<const FlowField> field;
+		unsigned long long used;
+	};
+	vector<CachedFlow> flows;
+	unsigned short maxFlows;
+	unsigned long long useClock;
+	unsigned int buildCt, flowCt; // how many grids and fields were built
+
+	bool blocks(const unsigned int code) {
+		return find(codes.begin(), codes.end(), code) != codes.end();
+	}
+
+	// the cell index of a world coordinate, or -1 if outside
+	int indexOf(const unsigned short x, const unsigned short y) {
+		const unsigned short gx = x - x0, gy = y - y0;
+		if(gx >= wd || gy >= ht) return -1;
+		return gy * wd + gx;
+	}
+
+	// the latest stamp of anything that could have moved a wall
+	unsigned long long lastChange() {
+		unsigned long long last = display -> structsChanged();
+		if(CharStruct::recoded() > last) last = CharStruct::recoded();
+		for(unsigned short i=0; i<display -> structCt(); i++) {
+			CharStruct* s = display -> getPtr(i);
+			if(blocks(s -> collisionCode()) && s -> changed() > last)
+				last = s -> changed();
+		}
+		return last;
+	}
+
+	void build() {
+		blocked.assign(wd * ht, 0);
+		for(unsigned short i=0; i<display -> structCt(); i++) {
+			CharStruct* s = display -> getPtr(i);
+			if(!blocks(s -> collisionCode())) continue;
+			// only the struct's bounds have to be checked cell by cell
+			int bx0 = x0, by0 = y0, bx1 = x0 + wd, by1 = y0 + ht;
+			unsigned short sx, sy, sw, sh;
+			if(s -> bounds(sx, sy, sw, sh)) {
+				bx0 = max(bx0, (int)sx); by0 = max(by0, (int)sy);
+				bx1 = min(bx1, sx + sw); by1 = min(by1, sy + sh);
+			}
+			for(int y=by0; y<by1; y++)
+				for(int x=bx0; x<bx1; x++)
+					if(s -> inColl(x, y)) blocked[(y - y0) * wd + (x - x0)] = 1;
+		}
+		seen.assign(wd * ht, 0);
+		gScore.assign(wd * ht, 0);
+		from.assign(wd * ht, 0);
+		gen = 0;
+		flows.clear();
+		built = CharStruct::tick();
+		buildCt++;
+	}
+
+	// Breadth first from every target at once, since every step costs the same
+	shared_ptr<const FlowField> buildFlow(const vector<unsigned int> &targets) {
+		FlowField* f = new FlowField(x0, y0, wd, ht);
+		vector<unsigned int> queue;
+		queue.reserve(wd * ht);
+		for(unsigned int i=0; i<targets.size(); i++) {
+			if(blocked[targets[i]] || f -> dist[targets[i]] == 0) continue;
+			f -> dist[targets[i]] = 0;
+			queue.push_back(targets[i]);
+		}
+		for(unsigned int k=0; k<queue.size(); k++) {
+			const unsigned int at = queue[k];
+			const unsigned short x = at % wd, y = at / wd, d = f -> dist[at] + 1;
+			// each neighbour steps back toward this cell
+			const int nb[4] = {
+				x + 1 < wd ? (int)at + 1 : -1, x > 0 ? (int)at - 1 : -1,
+				y + 1 < ht ? (int)(at + wd) : -1, y > 0 ? (int)(at - wd) : -1 };
+			const unsigned char back[4] = {2, 1, 4, 3};
+			for(int n=0; n<4; n++) {
+				if(nb[n] == -1 || blocked[nb[n]] || f -> dist[nb[n]] != NAV_FAR) continue;
+				f -> dist[nb[n]] = d;
+				f -> dir[nb[n]] = back[n];
+				queue.push_back(nb[n]);
+			}
+		}
+		flowCt++;
+		return shared_ptr<const FlowField>(f);
+	}
+
+	public:
+		// display - the display whose structs are the walls
+		// blockCodes - the collision codes that can't be walked through
+		// x, y, width, height - the world region to navigate in,
+		//   everything outside of it counts as blocked
+		// cacheSize - how many flow fields to keep around
+		NavGrid(CharDisplay *disp, const vector<unsigned int> &blockCodes,
+		const unsigned short x, const unsigned short y,
+		const unsigned short width, const unsigned short height,
+		const unsigned short cacheSize = 8) {
+			display = disp;
+			codes = blockCodes;
+			x0 = x; y0 = y;
+			wd = width; ht = height;
+			maxFlows = cacheSize;
+			useClock = 0;
+			buildCt = 0; flowCt = 0;
+			build();
+		}
+
+		// Rebuilds the grid if a wall moved, was added or removed, or a
+		// struct's collision code changed since it was built. Cached flow
+		// fields are dropped with it. Call this once a frame before queries.
+		// Returns true if the grid was rebuilt.
+		bool refresh() {
+			if(lastChange() <= built) return false;
+			build();
+			return true;
+		}
+
+		// Rebuilds on the next refresh(), for walls changed in ways the
+		// grid can't see, such as a subclass changing its own shape
+		void invalidate() { built = 0; }
+
+		// Whether a world cell can be walked on
+		bool passable(const unsigned short x, const unsigned short y) {
+			const int at = indexOf(x, y);
+			return at != -1 && !blocked[at];
+		}
+
+		// Finds a shortest path from sx, sy to tx, ty with 4 way movement.
+		// path gets every cell after the start up to and including the target.
+		// Uses a cached flow field toward the target if there is one.
+		// Returns false, with an empty path, if there is no way there.
+		bool findPath(const unsigned short sx, const unsigned short sy,
+		const unsigned short tx, const unsigned short ty, vector<NavPoint> &path) {
+			path.clear();
+			const int start = indexOf(sx, sy), goal = indexOf(tx, ty);
+			if(start == -1 || goal == -1 || blocked[start] || blocked[goal]) return false;
+			if(start == goal) return true;
+
+			// follow a field if one was already built toward exactly this cell
+			for(unsigned int i=0; i<flows.size(); i++) {
+				if(flows[i].targets.size() != 1 || (int)flows[i].targets[0] != goal)
+					continue;
+				const FlowField &f = *flows[i].field;
+				if(f.distance(sx, sy) == NAV_FAR) return false;
+				unsigned short x = sx, y = sy;
+				while(f.step(x, y)) path.push_back(NavPoint {x, y});
+				return true;
+			}
+
+			// A* with manhattan distance, ties go to the deeper node
+			if(++gen == 0) { seen.assign(wd * ht, 0); gen = 1; }
+			typedef pair<unsigned long long, unsigned int> Entry; // priority, cell
+			priority_queue<Entry, vector<Entry>, greater<Entry>> open;
+			const int gx = goal % wd, gy = goal / wd;
+			auto h = [&](const int at) {
+				return (unsigned int)(abs(at % wd - gx) + abs(at / (int)wd - gy));
+			};
+			seen[start] = gen; gScore[start] = 0; from[start] = start;
+			open.push(Entry((unsigned long long)h(start) << 32, start));
+			while(!open.empty()) {
+				const unsigned int at = open.top().second;
+				const unsigned int f = open.top().first >> 32;
+				open.pop();
+				if(f > gScore[at] + h(at)) continue; // stale entry
+				if((int)at == goal) break;
+				const unsigned short x = at % wd, y = at / wd;
+				const int nb[4] = {
+					x + 1 < wd ? (int)at + 1 : -1, x > 0 ? (int)at - 1 : -1,
+					y + 1 < ht ? (int)(at + wd) : -1, y > 0 ? (int)(at - wd) : -1 };
+				for(int n=0; n<4; n++) {
+					if(nb[n] == -1 || blocked[nb[n]]) continue;
+					const unsigned int g = gScore[at] + 1;
+					if(seen[nb[n]] == gen && gScore[nb[n]] <= g) continue;
+					seen[nb[n]] = gen;
+					gScore[nb[n]] = g;
+					from[nb[n]] = at;
+					// lower 32 bits favour larger g among equal f
+					open.push(Entry(((unsigned long long)(g + h(nb[n])) << 32)
+						| (0xFFFFFFFF - g), nb[n]));
+				}
+			}
+			if(seen[goal] != gen) return false;
+			for(unsigned int at = goal; (int)at != start; at = from[at])
+				path.push_back(NavPoint {(unsigned short)(x0 + at % wd),
+					(unsigned short)(y0 + at / wd)});
+			reverse(path.begin(), path.end());
+			return true;
+		}
+
+		// A flow field toward the nearest of the targets, built once and
+		// shared by every caller until the walls change.
+		// Blocked or out of region targets are left out.
+		shared_ptr<const FlowField> flowTo(const vector<NavPoint> &targets) {
+			vector<unsigned int> key;
+			for(unsigned int i=0; i<targets.size(); i++) {
+				const int at = indexOf(targets[i].x, targets[i].y);
+				if(at != -1) key.push_back(at);
+			}
+			sort(key.begin(), key.end());
+			key.erase(unique(key.begin(), key.end()), key.end());
+			for(unsigned int i=0; i<flows.size(); i++) {
+				if(flows[i].targets == key) {
+					flows[i].used = ++useClock;
+					return flows[i].field;
+				}
+			}
+			if(flows.size() >= maxFlows && !flows.empty()) {
+				unsigned int oldest = 0;
+				for(unsigned int i=1; i<flows.size(); i++)
+					if(flows[i].used < flows[oldest].used) oldest = i;
+				flows.erase(flows.begin() + oldest);
+			}
+			CachedFlow c;
+			c.targets = key;
+			c.field = buildFlow(key);
+			c.used = ++useClock;
+			flows.push_back(c);
+			return c.field;
+		}
+
+		// A flow field toward a single target
+		shared_ptr<const FlowField> flowTo(const unsigned short x, const unsigned short y) {
+			return flowTo(vector<NavPoint> { NavPoint {x, y} });
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		const unsigned short width() { return wd; }
+		const unsigned short height() { return ht; }
+		// how many times the grid and flow fields have been built,
+		// to check that caching is doing its job
+		const unsigned int grids() { return buildCt; }
+		const unsigned int fields() { return flowCt; }
+		const unsigned short cachedFields() { return flows.size(); }
+};
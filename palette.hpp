@@ -0,0 +1,268 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "engine.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PALETTE_X86
+#endif
+using namespace std;
+
+// =========================================
+// Palette quantization
+// ----------------------------------------
+// Turns RGB colors into the palette index
+// of the nearest color the terminal has,
+// out of its 8, 16 or 256.
+//
+// Searching the palette for every cell of
+// every frame is slow, so a Quantizer does
+// it once for every color there is, five
+// bits a channel, and keeps the answers in
+// a 32 KB table. After that a color is a
+// lookup, and whole rows of colors go
+// through the table eight at a time on CPUs
+// with AVX2.
+//
+// Rows can be dithered with a 4x4 ordered
+// pattern so gradients the palette can't
+// show come out as a mix of the colors on
+// either side. The pattern is keyed to
+// where on the screen a color is, so it
+// stays put as things move.
+//
+//   Quantizer colors(detectColors(window));
+//   cell = cellOf('#', colors.index(CharColorB(255, 128, 0)));
+//   colors.mapRow(rgb, 80, fg, 0, y, true);
+// =========================================
+
+// The RGB color of a terminal palette index, as xterm shows it
+inline void paletteRGB(const unsigned char i, uint8_t &r, uint8_t &g, uint8_t &b) {
+	static const uint8_t basic[16][3] = {
+		{0, 0, 0}, {205, 0, 0}, {0, 205, 0}, {205, 205, 0},
+		{0, 0, 238}, {205, 0, 205}, {0, 205, 205}, {229, 229, 229},
+		{127, 127, 127}, {255, 0, 0}, {0, 255, 0}, {255, 255, 0},
+		{92, 92, 255}, {255, 0, 255}, {0, 255, 255}, {255, 255, 255}
+	};
+	if(i < 16) { r = basic[i][0]; g = basic[i][1]; b = basic[i][2]; return; }
+	if(i >= 232) { r = g = b = 8 + 10 * (i - 232); return; }
+	// the 6x6x6 color cube
+	const unsigned char c = i - 16;
+	const auto level = [](const unsigned char l) { return (uint8_t)(l == 0 ? 0 : 55 + 40 * l); };
+	r = level(c / 36); g = level(c / 6 % 6); b = level(c % 6);
+}
+
+// How many colors the terminal has: 256, 16, 8, or 0 for none.
+// A built window asks ncurses, otherwise the environment is guessed from.
+inline unsigned short detectColors(ASCIIWindow* window = NULL) {
+	if(window != NULL && window -> isInstanced()) {
+		if(!has_colors()) return 0;
+		return COLORS >= 256 ? 256 : COLORS >= 16 ? 16 : 8;
+	}
+	const char* colorterm = getenv("COLORTERM");
+	if(colorterm != NULL && (strstr(colorterm, "truecolor") || strstr(colorterm, "24bit"))) return 256;
+	const char* term = getenv("TERM");
+	if(term == NULL || strcmp(term, "dumb") == 0) return 0;
+	if(strstr(term, "256")) return 256;
+	if(strstr(term, "16color")) return 16;
+	return 8;
+}
+
+// ==============
+// Row kernels
+// ----------------------------------------
+// Map n RGB colors to palette indices with a 32x32x32 table.
+// offs is NULL, or 8 offsets to add to the channels of the colors,
+// the dither pattern of the row from the first color. The pattern
+// repeats every 4 colors, so the rest of the row reuses them.
+// ==============
+
+// the table index of a color
+constexpr unsigned int quantKey(const int r, const int g, const int b) {
+	return (r >> 3) << 10 | (g >> 3) << 5 | (b >> 3);
+}
+
+inline void quantRowScalar(const uint8_t* lut, const uint8_t* rgb, size_t n,
+const int* offs, unsigned char* out) {
+	const auto clamp8 = [](const int v) { return v < 0 ? 0 : v > 255 ? 255 : v; };
+	for(size_t i=0; i<n; i++) {
+		const int o = offs == NULL ? 0 : offs[i & 3];
+		out[i] = lut[quantKey(clamp8(rgb[3*i] + o), clamp8(rgb[3*i+1] + o), clamp8(rgb[3*i+2] + o))];
+	}
+}
+
+#ifdef PALETTE_X86
+
+// Eight colors a step: the 24 bytes are spread into 32 bit lanes of red,
+// green and blue, and the table is read with a gather. The table has
+// three bytes of padding so the gather's 4 byte reads stay inside it.
+__attribute__((target("avx2")))
+inline void quantRowAVX2(const uint8_t* lut, const uint8_t* rgb, size_t n,
+const int* offs, unsigned char* out) {
+	// the first 12 bytes in the low half, the next 12 in the high half
+	const __m256i spread = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+	const __m256i rOf = _mm256_setr_epi8(
+		0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1,
+		0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1);
+	const __m256i gOf = _mm256_setr_epi8(
+		1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1,
+		1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+	const __m256i bOf = _mm256_setr_epi8(
+		2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1,
+		2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+	const __m256i zero = _mm256_setzero_si256(), top = _mm256_set1_epi32(255);
+	const __m256i low = _mm256_set1_epi32(0xFF);
+	// byte 0 of each lane into the low 4 bytes of each half
+	const __m256i pack = _mm256_setr_epi8(
+		0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	// the pattern repeats every 4, so every step starts on the same offsets
+	const __m256i off = offs == NULL ? zero : _mm256_loadu_si256((const __m256i*)offs);
+	size_t i = 0;
+	// a step reads 32 bytes but uses 24
+	for(; (i + 8) * 3 + 8 <= n * 3; i += 8) {
+		const __m256i px = _mm256_permutevar8x32_epi32(
+			_mm256_loadu_si256((const __m256i*)(rgb + 3 * i)), spread);
+		const __m256i r = _mm256_min_epi32(top, _mm256_max_epi32(zero,
+			_mm256_add_epi32(_mm256_shuffle_epi8(px, rOf), off)));
+		const __m256i g = _mm256_min_epi32(top, _mm256_max_epi32(zero,
+			_mm256_add_epi32(_mm256_shuffle_epi8(px, gOf), off)));
+		const __m256i b = _mm256_min_epi32(top, _mm256_max_epi32(zero,
+			_mm256_add_epi32(_mm256_shuffle_epi8(px, bOf), off)));
+		const __m256i key = _mm256_or_si256(_mm256_or_si256(
+			_mm256_slli_epi32(_mm256_srli_epi32(r, 3), 10),
+			_mm256_slli_epi32(_mm256_srli_epi32(g, 3), 5)),
+			_mm256_srli_epi32(b, 3));
+		const __m256i idx = _mm256_shuffle_epi8(_mm256_and_si256(
+			_mm256_i32gather_epi32((const int*)lut, key, 1), low), pack);
+		const int lo = _mm_cvtsi128_si32(_mm256_castsi256_si128(idx)),
+			hi = _mm_cvtsi128_si32(_mm256_extracti128_si256(idx, 1));
+		memcpy(out + i, &lo, 4);
+		memcpy(out + i + 4, &hi, 4);
+	}
+	quantRowScalar(lut, rgb + 3 * i, n - i, offs, out + i);
+}
+
+#endif
+
+// Picks the row kernel once, by what the CPU supports
+inline void (*quantRowKernel())(const uint8_t*, const uint8_t*, size_t, const int*, unsigned char*) {
+	static void (*const k)(const uint8_t*, const uint8_t*, size_t, const int*, unsigned char*) = []() {
+#ifdef PALETTE_X86
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2")) return quantRowAVX2;
+#endif
+		return quantRowScalar;
+	}();
+	return k;
+}
+
+// Maps RGB colors to the nearest color of a terminal palette
+class Quantizer {
+	vector<uint8_t> lut; // 32x32x32 palette indices, and padding
+	unsigned short colors;
+	int strength; // how far dithering moves a channel, either way
+
+	// how different two colors look, weighting green the most as eyes do
+	static int distance(const int r0, const int g0, const int b0,
+	const int r1, const int g1, const int b1) {
+		return 2 * (r0 - r1) * (r0 - r1) + 4 * (g0 - g1) * (g0 - g1) + 3 * (b0 - b1) * (b0 - b1);
+	}
+
+	void build() {
+		// on 256 color terminals the first 16 are left out, since
+		// themes change them and the cube and grays cover them anyway
+		const unsigned short first = colors == 256 ? 16 : 0;
+		uint8_t pr[256], pg[256], pb[256];
+		for(unsigned short i=first; i<colors; i++) paletteRGB(i, pr[i], pg[i], pb[i]);
+		// the distance weighs each channel on its own, so the nearest color
+		// of the cube is the nearest level of each channel, and only it and
+		// the grays need comparing
+		unsigned char level[32];
+		for(int v=0; v<32; v++) {
+			const int c = v << 3 | 4;
+			level[v] = c < 48 ? 0 : c < 115 ? 1 : c < 235 ? 2 + (c - 115) / 40 : 5;
+		}
+		lut.assign(32 * 32 * 32 + 3, 0);
+		for(int r=0; r<32; r++)
+			for(int g=0; g<32; g++)
+				for(int b=0; b<32; b++) {
+					// the middle of the colors that share this entry
+					const int cr = r << 3 | 4, cg = g << 3 | 4, cb = b << 3 | 4;
+					unsigned short best = first, from = first + 1;
+					if(colors == 256) {
+						best = 16 + 36 * level[r] + 6 * level[g] + level[b];
+						from = 232;
+					}
+					int bestD = distance(cr, cg, cb, pr[best], pg[best], pb[best]);
+					for(unsigned short i=from; i<colors; i++) {
+						const int d = distance(cr, cg, cb, pr[i], pg[i], pb[i]);
+						if(d < bestD) { bestD = d; best = i; }
+					}
+					lut[r << 10 | g << 5 | b] = best;
+				}
+	}
+
+	public:
+		// colorCt - the colors the terminal has, see detectColors.
+		// Terminals with fewer than 8 are mapped as if they had 8.
+		Quantizer(const unsigned short colorCt = detectColors()) {
+			colors = colorCt >= 256 ? 256 : colorCt >= 16 ? 16 : 8;
+			// about half the gap between neighbouring palette colors
+			strength = colors == 256 ? 20 : colors == 16 ? 48 : 64;
+			build();
+		}
+
+		// The palette index nearest a color
+		unsigned char index(const uint8_t r, const uint8_t g, const uint8_t b) const {
+			return lut[quantKey(r, g, b)];
+		}
+		unsigned char index(const CharColorB &c) const { return index(c.red(), c.grn(), c.blu()); }
+		unsigned char index(const CharColor2B &c) const {
+			return index(c.red() >> 8, c.grn() >> 8, c.blu() >> 8);
+		}
+
+		// Maps n colors, 3 bytes each, to palette indices in out.
+		// x, y - where on the screen the first color is, to line up
+		// the dither pattern, when dithered
+		void mapRow(const uint8_t* rgb, const size_t n, unsigned char* out,
+		const unsigned short x = 0, const unsigned short y = 0, const bool dither = false) const {
+			if(!dither) { quantRowKernel()(lut.data(), rgb, n, NULL, out); return; }
+			static const unsigned char bayer[4][4] = {
+				{0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}
+			};
+			int offs[8];
+			for(int i=0; i<8; i++)
+				offs[i] = (bayer[y & 3][(x + i) & 3] * 2 - 15) * strength / 16;
+			quantRowKernel()(lut.data(), rgb, n, offs, out);
+		}
+
+		// Sets the foreground, or the background, of n cells to n colors
+		void colorCells(const uint8_t* rgb, Cell* cells, const size_t n,
+		const unsigned short x = 0, const unsigned short y = 0,
+		const bool dither = false, const bool background = false) const {
+			unsigned char idx[256];
+			for(size_t at=0; at<n; at+=256) {
+				const size_t k = n - at < 256 ? n - at : 256;
+				mapRow(rgb + 3 * at, k, idx, x + at, y, dither);
+				if(background)
+					for(size_t i=0; i<k; i++)
+						cells[at + i] = (cells[at + i] & ~CELL_BG) | (Cell)idx[i] << 40 | CELL_BG_SET;
+				else
+					for(size_t i=0; i<k; i++)
+						cells[at + i] = (cells[at + i] & ~CELL_FG) | (Cell)idx[i] << 32 | CELL_FG_SET;
+			}
+		}
+
+		// How far dithering moves a channel either way, 0 to turn it off
+		void setStrength(const int s) { strength = s; }
+
+		// getter methods
+		const unsigned short colorCt() const { return colors; }
+		const int ditherStrength() const { return strength; }
+		const char* kernel() const {
+			return quantRowKernel() == quantRowScalar ? "scalar" : "avx2";
+		}
+};
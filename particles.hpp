@@ -0,0 +1,212 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "engine.hpp"
+#include "jobs.hpp"
+using namespace std;
+
+// =========================================
+// Particles
+// ----------------------------------------
+// Sparks, rain, smoke and other short lived
+// bits, as many as the pool was made for,
+// drawn as one struct.
+//
+// A CollChar per spark would mean a new and
+// a delete each, and an erase from the
+// display's list when it dies. A particle is
+// instead a slot in a set of arrays, one for
+// each field, kept the same size as the pool
+// for its whole life. Spawning takes the slot
+// after the last live particle and killing
+// moves the last live particle into the dead
+// one's slot, so live particles are always
+// the first count() slots and both are O(1).
+//
+// A step moves every particle with a few
+// loops straight down the arrays that the
+// compiler can vectorize, split over the job
+// system's threads for big pools, then drops
+// the dead. Writing goes straight into the
+// display's buffer in one pass with
+// CharBuffer::scatter().
+//
+//   ParticleSystem * sparks = new ParticleSystem(100000, &jobs);
+//   sparks -> setGravity(0, 20);
+//   display.addStruct(sparks);
+//   sparks -> burst(40, 12, 200, 15, 1.5, cellOf('*', paletteOf(BYLW)));
+//   ...
+//   sparks -> step(dt);
+//   display.redrawStructs();
+//
+// Particles don't collide, and die once
+// they leave the area they're kept in.
+// =========================================
+
+class ParticleSystem : public CharStruct {
+	// one entry per slot, the first alive of them live
+	vector<float> px, py, vx, vy, life;
+	vector<Cell> look;
+	vector<unsigned short> cx, cy; // where each live particle is drawn, for scatter
+	size_t alive;
+	float gx, gy; // acceleration on every particle, cells per second per second
+	float drag; // fraction of speed lost per second
+	float ax0, ay0, ax1, ay1; // the area particles live in
+	unsigned int seed; // xorshift state for burst
+	JobSystem* jobs;
+
+	float rand01() {
+		seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+		return (seed >> 8) * (1.0f / 16777216.0f);
+	}
+
+	// Moves particles [b, e) along by dt seconds
+	void integrate(const size_t b, const size_t e, const float dt) {
+		const float keep = drag > 0 ? expf(-drag * dt) : 1;
+		float* __restrict X = px.data(); float* __restrict Y = py.data();
+		float* __restrict VX = vx.data(); float* __restrict VY = vy.data();
+		float* __restrict L = life.data();
+		for(size_t i=b; i<e; i++) {
+			VX[i] = (VX[i] + gx * dt) * keep;
+			VY[i] = (VY[i] + gy * dt) * keep;
+			X[i] += VX[i] * dt;
+			Y[i] += VY[i] * dt;
+			L[i] -= dt;
+		}
+	}
+
+	// Moves the last live particle into slot i
+	void moveLast(const size_t i) {
+		alive--;
+		px[i] = px[alive]; py[i] = py[alive];
+		vx[i] = vx[alive]; vy[i] = vy[alive];
+		life[i] = life[alive]; look[i] = look[alive];
+	}
+
+	public:
+		// capacity - the most particles that can be alive at once
+		// jobSystem - threads to step big pools on, or NULL
+		ParticleSystem(const size_t capacity, JobSystem* jobSystem = NULL)
+		: CharStruct(0, 0, 0) {
+			px.assign(capacity, 0); py.assign(capacity, 0);
+			vx.assign(capacity, 0); vy.assign(capacity, 0);
+			life.assign(capacity, 0); look.assign(capacity, 0);
+			cx.assign(capacity, 0); cy.assign(capacity, 0);
+			alive = 0;
+			gx = 0; gy = 0;
+			drag = 0;
+			ax0 = 0; ay0 = 0; ax1 = 65536; ay1 = 65536;
+			seed = 0x2545F491u;
+			jobs = jobSystem;
+		}
+
+		// Adds a particle at x, y moving vx, vy cells a second, that dies
+		// after seconds. Returns false if the pool is full.
+		bool spawn(const float x, const float y, const float velX, const float velY,
+		const float seconds, const Cell c) {
+			if(alive == px.size()) return false;
+			px[alive] = x; py[alive] = y;
+			vx[alive] = velX; vy[alive] = velY;
+			life[alive] = seconds; look[alive] = c;
+			alive++;
+			touch();
+			return true;
+		}
+
+		// Adds up to n particles at x, y flying every way at up to speed
+		// cells a second, living up to seconds. Returns how many fit.
+		size_t burst(const float x, const float y, const size_t n,
+		const float speed, const float seconds, const Cell c) {
+			size_t made = 0;
+			for(; made<n; made++) {
+				const float a = rand01() * 6.2831853f, s = speed * (0.25f + 0.75f * rand01());
+				// cells are about twice as tall as they are wide, so half
+				// the vertical speed keeps the burst round
+				if(!spawn(x, y, cosf(a) * s, sinf(a) * s * 0.5f, seconds * (0.5f + 0.5f * rand01()), c))
+					break;
+			}
+			return made;
+		}
+
+		// Kills the live particle in slot i. The last live particle takes
+		// its slot, so slots past i are the ones that move.
+		void kill(const size_t i) {
+			if(i >= alive) return;
+			moveLast(i);
+			touch();
+		}
+
+		// kills every particle
+		void clearParticles() { alive = 0; touch(); }
+
+		// Moves every particle along by dt seconds and drops those that
+		// died or left the area
+		void step(const float dt) {
+			if(jobs != NULL && alive > 32768)
+				jobs -> parallelFor(0, alive, 16384, [this, dt](const unsigned int b, const unsigned int e) {
+					integrate(b, e, dt);
+				});
+			else integrate(0, alive, dt);
+			size_t i = 0;
+			while(i < alive) {
+				if(life[i] > 0 && px[i] >= ax0 && px[i] < ax1 && py[i] >= ay0 && py[i] < ay1) i++;
+				else moveLast(i); // the moved one is checked next
+			}
+			touch();
+		}
+
+		// The area particles are kept in, they die once they leave it.
+		// The whole world if not set.
+		void setArea(const unsigned short x, const unsigned short y,
+		const unsigned short w, const unsigned short h) {
+			ax0 = x; ay0 = y; ax1 = (float)x + w; ay1 = (float)y + h;
+		}
+
+		void setGravity(const float x, const float y) { gx = x; gy = y; }
+		void setDrag(const float perSecond) { drag = perSecond; }
+
+		// overrides for CharStruct funcs
+
+		void write(CharBuffer &buf) override {
+			// the area starts at 0 or more, so truncating is flooring
+			unsigned short* __restrict X = cx.data(); unsigned short* __restrict Y = cy.data();
+			const float* __restrict PX = px.data(); const float* __restrict PY = py.data();
+			for(size_t i=0; i<alive; i++) {
+				X[i] = (unsigned short)(int)PX[i];
+				Y[i] = (unsigned short)(int)PY[i];
+			}
+			buf.scatter(X, Y, look.data(), alive);
+		}
+
+		// the look of the last live particle drawn at x, y
+		Cell charAt(const unsigned short x, const unsigned short y) override {
+			for(size_t i=alive; i-- > 0;)
+				if((unsigned short)(int)px[i] == x && (unsigned short)(int)py[i] == y) return look[i];
+			return 0;
+		}
+
+		// nothing collides, so the collision bounds are empty
+		bool bounds(unsigned short &x, unsigned short &y,
+		unsigned short &w, unsigned short &h) override {
+			x = xp; y = yp; w = 0; h = 0;
+			return true;
+		}
+
+		const char* type() override { return "ParticleSystem"; }
+		CharStruct* clone() override { return new ParticleSystem(*this); }
+
+		// ============
+		// Getter funcs
+		// ============
+
+		// live particles, in slots [0, count())
+		const size_t count() { return alive; }
+		const size_t capacity() { return px.size(); }
+		const float particleX(const size_t i) { return px[i]; }
+		const float particleY(const size_t i) { return py[i]; }
+		const float lifeLeft(const size_t i) { return life[i]; }
+
+	protected:
+		void assign(CharStruct &from) override { *this = (ParticleSystem&)from; }
+};
@@ -0,0 +1,196 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "ascii.hpp"
+#include "engine.hpp"
+using namespace std;
+
+// =========================================
+// Render thread
+// ----------------------------------------
+// A Presenter owns the window and writes to
+// the terminal on its own thread, so that a
+// slow terminal never holds up the game and
+// the game never holds up the terminal.
+//
+// The game draws a frame onto the canvas, a
+// grid of cells the size of the window, and
+// publishes it. Frames are handed over in a
+// triple buffer: the game always has one to
+// draw on, the render thread always has one
+// to show, and the third holds the newest
+// frame published. Publishing swaps it in
+// with one atomic exchange, so the game never
+// waits. The render thread shows whichever
+// frame is newest when it gets to it, and
+// frames published in the meantime are
+// skipped, so however slow the terminal is
+// it is only ever one frame behind.
+//
+//   Presenter presenter(window);
+//   ...
+//   display.redrawStructs();
+//   presenter.draw(display);
+//   presenter.text(0, 0, "Score: 10");
+//   presenter.publish();
+//
+// Once the presenter is running nothing else
+// may use the window. Read keys straight from
+// the terminal, see EventLoop::setRawKeys.
+// =========================================
+
+class Presenter {
+	// a whole window of cells, and which frame it is
+	struct Frame {
+		vector<Cell> cells;
+		unsigned long long seq;
+		unsigned long long traced; // its frame in the window's latency trace
+	};
+
+	static const unsigned int FRESH = 4; // set in mid when it holds an unseen frame
+
+	ASCIIWindow *win;
+	unsigned short w, h;
+	Frame frames[3];
+	unsigned int back; // the frame the game draws on
+	atomic<unsigned int> mid; // the newest published frame, and FRESH
+	unsigned int front; // the frame the render thread shows, its own
+
+	// render thread state
+	vector<Cell> shown; // what the terminal shows
+	thread renderer;
+	int wakeFd;
+	atomic<bool> stopping;
+	atomic<unsigned long long> publishCt, presentCt, skipCt;
+
+	// Writes the runs of a row that differ from what the terminal shows
+	void paintRow(const Cell* cells, Cell* was, const unsigned short y) {
+		size_t i = cellMismatch(cells, was, w);
+		while(i < w) {
+			const size_t j = i + cellMatch(cells + i, was + i, w - i);
+			win -> writeCellsNR(i, y, cells + i, j - i);
+			cellCopy(was + i, cells + i, j - i);
+			i = j + cellMismatch(cells + j, was + j, w - j);
+		}
+	}
+
+	// the render thread, shows the newest frame each time one is published
+	void render() {
+		unsigned long long seen = 0; // the last frame shown
+		pollfd pfd = {wakeFd, POLLIN, 0};
+		while(true) {
+			if(poll(&pfd, 1, -1) < 0) continue;
+			uint64_t count;
+			if(read(wakeFd, &count, sizeof(count)) < 0) {}
+			// the last frame is still shown when stopping
+			const bool last = stopping.load(memory_order_acquire);
+			if(!(mid.load(memory_order_acquire) & FRESH)) {
+				if(last) break;
+				continue;
+			}
+			front = mid.exchange(front, memory_order_acq_rel) & 3;
+			const Frame &f = frames[front];
+			for(unsigned short y=0; y<h; y++)
+				paintRow(f.cells.data() + y * w, shown.data() + y * w, y);
+			win -> present(f.traced);
+			if(seen != 0 && f.seq > seen + 1) skipCt += f.seq - seen - 1;
+			seen = f.seq;
+			presentCt++;
+			if(last) break;
+		}
+	}
+
+	public:
+		// window - the window to present on, which the presenter
+		//   writes to from its own thread until it is stopped
+		Presenter(ASCIIWindow *window)
+		: stopping(false), publishCt(0), presentCt(0), skipCt(0) {
+			win = window;
+			w = win -> width();
+			h = win -> height();
+			for(unsigned int i=0; i<3; i++) {
+				frames[i].cells.assign((size_t)w * h, CELL_BLANK);
+				frames[i].seq = 0;
+				frames[i].traced = 0;
+			}
+			back = 0;
+			mid.store(1);
+			front = 2;
+			// nothing in a real cell has its top bits set, so the first frame
+			// is written whole over whatever the window had
+			shown.assign((size_t)w * h, ~(Cell)0);
+			wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			renderer = thread(&Presenter::render, this);
+		}
+
+		~Presenter() { stop(); }
+
+		// Stops the render thread once it has shown the last frame published,
+		// after which the window can be used again
+		void stop() {
+			if(stopping.exchange(true)) return;
+			const uint64_t one = 1;
+			if(write(wakeFd, &one, sizeof(one)) < 0) {}
+			renderer.join();
+			close(wakeFd);
+		}
+
+		// ========
+		// Drawing
+		// ========
+
+		// The cells of the frame being drawn, the window's width across.
+		// It starts out as the last frame published.
+		Cell* canvas() { return frames[back].cells.data(); }
+
+		// Draws a display onto the canvas where it sits on the window.
+		// This commits the display, so its sinks see the frame.
+		void draw(CharDisplay &display) {
+			display.commit();
+			const unsigned short x = display.offsetX(), y = display.offsetY();
+			if(x + display.width() > w || y + display.height() > h) return;
+			display.copyShown(canvas() + (size_t)y * w + x, w);
+		}
+
+		// Writes text on the canvas at x, y, cut off at the window's edge
+		void text(const unsigned short x, const unsigned short y,
+		const string_view str, const Cell style = 0) {
+			if(y >= h) return;
+			Cell* row = canvas() + (size_t)y * w;
+			for(size_t i=0; i<str.size() && x + i < w; i++)
+				row[x + i] = cellWithChar(style, (unsigned char)str[i]);
+		}
+
+		// Hands the canvas to the render thread, never waiting for it.
+		// The next canvas starts out as a copy of this one.
+		void publish() {
+			Frame &done = frames[back];
+			done.seq = ++publishCt;
+			// set before the render thread starts, so it is safe to read here
+			LatencyTrace *trace = win -> latencyTrace();
+			done.traced = trace != NULL ? trace -> frame() : 0;
+			const unsigned int was = mid.exchange(back | FRESH, memory_order_acq_rel) & 3;
+			cellCopy(frames[was].cells.data(), done.cells.data(), done.cells.size());
+			back = was;
+			const uint64_t one = 1;
+			if(write(wakeFd, &one, sizeof(one)) < 0) {} // full means it will wake
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		const unsigned short width() { return w; }
+		const unsigned short height() { return h; }
+		// frames published, frames shown, and frames that were published
+		// but skipped because a newer one was ready by the time it was shown
+		const unsigned long long published() { return publishCt; }
+		const unsigned long long presented() { return presentCt; }
+		const unsigned long long skipped() { return skipCt; }
+};
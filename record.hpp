@@ -0,0 +1,255 @@
+#pragma once
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "delta.hpp"
+using namespace std;
+
+// =========================================
+// Session recording
+// ----------------------------------------
+// A Recorder is a FrameSink that writes the
+// frames of a display to a file as they are
+// shown, in the encoding of delta.hpp, with
+// a keyframe every so often. The frame thread
+// only copies the delta into a spare buffer
+// and queues it; encoding and writing happen
+// on the recorder's own thread.
+//
+//   Recorder rec("session.aefd", display.width(), display.height());
+//   display.addFrameSink(&rec);
+//
+// A Playback reads a recording back and can
+// jump to any time in it, by starting from
+// the last keyframe before that time.
+// =========================================
+
+class Recorder : public FrameSink {
+	FILE* file;
+	unsigned short w, h;
+	uint64_t start; // time of the first frame
+	unsigned int keyEvery, sinceKey; // frames between keyframes
+	bool needKey; // a frame was dropped, so the next has to be a keyframe
+
+	// frames waiting to be written, and spare buffers to copy new ones into
+	vector<FrameDelta *> queue, spare;
+	unsigned int maxQueue; // frames to queue before dropping them
+	mutex m;
+	condition_variable wake;
+	bool stopping;
+	thread writer;
+
+	unsigned long long frameCt, dropCt, byteCt;
+
+	// the writer thread, encodes and writes whatever is queued
+	void write() {
+		vector<FrameDelta *> batch;
+		vector<uint8_t> out;
+		unique_lock<mutex> lock(m);
+		while(true) {
+			wake.wait(lock, [this]() { return stopping || !queue.empty(); });
+			if(queue.empty() && stopping) break;
+			batch.swap(queue);
+			lock.unlock();
+
+			out.clear();
+			for(unsigned int i=0; i<batch.size(); i++)
+				encodeFrame(out, *batch[i], batch[i] -> time - start);
+			fwrite(out.data(), 1, out.size(), file);
+
+			lock.lock();
+			byteCt += out.size();
+			spare.insert(spare.end(), batch.begin(), batch.end());
+			batch.clear();
+		}
+		fflush(file);
+	}
+
+	public:
+		// path - the file to record to, replaced if it exists
+		// width, height - the size of the display being recorded
+		// keyframeEvery - frames between keyframes, more makes seeking
+		//   faster and the file bigger
+		Recorder(const string &path, const unsigned short width,
+		const unsigned short height, const unsigned int keyframeEvery = 120) {
+			w = width; h = height;
+			start = 0;
+			keyEvery = keyframeEvery;
+			sinceKey = keyEvery; // the first frame is a keyframe
+			needKey = true;
+			maxQueue = 256;
+			stopping = false;
+			frameCt = 0; dropCt = 0; byteCt = 0;
+			file = fopen(path.c_str(), "wb");
+			if(file == NULL) return;
+			prepareDeltaPool(queue, spare, maxQueue, w, h);
+			vector<uint8_t> header;
+			encodeHeader(header, w, h);
+			fwrite(header.data(), 1, header.size(), file);
+			byteCt = header.size();
+			writer = thread(&Recorder::write, this);
+		}
+
+		~Recorder() {
+			if(file == NULL) return;
+			{
+				lock_guard<mutex> lock(m);
+				stopping = true;
+			}
+			wake.notify_one();
+			writer.join();
+			fclose(file);
+			for(unsigned int i=0; i<spare.size(); i++) delete spare[i];
+		}
+
+		// Queues a copy of the frame for the writer thread
+		void frame(const FrameDelta &delta) override {
+			if(file == NULL) return;
+			// frames before the first keyframe can't be played back
+			if(start == 0 && !delta.key) return;
+			if(start == 0) start = delta.time;
+			{
+				lock_guard<mutex> lock(m);
+				if(queue.size() >= maxQueue) {
+					// the disk can't keep up, the next keyframe repairs the gap
+					dropCt++;
+					needKey = true;
+					return;
+				}
+				FrameDelta* buf;
+				if(spare.empty()) buf = new FrameDelta();
+				else { buf = spare.back(); spare.pop_back(); }
+				*buf = delta; // reuses the spare buffer's memory
+				queue.push_back(buf);
+			}
+			wake.notify_one();
+			frameCt++;
+			if(delta.key) { sinceKey = 0; needKey = false; }
+			else sinceKey++;
+		}
+
+		bool wantsKeyframe() override {
+			return file != NULL && (needKey || sinceKey >= keyEvery);
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		// whether the file could be opened
+		bool isOpen() { return file != NULL; }
+		// frames queued and frames dropped because the writer fell behind
+		const unsigned long long frames() { return frameCt; }
+		const unsigned long long dropped() { return dropCt; }
+		// bytes written so far
+		const unsigned long long bytes() {
+			lock_guard<mutex> lock(m);
+			return byteCt;
+		}
+};
+
+// Plays a recording back, see Recorder
+class Playback {
+	vector<uint8_t> data; // the whole file
+	unsigned short w, h;
+
+	// where each frame's body is, and what is known without decoding it
+	struct FrameInfo {
+		size_t at, len;
+		uint64_t time;
+		bool key;
+	};
+	vector<FrameInfo> frames;
+	vector<unsigned int> keys; // indices of the keyframes
+
+	vector<Cell> screen; // what the recording showed after frame next - 1
+	unsigned int next; // the next frame to apply
+	FrameDelta scratch;
+
+	// Reads the time and keyframe flag of every frame, without the cells
+	void index() {
+		const uint8_t* p = data.data();
+		const uint8_t* end = p + data.size();
+		if(!decodeHeader(p, end, w, h)) return;
+		size_t len;
+		while(frameLength(p, end, len)) {
+			FrameInfo f;
+			f.at = p - data.data();
+			f.len = len;
+			f.key = len > 0 && (*p & 1);
+			const uint8_t* q = p + 1;
+			uint64_t t;
+			if(len == 0 || !getVarint(q, p + len, t)) break;
+			f.time = t;
+			if(f.key) keys.push_back(frames.size());
+			frames.push_back(f);
+			p += len;
+		}
+	}
+
+	// Applies frame i to the screen
+	bool apply(const unsigned int i) {
+		if(!decodeFrame(data.data() + frames[i].at, frames[i].len, scratch))
+			return false;
+		applyFrame(scratch, screen.data(), w, h);
+		return true;
+	}
+
+	public:
+		Playback() { w = 0; h = 0; next = 0; }
+
+		// Loads a recording, returns false if it can't be read
+		bool load(const string &path) {
+			data.clear(); frames.clear(); keys.clear();
+			w = 0; h = 0; next = 0;
+			FILE* file = fopen(path.c_str(), "rb");
+			if(file == NULL) return false;
+			uint8_t buf[65536];
+			size_t n;
+			while((n = fread(buf, 1, sizeof(buf), file)) > 0)
+				data.insert(data.end(), buf, buf + n);
+			fclose(file);
+			index();
+			screen.assign(w * h, CELL_BLANK);
+			return w > 0 && h > 0 && !keys.empty();
+		}
+
+		// Moves the screen to what was shown at time microseconds into
+		// the recording, starting from the last keyframe at or before it
+		// if that is closer than going on from where the screen is now.
+		// Returns true if the screen changed.
+		bool seek(const uint64_t time) {
+			// the last keyframe at or before time
+			unsigned int key = keys.empty() ? 0 : keys[0];
+			for(unsigned int k=0; k<keys.size() && frames[keys[k]].time <= time; k++)
+				key = keys[k];
+			// replay from the keyframe unless the screen is already past it
+			// and not past time
+			const bool ahead = next > 0 && frames[next - 1].time > time;
+			if(ahead || next <= key) next = key;
+			bool changed = false;
+			while(next < frames.size() && frames[next].time <= time) {
+				apply(next++);
+				changed = true;
+			}
+			return changed;
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		const unsigned short width() { return w; }
+		const unsigned short height() { return h; }
+		// the screen as of the last seek(), row by row
+		const Cell* cells() { return screen.data(); }
+		// length of the recording in microseconds
+		const uint64_t duration() { return frames.empty() ? 0 : frames.back().time; }
+		const unsigned int frameCt() { return frames.size(); }
+		const unsigned int keyframeCt() { return keys.size(); }
+		// time of the frame the screen is at
+		const uint64_t position() { return next > 0 ? frames[next - 1].time : 0; }
+};
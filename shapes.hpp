@@ -0,0 +1,537 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "engine.hpp"
+#include "snapshot.hpp"
+using namespace std;
+
+// =========================================
+// Span shapes
+// ----------------------------------------
+// Shapes beyond lines and boxes, each one
+// struct no matter how big:
+//
+//   Segment   a line at any angle
+//   Ellipse   filled or outlined, and Circle
+//   Polygon   convex or concave, filled or
+//             outlined
+//   Region    whatever a flood fill reaches
+//
+// Each shape is worked out once, when it is
+// made or reshaped, into the horizontal runs
+// of cells it covers on every row. Writing it
+// is then one hrun per run, and a collision
+// check looks at the few runs of one row.
+// Moving a shape doesn't work it out again.
+//
+//   Ellipse * pond = new Ellipse(1, '~', 10, 4, 6, 3, true);
+//   Polygon * hill = new Polygon(1, '^', {{30, 2}, {40, 9}, {25, 9}}, true);
+//   display.addStruct(pond);
+//   display.addStruct(hill);
+// =========================================
+
+// A corner of a polygon, in world coordinates
+struct ShapePoint {
+	unsigned short x, y;
+};
+
+// The base of every span shape: the runs it covers, relative to its
+// top left corner, and the cell it is drawn with
+class SpanShape : public CharStruct {
+	// a run being added, in world coordinates
+	struct Piece {
+		int y, x0, x1;
+		bool operator<(const Piece &o) const { return y != o.y ? y < o.y : x0 < o.x0; }
+	};
+	vector<Piece> pieces;
+
+	protected:
+		Cell chr;
+		unsigned short wd, ht;
+		vector<unsigned int> rowAt; // where each row's runs start in runs, ht + 1 of them
+		vector<unsigned short> runs; // start and end of each run, end excluded
+
+		// Adds cells [x0, x1) of world row y to the shape being worked out.
+		// Cells left of or above 0 are cut off.
+		void addRun(const int y, int x0, const int x1) {
+			if(y < 0 || x1 <= 0) return;
+			if(x0 < 0) x0 = 0;
+			if(x1 > x0) pieces.push_back({y, x0, x1});
+		}
+
+		// Adds a line of cells between two points, in runs along each row
+		void addSegment(const int x0, const int y0, const int x1, const int y1) {
+			// Bresenham, going right so the cells of a row form one run
+			int ax = x0, ay = y0, bx = x1, by = y1;
+			if(ax > bx) { swap(ax, bx); swap(ay, by); }
+			const int dx = bx - ax, dy = -abs(by - ay), sy = ay < by ? 1 : -1;
+			int err = dx + dy, x = ax, y = ay;
+			int row = ay, start = ax, last = ax; // the run of the current row
+			while(true) {
+				if(y != row) {
+					addRun(row, start, last + 1);
+					row = y; start = x;
+				}
+				last = x;
+				if(x == bx && y == by) break;
+				const int e2 = 2 * err;
+				if(e2 >= dy) { err += dy; x++; }
+				if(e2 <= dx) { err += dx; y += sy; }
+			}
+			addRun(row, start, last + 1);
+		}
+
+		// Sorts and joins the runs added since the last time, and moves the
+		// shape's corner to the top left of them. This is a change of the
+		// shape's collision, so its stamp moves on.
+		void finishRuns() {
+			sort(pieces.begin(), pieces.end());
+			runs.clear();
+			if(pieces.empty()) {
+				wd = 0; ht = 0;
+				rowAt.assign(1, 0);
+				rev = tick();
+				return;
+			}
+			int left = pieces[0].x0, right = 0;
+			for(unsigned int i=0; i<pieces.size(); i++) {
+				if(pieces[i].x0 < left) left = pieces[i].x0;
+				if(pieces[i].x1 > right) right = pieces[i].x1;
+			}
+			const int top = pieces[0].y;
+			xp = left; yp = top;
+			wd = right - left;
+			ht = pieces.back().y - top + 1;
+			rowAt.assign(ht + 1, 0);
+			unsigned int i = 0;
+			for(unsigned short r=0; r<ht; r++) {
+				rowAt[r] = runs.size();
+				while(i < pieces.size() && pieces[i].y == top + r) {
+					int a = pieces[i].x0, b = pieces[i].x1;
+					// runs that overlap or touch become one
+					for(i++; i < pieces.size() && pieces[i].y == top + r && pieces[i].x0 <= b; i++)
+						if(pieces[i].x1 > b) b = pieces[i].x1;
+					runs.push_back(a - left);
+					runs.push_back(b - left);
+				}
+			}
+			rowAt[ht] = runs.size();
+			pieces.clear();
+			rev = tick();
+		}
+
+	public:
+		SpanShape(const unsigned int collision, const Cell cell)
+		: CharStruct(collision, 0, 0) {
+			chr = cell;
+			wd = 0; ht = 0;
+			rowAt.assign(1, 0);
+		}
+
+		// overrides for CharStruct funcs
+
+		void draw(ASCIIWindow &win,
+		const unsigned short xo, const unsigned short yo) override {
+			for(unsigned short r=0; r<ht; r++)
+				for(unsigned int i=rowAt[r]; i<rowAt[r+1]; i += 2)
+					for(unsigned short x=runs[i]; x<runs[i+1]; x++)
+						if(win.inBounds(xp + xo + x, yp + yo + r))
+							win.writeCellsNR(xp + xo + x, yp + yo + r, &chr, 1);
+		}
+
+		void write(CharBuffer &buf) override {
+			if(!buf.overlaps(xp, yp, wd, ht)) return;
+			for(unsigned short r=0; r<ht; r++)
+				for(unsigned int i=rowAt[r]; i<rowAt[r+1]; i += 2)
+					buf.hrun(xp + runs[i], yp + r, runs[i+1] - runs[i], chr);
+		}
+
+		Cell charAt(const unsigned short x, const unsigned short y) override {
+			return inColl(x, y) ? chr : 0;
+		}
+
+		bool inColl(const unsigned short x, const unsigned short y) override {
+			// unsigned underflow puts coordinates left or above of the shape out of it
+			const unsigned short gx = x - xp, gy = y - yp;
+			if(gx >= wd || gy >= ht) return false;
+			for(unsigned int i=rowAt[gy]; i<rowAt[gy+1]; i += 2) {
+				if(gx < runs[i]) return false;
+				if(gx < runs[i+1]) return true;
+			}
+			return false;
+		}
+
+		bool bounds(unsigned short &x, unsigned short &y,
+		unsigned short &w, unsigned short &h) override {
+			x = xp; y = yp; w = wd; h = ht;
+			return true;
+		}
+
+		const char* type() override { return "SpanShape"; }
+
+		void save(vector<uint8_t> &out) override {
+			saveBase(out);
+			putVarint(out, chr);
+			putVarint(out, wd);
+			putVarint(out, ht);
+			for(unsigned short r=0; r<ht; r++) {
+				putVarint(out, (rowAt[r+1] - rowAt[r]) / 2);
+				for(unsigned int i=rowAt[r]; i<rowAt[r+1]; i++) putVarint(out, runs[i]);
+			}
+		}
+
+		bool load(const uint8_t* &p, const uint8_t* end) override {
+			uint64_t c, w, h;
+			if(!loadBase(p, end) || !getVarint(p, end, c) ||
+			!getVarint(p, end, w) || !getVarint(p, end, h)) return false;
+			// every row takes at least a byte
+			if(h > (uint64_t)(end - p)) return false;
+			chr = c; wd = w; ht = h;
+			runs.clear();
+			rowAt.assign(ht + 1, 0);
+			for(unsigned short r=0; r<ht; r++) {
+				rowAt[r] = runs.size();
+				uint64_t n;
+				if(!getVarint(p, end, n) || n > (uint64_t)(end - p)) return false;
+				for(uint64_t i=0; i<2 * n; i++) {
+					uint64_t x;
+					if(!getVarint(p, end, x) || x > wd) return false;
+					runs.push_back(x);
+				}
+			}
+			rowAt[ht] = runs.size();
+			return true;
+		}
+
+		// getter methods
+		const unsigned short width() { return wd; }
+		const unsigned short height() { return ht; }
+		// how many runs writing the shape takes
+		const unsigned int runCt() { return runs.size() / 2; }
+		const Cell cell() { return chr; }
+		void setCell(const Cell c) { chr = c; touch(); }
+};
+
+// A line between any two points, such as a diagonal wall or a laser
+class Segment : public SpanShape {
+	// the ends, relative to the top left corner
+	short ax, ay, bx, by;
+
+	void trace(const int x0, const int y0, const int x1, const int y1) {
+		addSegment(x0, y0, x1, y1);
+		finishRuns();
+		ax = x0 - xp; ay = y0 - yp;
+		bx = x1 - xp; by = y1 - yp;
+	}
+
+	public:
+		Segment(const unsigned int collision, const Cell cell,
+		const unsigned short x0, const unsigned short y0,
+		const unsigned short x1, const unsigned short y1)
+		: SpanShape(collision, cell) {
+			trace(x0, y0, x1, y1);
+		}
+
+		const char* type() override { return "Segment"; }
+		CharStruct* clone() override { return new Segment(*this); }
+
+		void save(vector<uint8_t> &out) override {
+			SpanShape::save(out);
+			putVarint(out, ax); putVarint(out, ay);
+			putVarint(out, bx); putVarint(out, by);
+		}
+
+		bool load(const uint8_t* &p, const uint8_t* end) override {
+			uint64_t v[4];
+			if(!SpanShape::load(p, end)) return false;
+			for(unsigned int i=0; i<4; i++)
+				if(!getVarint(p, end, v[i])) return false;
+			ax = v[0]; ay = v[1]; bx = v[2]; by = v[3];
+			return true;
+		}
+
+		// Moves the ends, returns false if no change
+		bool setEnds(const unsigned short x0, const unsigned short y0,
+		const unsigned short x1, const unsigned short y1) {
+			if(x0 == startX() && y0 == startY() && x1 == endX() && y1 == endY()) return false;
+			trace(x0, y0, x1, y1);
+			return true;
+		}
+
+		// getter methods
+		const unsigned short startX() { return xp + ax; }
+		const unsigned short startY() { return yp + ay; }
+		const unsigned short endX() { return xp + bx; }
+		const unsigned short endY() { return yp + by; }
+
+	protected:
+		void assign(CharStruct &from) override { *this = (Segment&)from; }
+};
+
+// An ellipse with its top left corner at x, y, rx cells out from its middle
+// across and ry cells out up and down, so it is 2rx + 1 by 2ry + 1 cells.
+// Terminal cells are about twice as tall as they are wide, so an ellipse
+// with rx = 2ry looks round.
+class Ellipse : public SpanShape {
+	unsigned short rx, ry;
+	bool fill;
+
+	// how far out the ellipse reaches on a row dy from its middle, -1 if not at all
+	int halfWidth(const int dy) {
+		if(dy < -ry || dy > ry) return -1;
+		const double t = dy / (ry + 0.5);
+		const int hw = (int)floor((rx + 0.5) * sqrt(1.0 - t * t));
+		return hw > rx ? rx : hw;
+	}
+
+	void trace(const int x, const int y) {
+		const int cx = x + rx, cy = y + ry;
+		for(int dy=-ry; dy<=ry; dy++) {
+			const int hw = halfWidth(dy);
+			if(hw < 0) continue;
+			// an outline keeps the cells that have a side outside of the ellipse
+			int inner = hw - 1;
+			if(halfWidth(dy - 1) < inner) inner = halfWidth(dy - 1);
+			if(halfWidth(dy + 1) < inner) inner = halfWidth(dy + 1);
+			if(fill || inner < 0) addRun(cy + dy, cx - hw, cx + hw + 1);
+			else {
+				addRun(cy + dy, cx - hw, cx - inner);
+				addRun(cy + dy, cx + inner + 1, cx + hw + 1);
+			}
+		}
+		// the middle row is always 2rx + 1 wide, and the top and bottom
+		// rows always have a cell, so the corner stays at x, y
+		finishRuns();
+	}
+
+	public:
+		Ellipse(const unsigned int collision, const Cell cell,
+		const unsigned short x, const unsigned short y,
+		const unsigned short xRadius, const unsigned short yRadius, const bool filled)
+		: SpanShape(collision, cell) {
+			rx = xRadius; ry = yRadius;
+			fill = filled;
+			trace(x, y);
+		}
+
+		const char* type() override { return "Ellipse"; }
+		CharStruct* clone() override { return new Ellipse(*this); }
+
+		void save(vector<uint8_t> &out) override {
+			SpanShape::save(out);
+			putVarint(out, rx);
+			putVarint(out, ry);
+			putVarint(out, fill);
+		}
+
+		bool load(const uint8_t* &p, const uint8_t* end) override {
+			uint64_t a, b, f;
+			if(!SpanShape::load(p, end) || !getVarint(p, end, a) ||
+			!getVarint(p, end, b) || !getVarint(p, end, f)) return false;
+			rx = a; ry = b; fill = f;
+			return true;
+		}
+
+		// Changes the size, keeping the top left corner. Returns false if no change
+		bool setRadii(const unsigned short xRadius, const unsigned short yRadius) {
+			if(xRadius == rx && yRadius == ry) return false;
+			rx = xRadius; ry = yRadius;
+			trace(xp, yp);
+			return true;
+		}
+
+		// getter methods
+		const unsigned short xRadius() { return rx; }
+		const unsigned short yRadius() { return ry; }
+		const bool filled() { return fill; }
+
+	protected:
+		void assign(CharStruct &from) override { *this = (Ellipse&)from; }
+};
+
+// An ellipse as wide as it is tall, in cells
+class Circle : public Ellipse {
+	public:
+		Circle(const unsigned int collision, const Cell cell,
+		const unsigned short x, const unsigned short y,
+		const unsigned short radius, const bool filled)
+		: Ellipse(collision, cell, x, y, radius, radius, filled) {}
+
+		const char* type() override { return "Circle"; }
+		CharStruct* clone() override { return new Circle(*this); }
+
+	protected:
+		void assign(CharStruct &from) override { *this = (Circle&)from; }
+};
+
+// A polygon through any number of corners, in order, closed back to the
+// first. Filled polygons follow the even-odd rule, so a concave or self
+// crossing polygon fills like it would in a drawing program, and always
+// include their edges.
+class Polygon : public SpanShape {
+	vector<ShapePoint> pts; // the corners, relative to the top left corner
+	bool fill;
+
+	void trace(const vector<ShapePoint> &at) {
+		const unsigned int n = at.size();
+		for(unsigned int i=0; i<n; i++) {
+			const ShapePoint &a = at[i], &b = at[(i + 1) % n];
+			addSegment(a.x, a.y, b.x, b.y);
+		}
+		if(fill && n > 2) {
+			int top = at[0].y, bottom = at[0].y;
+			for(unsigned int i=1; i<n; i++) {
+				if(at[i].y < top) top = at[i].y;
+				if(at[i].y > bottom) bottom = at[i].y;
+			}
+			vector<double> cross;
+			for(int y=top; y<=bottom; y++) {
+				// where the edges cross the middle of the row, corners count
+				// for the edge below them only so they aren't counted twice
+				cross.clear();
+				for(unsigned int i=0; i<n; i++) {
+					const ShapePoint &a = at[i], &b = at[(i + 1) % n];
+					if((a.y <= y) != (b.y <= y))
+						cross.push_back(a.x + (double)(y - a.y) * (b.x - a.x) / (b.y - a.y));
+				}
+				sort(cross.begin(), cross.end());
+				for(unsigned int i=0; i + 1 < cross.size(); i += 2)
+					addRun(y, (int)ceil(cross[i]), (int)floor(cross[i+1]) + 1);
+			}
+		}
+		finishRuns();
+		pts.resize(n);
+		for(unsigned int i=0; i<n; i++) {
+			pts[i].x = at[i].x - xp;
+			pts[i].y = at[i].y - yp;
+		}
+	}
+
+	public:
+		Polygon(const unsigned int collision, const Cell cell,
+		const vector<ShapePoint> &corners, const bool filled)
+		: SpanShape(collision, cell) {
+			fill = filled;
+			trace(corners);
+		}
+
+		const char* type() override { return "Polygon"; }
+		CharStruct* clone() override { return new Polygon(*this); }
+
+		void save(vector<uint8_t> &out) override {
+			SpanShape::save(out);
+			putVarint(out, fill);
+			putVarint(out, pts.size());
+			for(unsigned int i=0; i<pts.size(); i++) {
+				putVarint(out, pts[i].x);
+				putVarint(out, pts[i].y);
+			}
+		}
+
+		bool load(const uint8_t* &p, const uint8_t* end) override {
+			uint64_t f, n;
+			if(!SpanShape::load(p, end) || !getVarint(p, end, f) || !getVarint(p, end, n)
+			|| n > (uint64_t)(end - p)) return false;
+			fill = f;
+			pts.resize(n);
+			for(unsigned int i=0; i<n; i++) {
+				uint64_t x, y;
+				if(!getVarint(p, end, x) || !getVarint(p, end, y)) return false;
+				pts[i].x = x; pts[i].y = y;
+			}
+			return true;
+		}
+
+		// Moves the corners, in world coordinates
+		void setCorners(const vector<ShapePoint> &corners) { trace(corners); }
+
+		// getter methods
+		const unsigned int cornerCt() { return pts.size(); }
+		// a corner in world coordinates
+		const ShapePoint corner(const unsigned int i) {
+			return {(unsigned short)(xp + pts[i].x), (unsigned short)(yp + pts[i].y)};
+		}
+		const bool filled() { return fill; }
+
+	protected:
+		void assign(CharStruct &from) override { *this = (Polygon&)from; }
+};
+
+// The cells a flood fill reaches, such as a room's floor or a spill
+class Region : public SpanShape {
+	public:
+		Region(const unsigned int collision, const Cell cell)
+		: SpanShape(collision, cell) {}
+
+		// Fills from x, y across every cell that open() says the fill can
+		// reach, going up, down, left and right, inside of [0, w) x [0, h).
+		// Cell 0, 0 of that area is world cell wx, wy.
+		// It works a row at a time, so each run is looked at about once.
+		// Returns how many cells it filled.
+		unsigned int fillFrom(const unsigned short x, const unsigned short y,
+		const unsigned short w, const unsigned short h,
+		const function<bool(unsigned short, unsigned short)> &open,
+		const int wx = 0, const int wy = 0) {
+			unsigned int ct = 0;
+			vector<bool> seen((size_t)w * h, false);
+			vector<ShapePoint> seeds;
+			if(x < w && y < h) seeds.push_back({x, y});
+			while(!seeds.empty()) {
+				const ShapePoint s = seeds.back();
+				seeds.pop_back();
+				if(seen[s.y * w + s.x] || !open(s.x, s.y)) continue;
+				// widen to the whole run the seed is in
+				int a = s.x, b = s.x;
+				while(a > 0 && !seen[s.y * w + a - 1] && open(a - 1, s.y)) a--;
+				while(b + 1 < w && !seen[s.y * w + b + 1] && open(b + 1, s.y)) b++;
+				for(int i=a; i<=b; i++) seen[s.y * w + i] = true;
+				addRun(s.y + wy, a + wx, b + 1 + wx);
+				ct += b - a + 1;
+				// one seed for each open run touching it above and below
+				for(int ny = s.y - 1; ny <= s.y + 1; ny += 2) {
+					if(ny < 0 || ny >= h) continue;
+					bool inRun = false;
+					for(int i=a; i<=b; i++) {
+						const bool go = !seen[ny * w + i] && open(i, ny);
+						if(go && !inRun) seeds.push_back({(unsigned short)i, (unsigned short)ny});
+						inRun = go;
+					}
+				}
+			}
+			finishRuns();
+			return ct;
+		}
+
+		// Fills the cells of a display around x, y that look the same as the
+		// cell at x, y, like a paint bucket. x, y are the display's
+		// coordinates, the region lands in the world under the cells filled
+		// however far the display has scrolled.
+		unsigned int fillLike(CharDisplay &display,
+		const unsigned short x, const unsigned short y) {
+			const Cell like = display.cellAt(x, y);
+			return fillFrom(x, y, display.width(), display.height(),
+				[&](const unsigned short cx, const unsigned short cy) {
+					return display.cellAt(cx, cy) == like;
+				}, -display.scrolledX(), -display.scrolledY());
+		}
+
+		const char* type() override { return "Region"; }
+		CharStruct* clone() override { return new Region(*this); }
+
+	protected:
+		void assign(CharStruct &from) override { *this = (Region&)from; }
+};
+
+// Makes an empty struct to load a save into, for the shapes here as well
+// as the engine's own types. Pass it to decodeSnapshot.
+inline CharStruct* makeShape(const char* type) {
+	if(strcmp(type, "Segment") == 0) return new Segment(0, 0, 0, 0, 0, 0);
+	if(strcmp(type, "Ellipse") == 0) return new Ellipse(0, 0, 0, 0, 0, 0, false);
+	if(strcmp(type, "Circle") == 0) return new Circle(0, 0, 0, 0, 0, false);
+	if(strcmp(type, "Polygon") == 0) return new Polygon(0, 0, vector<ShapePoint>(), false);
+	if(strcmp(type, "Region") == 0) return new Region(0, 0);
+	return makeStruct(type);
+}
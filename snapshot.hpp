@@ -0,0 +1,350 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "delta.hpp"
+#include "engine.hpp"
+using namespace std;
+
+// =========================================
+// World snapshots
+// ----------------------------------------
+// A Snapshot holds the structs of a display
+// as they were when it was taken, so that
+// they can be put back later, compared with
+// another snapshot, or saved to a file.
+//
+// Snapshots share whatever they can. Every
+// struct is copied once when it first goes
+// into a snapshot and the copy is never
+// changed after, so later snapshots point
+// to the same copy until the struct is
+// edited again (see CharStruct::edited()).
+// The copies are kept in chunks of CHUNK
+// structs, and a chunk where nothing changed
+// is shared whole. Taking a snapshot costs a
+// stamp check per struct and one copy per
+// struct that changed since the last one.
+//
+//   History history;
+//   history.save(display); // before each turn
+//   ...
+//   history.undo(display); // takes the turn back
+//
+// Since nothing in a snapshot ever changes,
+// it can be written out on another thread
+// while the game goes on:
+//
+//   Snapshot snap = Snapshot::take(display, last);
+//   thread([snap]() { vector<uint8_t> out; encodeSnapshot(out, snap); ... }).detach();
+//
+// Take and restore snapshots between frames,
+// not while jobs are changing the structs.
+// =========================================
+
+// One struct as it was when a snapshot was taken
+struct Frozen {
+	shared_ptr<CharStruct> copy; // NULL if the struct can't be copied
+	unsigned long long id; // the struct's id()
+	unsigned long long stamp; // what its edited() was
+};
+
+class Snapshot {
+	public:
+		static const unsigned int CHUNK = 32; // structs per chunk
+		typedef vector<Frozen> Chunk;
+
+	private:
+		vector<shared_ptr<const Chunk>> chunks;
+		unsigned int ct;
+		unsigned int copyCt; // structs that were copied taking it
+
+		// Whether a chunk still holds the structs from start on, unchanged
+		static bool unchanged(const Chunk &chunk, CharDisplay &display,
+		const unsigned int start, const unsigned int n) {
+			if(chunk.size() != n) return false;
+			for(unsigned int k=0; k<n; k++) {
+				CharStruct* s = display.getPtr(start + k);
+				if(chunk[k].id != s -> id() || chunk[k].stamp != s -> edited()) return false;
+			}
+			return true;
+		}
+
+		friend bool decodeSnapshot(const uint8_t* p, const size_t len, Snapshot &snap,
+		const function<CharStruct*(const char*)> &maker);
+
+	public:
+		Snapshot() { ct = 0; copyCt = 0; }
+
+		// Takes a snapshot of every struct on a display, sharing
+		// the copies of structs that haven't changed since another
+		static Snapshot take(CharDisplay &display, const Snapshot &since) {
+			Snapshot snap;
+			snap.ct = display.structCt();
+			// where each struct of since is, worked out only if something moved
+			unordered_map<unsigned long long, const Frozen*> was;
+			for(unsigned int start=0, c=0; start<snap.ct; start += CHUNK, c++) {
+				const unsigned int n = snap.ct - start < CHUNK ? snap.ct - start : CHUNK;
+				const Chunk* old = c < since.chunks.size() ? since.chunks[c].get() : NULL;
+				if(old != NULL && unchanged(*old, display, start, n)) {
+					snap.chunks.push_back(since.chunks[c]);
+					continue;
+				}
+				shared_ptr<Chunk> chunk = make_shared<Chunk>(n);
+				for(unsigned int k=0; k<n; k++) {
+					CharStruct* s = display.getPtr(start + k);
+					Frozen &f = (*chunk)[k];
+					f.id = s -> id();
+					f.stamp = s -> edited();
+					const Frozen* prev = NULL;
+					if(old != NULL && k < old -> size() && (*old)[k].id == f.id) prev = &(*old)[k];
+					else {
+						if(was.empty())
+							for(unsigned int i=0; i<since.chunks.size(); i++)
+								for(const Frozen &e : *since.chunks[i]) was[e.id] = &e;
+						auto it = was.find(f.id);
+						if(it != was.end()) prev = it -> second;
+					}
+					if(prev != NULL && prev -> stamp == f.stamp) f.copy = prev -> copy;
+					else {
+						f.copy = shared_ptr<CharStruct>(s -> clone());
+						snap.copyCt++;
+					}
+				}
+				snap.chunks.push_back(chunk);
+			}
+			return snap;
+		}
+
+		// Takes a snapshot that copies every struct
+		static Snapshot take(CharDisplay &display) { return take(display, Snapshot()); }
+
+		// Puts the display's structs back the way they were, and redraws it.
+		// Structs that are still on the display are set back in place, so
+		// pointers to them stay good, and only if they changed since. Structs
+		// removed since are copied back, and structs added since are removed.
+		void restore(CharDisplay &display) const {
+			unordered_map<unsigned long long, CharStruct*> live;
+			for(unsigned int i=0; i<display.structCt(); i++) {
+				CharStruct* s = display.getPtr(i);
+				live[s -> id()] = s;
+			}
+			vector<CharStruct *> list;
+			list.reserve(ct);
+			for(unsigned int c=0; c<chunks.size(); c++) {
+				for(const Frozen &f : *chunks[c]) {
+					auto it = live.find(f.id);
+					if(it != live.end()) {
+						CharStruct* s = it -> second;
+						if(f.copy != NULL && s -> edited() != f.stamp) s -> restoreFrom(*f.copy);
+						list.push_back(s);
+						live.erase(it);
+					} else if(f.copy != NULL) list.push_back(f.copy -> clone());
+				}
+			}
+			display.replaceStructs(list);
+			display.redrawStructs();
+		}
+
+		// Calls fn for every struct that differs between two snapshots, with
+		// how it was in a and how it is in b. Structs only in b come with a
+		// NULL before, and structs only in a with a NULL after. Chunks the
+		// two share are skipped without looking inside.
+		static void diff(const Snapshot &a, const Snapshot &b,
+		const function<void(const Frozen* before, const Frozen* after)> &fn) {
+			unordered_map<unsigned long long, const Frozen*> before;
+			vector<const Frozen*> after;
+			const size_t n = a.chunks.size() > b.chunks.size() ? a.chunks.size() : b.chunks.size();
+			for(size_t c=0; c<n; c++) {
+				const Chunk* ca = c < a.chunks.size() ? a.chunks[c].get() : NULL;
+				const Chunk* cb = c < b.chunks.size() ? b.chunks[c].get() : NULL;
+				if(ca == cb) continue;
+				if(ca != NULL) for(const Frozen &f : *ca) before[f.id] = &f;
+				if(cb != NULL) for(const Frozen &f : *cb) after.push_back(&f);
+			}
+			for(unsigned int i=0; i<after.size(); i++) {
+				auto it = before.find(after[i] -> id);
+				if(it == before.end()) fn(NULL, after[i]);
+				else {
+					if(it -> second -> copy != after[i] -> copy) fn(it -> second, after[i]);
+					before.erase(it);
+				}
+			}
+			for(auto &gone : before) fn(gone.second, NULL);
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		// number of structs in the snapshot
+		const unsigned int size() const { return ct; }
+		// a struct in drawing order, as it was, or NULL if index is out of bounds
+		const Frozen* at(const unsigned int index) const {
+			if(index >= ct) return NULL;
+			return &(*chunks[index / CHUNK])[index % CHUNK];
+		}
+		// how many structs were copied taking it, the rest were shared
+		const unsigned int copied() const { return copyCt; }
+		// how many chunks it has, and how many of them it shares with another
+		const unsigned int chunkCt() const { return chunks.size(); }
+		const unsigned int sharedWith(const Snapshot &other) const {
+			unsigned int n = 0;
+			for(unsigned int c=0; c<chunks.size() && c<other.chunks.size(); c++)
+				if(chunks[c] == other.chunks[c]) n++;
+			return n;
+		}
+};
+
+// Snapshots taken before each turn, to take turns back with
+class History {
+	deque<Snapshot> past;
+	unsigned int limit;
+
+	public:
+		// steps - how many turns back can be taken, the oldest are forgotten
+		History(const unsigned int steps = 64) { limit = steps > 0 ? steps : 1; }
+
+		// Remembers the display as it is now
+		void save(CharDisplay &display) {
+			if(past.empty()) past.push_back(Snapshot::take(display));
+			else past.push_back(Snapshot::take(display, past.back()));
+			if(past.size() > limit) past.pop_front();
+		}
+
+		// Puts the display back the way it was at the last save, and forgets
+		// that save. Returns false if there is nothing to go back to.
+		bool undo(CharDisplay &display) {
+			if(past.empty()) return false;
+			past.back().restore(display);
+			past.pop_back();
+			return true;
+		}
+
+		void forget() { past.clear(); }
+
+		// ============
+		// Getter funcs
+		// ============
+
+		// how many turns can be taken back
+		const unsigned int steps() { return past.size(); }
+		// the last save, or NULL if there is none
+		const Snapshot* last() { return past.empty() ? NULL : &past.back(); }
+};
+
+// ======
+// Saving
+// ======
+
+const uint8_t SNAPSHOT_VERSION = 1;
+
+// Makes an empty struct of one of the engine's types to load a save into,
+// or NULL for a type it doesn't know. Programs with their own structs pass
+// decodeSnapshot a maker that knows them too.
+inline CharStruct* makeStruct(const char* type) {
+	if(strcmp(type, "CollChar") == 0) return new CollChar();
+	if(strcmp(type, "Line") == 0) return new Line(0);
+	if(strcmp(type, "Box") == 0) return new Box(0, '0', false);
+	if(strcmp(type, "StoredGrid") == 0) return new StoredGrid(0, 0, 0, 0, 0);
+	if(strcmp(type, "CharStructGroup") == 0) return new CharStructGroup();
+	return NULL;
+}
+
+// A struct as its type name, then its length so readers can skip
+// types they don't know, then what it saved. Groups save what is
+// in them after themselves.
+inline void encodeStruct(vector<uint8_t> &out, CharStruct &s) {
+	const char* type = s.type();
+	const size_t n = strlen(type);
+	putVarint(out, n);
+	out.insert(out.end(), type, type + n);
+	vector<uint8_t> body;
+	s.save(body);
+	if(strcmp(type, "CharStructGroup") == 0) {
+		CharStructGroup &g = (CharStructGroup&)s;
+		putVarint(body, g.size());
+		for(unsigned short i=0; i<g.size(); i++) encodeStruct(body, *g.getPtr(i));
+	}
+	putVarint(out, body.size());
+	out.insert(out.end(), body.begin(), body.end());
+}
+
+// Reads a struct and moves p past it. s is set to NULL, and true is
+// returned, for a type the maker doesn't know.
+inline bool decodeStruct(const uint8_t* &p, const uint8_t* end, CharStruct* &s,
+const function<CharStruct*(const char*)> &maker) {
+	s = NULL;
+	uint64_t n, len;
+	if(!getVarint(p, end, n) || n > (uint64_t)(end - p)) return false;
+	const string type((const char*)p, n);
+	p += n;
+	if(!getVarint(p, end, len) || len > (uint64_t)(end - p)) return false;
+	const uint8_t* body = p;
+	const uint8_t* bodyEnd = p + len;
+	p = bodyEnd;
+	s = maker(type.c_str());
+	if(s == NULL) return true;
+	bool ok = s -> load(body, bodyEnd);
+	if(ok && type == "CharStructGroup") {
+		uint64_t kids;
+		ok = getVarint(body, bodyEnd, kids);
+		for(uint64_t i=0; ok && i<kids; i++) {
+			CharStruct* kid;
+			ok = decodeStruct(body, bodyEnd, kid, maker);
+			if(ok && kid != NULL) ((CharStructGroup*)s) -> add(kid);
+		}
+	}
+	if(!ok) { delete s; s = NULL; }
+	return ok;
+}
+
+// Appends a whole snapshot. Structs that can't be copied are left out.
+inline void encodeSnapshot(vector<uint8_t> &out, const Snapshot &snap) {
+	const uint8_t magic[4] = {'A', 'E', 'W', 'S'};
+	out.insert(out.end(), magic, magic + 4);
+	out.push_back(SNAPSHOT_VERSION);
+	unsigned int n = 0;
+	for(unsigned int i=0; i<snap.size(); i++)
+		if(snap.at(i) -> copy != NULL) n++;
+	putVarint(out, n);
+	for(unsigned int i=0; i<snap.size(); i++)
+		if(snap.at(i) -> copy != NULL) encodeStruct(out, *snap.at(i) -> copy);
+}
+
+// Reads a snapshot written by encodeSnapshot, leaving out structs of types
+// the maker doesn't know. The structs get new ids, so restoring it replaces
+// every struct on the display. Returns false if the data is bad.
+inline bool decodeSnapshot(const uint8_t* p, const size_t len, Snapshot &snap,
+const function<CharStruct*(const char*)> &maker = makeStruct) {
+	const uint8_t* end = p + len;
+	if(len < 5 || memcmp(p, "AEWS", 4) != 0 || p[4] != SNAPSHOT_VERSION) return false;
+	p += 5;
+	uint64_t n;
+	if(!getVarint(p, end, n)) return false;
+	snap = Snapshot();
+	shared_ptr<Snapshot::Chunk> chunk;
+	for(uint64_t i=0; i<n; i++) {
+		CharStruct* s;
+		if(!decodeStruct(p, end, s, maker)) return false;
+		if(s == NULL) continue;
+		if(chunk == NULL || chunk -> size() == Snapshot::CHUNK) {
+			chunk = make_shared<Snapshot::Chunk>();
+			chunk -> reserve(Snapshot::CHUNK);
+			snap.chunks.push_back(chunk);
+		}
+		Frozen f;
+		f.copy = shared_ptr<CharStruct>(s);
+		f.id = s -> id();
+		f.stamp = s -> edited();
+		chunk -> push_back(f);
+		snap.ct++;
+		snap.copyCt++;
+	}
+	return true;
+}
@@ -0,0 +1,213 @@
+#pragma once
+#include <cstdint>
+#include <type_traits>
+#include "engine.hpp"
+using namespace std;
+
+// =========================================
+// Static shapes
+// ----------------------------------------
+// Shapes that are known when the program is
+// compiled, such as HUD frames or sprites,
+// written as ASCII art in a string literal:
+//
+//   struct Pillar {
+//       static constexpr const char art[] =
+//           "┌─┐\n"
+//           "│ │\n"
+//           "└─┘";
+//       // optional colors and attributes
+//       static constexpr Cell style = cellOf(0, 3);
+//   };
+//
+// The literal is read as UTF-8, one character
+// per column. Spaces are see-through and do
+// not collide, everything else is drawn and
+// collides. The runs of visible cells and the
+// collision mask are worked out at compile
+// time, so writing the shape copies a few
+// premade runs and a collision check is one
+// bit test.
+//
+// StaticArt<Pillar>::write draws it with no
+// virtual calls at all, StaticStruct<Pillar>
+// is the same shape as a CharStruct that can
+// be added to a CharDisplay.
+// =========================================
+
+// A run of visible cells in a shape, in shape coordinates
+struct ArtSpan {
+	unsigned short x, y, len;
+	unsigned short at; // index of the run's first cell in the glyphs
+};
+
+// The size of a shape, worked out by a first pass over the art
+struct ArtCounts {
+	unsigned short wd, ht, spanCt, glyphCt;
+};
+
+// First pass, the dimensions of the art and how many runs and cells it has
+constexpr ArtCounts artCount(const char* s, const size_t n) {
+	ArtCounts ct = {0, 0, 0, 0};
+	unsigned short x = 0;
+	bool inRun = false;
+	size_t i = 0;
+	while(i < n) {
+		const uint32_t cp = utf8Decode(s, n, i);
+		if(cp == '\n') {
+			ct.ht++;
+			x = 0;
+			inRun = false;
+			continue;
+		}
+		if(cp != ' ') {
+			if(!inRun) ct.spanCt++;
+			ct.glyphCt++;
+		}
+		inRun = (cp != ' ');
+		x++;
+		if(x > ct.wd) ct.wd = x;
+	}
+	if(n > 0 && s[n-1] != '\n') ct.ht++; // last line has no newline
+	return ct;
+}
+
+// The premade runs, cells and collision mask of a shape
+template<unsigned short SpanCt, unsigned short GlyphCt,
+unsigned short Ht, unsigned short Words>
+struct ArtData {
+	ArtSpan spans[SpanCt ? SpanCt : 1];
+	Cell glyphs[GlyphCt ? GlyphCt : 1];
+	// the spans of row y are rowSpan[y] up to rowSpan[y+1]
+	unsigned short rowSpan[Ht + 1];
+	// collision bits, Words 64 bit words per row
+	uint64_t mask[(Ht * Words) ? Ht * Words : 1];
+};
+
+// Second pass, fills in the runs, cells and mask
+template<class Data>
+constexpr Data artBuild(const char* s, const size_t n, const Cell style,
+const unsigned short ht, const unsigned short words) {
+	Data d {};
+	unsigned short x = 0, y = 0, sp = 0, gl = 0;
+	bool inRun = false;
+	size_t i = 0;
+	d.rowSpan[0] = 0;
+	while(i < n) {
+		const uint32_t cp = utf8Decode(s, n, i);
+		if(cp == '\n') {
+			y++;
+			d.rowSpan[y] = sp;
+			x = 0;
+			inRun = false;
+			continue;
+		}
+		if(cp != ' ') {
+			if(!inRun) d.spans[sp++] = ArtSpan {x, y, 0, gl};
+			d.spans[sp-1].len++;
+			d.glyphs[gl++] = cellWithChar(style, cp);
+			d.mask[y * words + x / 64] |= (uint64_t)1 << (x % 64);
+		}
+		inRun = (cp != ' ');
+		x++;
+	}
+	for(unsigned short r=y+1; r<=ht; r++)
+		d.rowSpan[r] = sp;
+	return d;
+}
+
+// The optional style member of an art type, or 0 for default colors
+template<class Art, class = void>
+struct ArtStyle { static constexpr Cell value = 0; };
+
+template<class Art>
+struct ArtStyle<Art, void_t<decltype(Art::style)>>
+{ static constexpr Cell value = Art::style; };
+
+// Everything about a shape that is known at compile time
+template<class Art>
+struct StaticArt {
+	static constexpr ArtCounts counts = artCount(Art::art, sizeof(Art::art) - 1);
+	static constexpr unsigned short width = counts.wd, height = counts.ht;
+	static constexpr unsigned short words = (counts.wd + 63) / 64;
+	typedef ArtData<counts.spanCt, counts.glyphCt, counts.ht, words> Data;
+	static constexpr Data data = artBuild<Data>(Art::art, sizeof(Art::art) - 1,
+		cellStyle(ArtStyle<Art>::value), counts.ht, words);
+
+	// Writes the shape with its top left corner at x, y
+	static void write(CharBuffer &buf, const unsigned short x, const unsigned short y) {
+		for(unsigned short i=0; i<counts.spanCt; i++) {
+			const ArtSpan &sp = data.spans[i];
+			buf.cells(x + sp.x, y + sp.y, data.glyphs + sp.at, sp.len);
+		}
+	}
+
+	// Whether the shape collides at x, y relative to its top left corner
+	static constexpr bool solid(const unsigned short x, const unsigned short y) {
+		return x < width && y < height
+			&& (data.mask[y * words + x / 64] >> (x % 64) & 1);
+	}
+
+	// The cell at x, y relative to its top left corner, or 0 if see-through
+	static constexpr Cell cellAt(const unsigned short x, const unsigned short y) {
+		if(!solid(x, y)) return 0;
+		for(unsigned short i=data.rowSpan[y]; i<data.rowSpan[y+1]; i++) {
+			const ArtSpan &sp = data.spans[i];
+			if(x >= sp.x && x < sp.x + sp.len)
+				return data.glyphs[sp.at + x - sp.x];
+		}
+		return 0;
+	}
+};
+
+// Writes a static shape straight onto a display at x, y,
+// on top of everything else, without storing it as a struct.
+template<class Art>
+void stamp(CharDisplay &display, const unsigned short x, const unsigned short y) {
+	display.writeWith([x, y](CharBuffer &buf) { StaticArt<Art>::write(buf, x, y); });
+}
+
+// A static shape as a CharStruct, so that it can be added to a CharDisplay
+// and collided with. The class is final, so calls through a StaticStruct
+// pointer are resolved at compile time as well.
+template<class Art>
+class StaticStruct final : public CharStruct {
+	public:
+		StaticStruct() : CharStruct() {}
+
+		StaticStruct(const unsigned int collision,
+		const unsigned short xPos, const unsigned short yPos)
+		: CharStruct(collision, xPos, yPos) {}
+
+		// overrides for CharStruct funcs
+
+		void write(CharBuffer &buf) override {
+			StaticArt<Art>::write(buf, xp, yp);
+		}
+
+		Cell charAt(const unsigned short x, const unsigned short y) override {
+			return StaticArt<Art>::cellAt(x - xp, y - yp);
+		}
+
+		bool inColl(const unsigned short x, const unsigned short y) override {
+			return StaticArt<Art>::solid(x - xp, y - yp);
+		}
+
+		bool bounds(unsigned short &x, unsigned short &y,
+		unsigned short &w, unsigned short &h) override {
+			x = xp; y = yp;
+			w = StaticArt<Art>::width;
+			h = StaticArt<Art>::height;
+			return true;
+		}
+
+		const char* type() override { return "StaticStruct"; }
+		CharStruct* clone() override { return new StaticStruct(*this); }
+
+		// getter methods
+		const unsigned short width() { return StaticArt<Art>::width; }
+		const unsigned short height() { return StaticArt<Art>::height; }
+
+	protected:
+		void assign(CharStruct &from) override { *this = (StaticStruct&)from; }
+};
@@ -0,0 +1,334 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <vector>
+using namespace std;
+
+// =========================================
+// Timing wheel
+// ----------------------------------------
+// Keeps track of game events that come due
+// later, such as a spell wearing off or a
+// monster respawning, however many of them
+// there are.
+//
+// Time is counted in ticks: milliseconds of
+// an EventLoop (see EventLoop::wheel()), or
+// frames or turns when a game advances the
+// wheel itself. The wheel has four levels of
+// 256 slots. The first level's slots are one
+// tick each, the second's 256 ticks each, and
+// so on. An event goes in the slot of the
+// lowest level that reaches its due tick.
+// Whenever the first level comes round, the
+// next level's slot for the coming 256 ticks
+// is emptied down into the first level, and
+// likewise up the levels, so an event only
+// moves a few times in its life. Scheduling
+// and cancelling are O(1), and advancing
+// skips empty slots 64 at a time with a bit
+// per slot.
+//
+// Events are kept in a pool of nodes that
+// are reused, linked into their slot both
+// ways so any of them can be unlinked.
+//
+//   TimerWheel &timers = loop.wheel();
+//   auto burn = timers.every(500, [&]() { hurt(player, 1); });
+//   timers.after(8000, [&, burn]() { timers.cancel(burn); });
+//
+// An event can carry a number instead of a
+// function. Those that come due on the same
+// tick are handed to onExpired() together in
+// one call, which is how hundreds of thousands
+// of them stay cheap:
+//
+//   timers.onExpired([&](const uint64_t* ids, size_t n) {
+//       for(size_t i=0; i<n; i++) respawn(ids[i]);
+//   });
+//   timers.afterTag(30000, monsterId);
+// =========================================
+
+class TimerWheel {
+	public:
+		// 0 is never a handle
+		typedef unsigned long long Handle;
+
+	private:
+		static const unsigned int LEVELS = 4, SLOTS = 256, BITS = 8;
+		static const unsigned int FIRING = LEVELS * SLOTS; // the list being run
+		static const int NONE = -1;
+
+		struct Node {
+			uint64_t due, every; // the tick it is due on, ticks between repeats or 0
+			uint64_t tag; // handed to onExpired when fn is empty
+			function<void()> fn;
+			int prev, next; // in its list, NONE at the ends
+			unsigned int list; // which list it is in, or NONE when free
+			unsigned int gen; // bumped every time the node is freed
+		};
+
+		vector<Node> nodes;
+		int freeList; // free nodes, linked by next
+		int heads[LEVELS * SLOTS + 1];
+		uint64_t occupied[LEVELS][SLOTS / 64]; // a bit per slot that isn't empty
+		uint64_t tick; // the last tick that was run
+		size_t pendingCt;
+		vector<uint64_t> batch; // tags that came due this tick
+		function<void(const uint64_t*, size_t)> expiredFn;
+
+		void link(const int n, const unsigned int list) {
+			Node &node = nodes[n];
+			node.list = list;
+			node.prev = NONE;
+			node.next = heads[list];
+			if(node.next != NONE) nodes[node.next].prev = n;
+			heads[list] = n;
+			if(list < FIRING) occupied[list / SLOTS][list % SLOTS / 64] |= (uint64_t)1 << (list % 64);
+		}
+
+		void unlink(const int n) {
+			Node &node = nodes[n];
+			if(node.prev != NONE) nodes[node.prev].next = node.next;
+			else heads[node.list] = node.next;
+			if(node.next != NONE) nodes[node.next].prev = node.prev;
+			if(heads[node.list] == NONE && node.list < FIRING)
+				occupied[node.list / SLOTS][node.list % SLOTS / 64] &= ~((uint64_t)1 << (node.list % 64));
+		}
+
+		// Puts a node in the slot for its due tick, as seen from the current
+		// tick. Only a cascade places a node due on the current tick, and the
+		// first level's slot for it is run right after.
+		void place(const int n) {
+			uint64_t due = nodes[n].due;
+			if(due < tick) due = tick;
+			const uint64_t delta = due - tick;
+			unsigned int level = 0;
+			while(level < LEVELS - 1 && delta >= (uint64_t)1 << (BITS * (level + 1))) level++;
+			// past the top level's reach, it waits in the furthest slot and is
+			// placed again when that slot is emptied
+			if(delta >= (uint64_t)1 << (BITS * LEVELS)) due = tick + ((uint64_t)1 << (BITS * LEVELS)) - 1;
+			link(n, level * SLOTS + (due >> (BITS * level)) % SLOTS);
+		}
+
+		int claim() {
+			if(freeList == NONE) {
+				nodes.emplace_back();
+				nodes.back().gen = 1;
+				nodes.back().list = NONE;
+				return nodes.size() - 1;
+			}
+			const int n = freeList;
+			freeList = nodes[n].next;
+			return n;
+		}
+
+		void release(const int n) {
+			Node &node = nodes[n];
+			node.fn = nullptr; // lets go of what it captured
+			node.list = NONE;
+			node.gen++;
+			node.next = freeList;
+			freeList = n;
+			pendingCt--;
+		}
+
+		Handle add(const uint64_t delay, const uint64_t every, const uint64_t tag,
+		const function<void()> &fn) {
+			const int n = claim();
+			Node &node = nodes[n];
+			node.due = tick + (delay > 0 ? delay : 1);
+			node.every = every;
+			node.tag = tag;
+			node.fn = fn;
+			place(n);
+			pendingCt++;
+			return (Handle)node.gen << 32 | (unsigned int)n;
+		}
+
+		// the next slot at or after slot from of a level with anything in it,
+		// counted from from, or SLOTS if they are all empty
+		unsigned int nextOccupied(const unsigned int level, const unsigned int from) const {
+			for(unsigned int k=0; k<SLOTS; ) {
+				const unsigned int s = (from + k) % SLOTS;
+				const uint64_t word = occupied[level][s / 64] >> (s % 64);
+				if(word != 0) {
+					const unsigned int at = k + __builtin_ctzll(word);
+					return at < SLOTS ? at : SLOTS;
+				}
+				k += 64 - s % 64;
+			}
+			return SLOTS;
+		}
+
+		// Empties a slot of a level above the first down into the lower levels
+		void cascade(const unsigned int level) {
+			const unsigned int list = level * SLOTS + (tick >> (BITS * level)) % SLOTS;
+			int n = heads[list];
+			heads[list] = NONE;
+			occupied[level][list % SLOTS / 64] &= ~((uint64_t)1 << (list % 64));
+			while(n != NONE) {
+				const int next = nodes[n].next;
+				place(n);
+				n = next;
+			}
+		}
+
+		// Runs everything due on the current tick
+		void expire() {
+			const unsigned int list = tick % SLOTS;
+			if(heads[list] == NONE) return;
+			// moved to a list of its own, so events scheduled while it
+			// runs wait for their own tick and cancels still unlink
+			heads[FIRING] = heads[list];
+			heads[list] = NONE;
+			occupied[0][list / 64] &= ~((uint64_t)1 << (list % 64));
+			for(int n=heads[FIRING]; n!=NONE; n=nodes[n].next) nodes[n].list = FIRING;
+			batch.clear();
+			while(heads[FIRING] != NONE) {
+				const int n = heads[FIRING];
+				unlink(n);
+				Node &node = nodes[n];
+				if(!node.fn) batch.push_back(node.tag);
+				if(node.every != 0) {
+					node.due = tick + node.every;
+					place(n);
+					// run after it is placed again, so it can cancel itself
+					if(node.fn) {
+						// moved out, since fn can add events and move the pool
+						function<void()> fn;
+						fn.swap(node.fn);
+						const unsigned int gen = node.gen;
+						fn();
+						if(nodes[n].gen == gen) nodes[n].fn.swap(fn); // unless it was cancelled
+					}
+				} else if(node.fn) {
+					function<void()> fn;
+					fn.swap(node.fn);
+					release(n);
+					fn();
+				} else release(n);
+			}
+			if(!batch.empty() && expiredFn) expiredFn(batch.data(), batch.size());
+		}
+
+	public:
+		// start - the tick the wheel starts on
+		TimerWheel(const uint64_t start = 0) {
+			freeList = NONE;
+			for(unsigned int i=0; i<=FIRING; i++) heads[i] = NONE;
+			for(unsigned int l=0; l<LEVELS; l++)
+				for(unsigned int w=0; w<SLOTS / 64; w++) occupied[l][w] = 0;
+			tick = start;
+			pendingCt = 0;
+		}
+
+		// Makes room for n events, so scheduling them never allocates a node
+		void reserve(const size_t n) {
+			nodes.reserve(n);
+			while(nodes.size() < n) {
+				nodes.emplace_back();
+				Node &node = nodes.back();
+				node.gen = 1;
+				node.list = NONE;
+				node.next = freeList;
+				freeList = nodes.size() - 1;
+			}
+		}
+
+		// =========
+		// Scheduling
+		// =========
+
+		// Runs fn once, ticks from now. Returns a handle for cancel().
+		Handle after(const uint64_t ticks, const function<void()> &fn) {
+			return add(ticks, 0, 0, fn);
+		}
+
+		// Runs fn every ticks from now on. Returns a handle for cancel().
+		Handle every(const uint64_t ticks, const function<void()> &fn) {
+			return add(ticks, ticks > 0 ? ticks : 1, 0, fn);
+		}
+
+		// Hands tag to onExpired ticks from now, with the others due then
+		Handle afterTag(const uint64_t ticks, const uint64_t tag) {
+			return add(ticks, 0, tag, nullptr);
+		}
+
+		// Hands tag to onExpired every ticks from now on
+		Handle everyTag(const uint64_t ticks, const uint64_t tag) {
+			return add(ticks, ticks > 0 ? ticks : 1, tag, nullptr);
+		}
+
+		// Called once per tick with the tags of every tagged event due on it
+		void onExpired(const function<void(const uint64_t*, size_t)> &fn) { expiredFn = fn; }
+
+		// Stops a scheduled event, returns true if it was still scheduled
+		bool cancel(const Handle h) {
+			const unsigned int n = h & 0xFFFFFFFF;
+			if(n >= nodes.size() || nodes[n].gen != h >> 32 || nodes[n].list == (unsigned int)NONE)
+				return false;
+			unlink(n);
+			release(n);
+			return true;
+		}
+
+		// ========
+		// Advancing
+		// ========
+
+		// Runs every event due up to and including tick to
+		void advanceTo(const uint64_t to) {
+			while(tick < to) {
+				if(pendingCt == 0) { tick = to; return; }
+				// straight to the next slot with anything in it, stopping
+				// where the first level comes round to cascade
+				const unsigned int at = tick % SLOTS;
+				unsigned int skip = at + 1 < SLOTS ? nextOccupied(0, at + 1) : SLOTS;
+				if(at + 1 + skip > SLOTS) skip = SLOTS - at - 1;
+				tick += (to - tick <= skip ? to - tick - 1 : skip) + 1;
+				if(tick % SLOTS == 0) {
+					unsigned int top = 1;
+					while(top < LEVELS - 1 && (tick >> (BITS * top)) % SLOTS == 0) top++;
+					for(unsigned int l=top; l>=1; l--) cascade(l);
+				}
+				expire();
+			}
+		}
+
+		// Runs every event due in the next ticks
+		void advance(const uint64_t ticks) { advanceTo(tick + ticks); }
+
+		// ============
+		// Getter funcs
+		// ============
+
+		// The earliest tick anything could come due or move down a level,
+		// never later than the next event, or UINT64_MAX with none pending.
+		// For sleeping until then.
+		const uint64_t nextDue() const {
+			if(pendingCt == 0) return UINT64_MAX;
+			uint64_t best = UINT64_MAX;
+			for(unsigned int l=0; l<LEVELS; l++) {
+				const uint64_t cur = tick >> (BITS * l);
+				const unsigned int k = nextOccupied(l, (cur + 1) % SLOTS) + 1;
+				if(k > SLOTS) continue;
+				const uint64_t at = (cur + k) << (BITS * l);
+				if(at < best) best = at;
+			}
+			return best;
+		}
+
+		// whether an event is still scheduled
+		const bool pending(const Handle h) const {
+			const unsigned int n = h & 0xFFFFFFFF;
+			return n < nodes.size() && nodes[n].gen == h >> 32 && nodes[n].list != (unsigned int)NONE;
+		}
+
+		// the last tick that was run
+		const uint64_t now() const { return tick; }
+		// events still to come
+		const size_t scheduled() const { return pendingCt; }
+		// nodes made so far, used or free
+		const size_t poolSize() const { return nodes.size(); }
+};
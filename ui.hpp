@@ -0,0 +1,444 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <vector>
+#include "engine.hpp"
+using namespace std;
+
+// =========================================
+// UI widgets
+// ----------------------------------------
+// A tree of widgets, such as labels, lists
+// and menus inside bordered panels, that is
+// kept around between frames instead of
+// being drawn from scratch every time.
+//
+// Each widget works out its size once and
+// keeps it until its content changes size,
+// and is placed once until something above
+// it moves. A change only marks the cells
+// that it touches, so moving the selection
+// of a menu marks two lines. A UI is a
+// CharStruct: add it to a display and call
+// flush() after changing widgets, which
+// redraws just the marked rectangles.
+//
+//   UI* ui = new UI(0, 0);
+//   Panel* panel = new Panel("Options");
+//   Menu* menu = new Menu(10);
+//   menu -> addItem("Start");
+//   panel -> add(menu);
+//   ui -> setRoot(panel);
+//   display.addStruct(ui);
+//   ...
+//   menu -> key(input);
+//   ui -> flush(display);
+//   display.update();
+// =========================================
+
+class UI;
+
+// The cells of UTF-8 text in a style, one character per column
+inline void uiCells(const string &text, const Cell style, vector<Cell> &out) {
+	out.clear();
+	size_t i = 0;
+	while(i < text.size())
+		out.push_back(cellWithChar(style, utf8Decode(text.data(), text.size(), i)));
+}
+
+// A part of the UI. Widgets own their children.
+class Widget {
+	friend class UI;
+	protected:
+		Widget *parent;
+		vector<Widget *> kids;
+		UI *ui; // the UI the widget is in, NULL until it is in one
+		unsigned short rx, ry, rw, rh; // where it was placed, world coordinates
+		unsigned short mw, mh; // the size it wants, when measured is true
+		bool measured;
+
+		// Works out the size the widget wants
+		virtual void measure(unsigned short &w, unsigned short &h) = 0;
+		// Places the children inside of the widget's rectangle
+		virtual void arrange() {}
+		// Draws the widget itself, its children are drawn after it
+		virtual void draw(CharBuffer &buf) = 0;
+
+		// Marks the wd by ht cells at x, y within the widget for redrawing
+		void invalidate(const unsigned short x, const unsigned short y,
+		const unsigned short wd, const unsigned short ht);
+
+		// Marks the whole widget for redrawing
+		void invalidate() { invalidate(0, 0, rw, rh); }
+
+		// The widget's size may have changed, so it and everything
+		// above it are measured and placed again on the next flush
+		void remeasure();
+
+		void attach(UI *to) {
+			ui = to;
+			for(unsigned int i=0; i<kids.size(); i++) kids[i] -> attach(to);
+		}
+
+	public:
+		Widget() {
+			parent = NULL;
+			ui = NULL;
+			rx = 0; ry = 0; rw = 0; rh = 0;
+			mw = 0; mh = 0;
+			measured = false;
+		}
+
+		virtual ~Widget() {
+			for(unsigned int i=0; i<kids.size(); i++)
+				delete(kids[i]);
+		}
+
+		// Adds a child, which the widget deletes. Returns the child.
+		Widget* add(Widget *child) {
+			child -> parent = this;
+			child -> attach(ui);
+			kids.push_back(child);
+			remeasure();
+			return child;
+		}
+
+		// The size the widget wants, measured once until it changes
+		void size(unsigned short &w, unsigned short &h) {
+			if(!measured) {
+				measure(mw, mh);
+				measured = true;
+			}
+			w = mw; h = mh;
+		}
+
+		// Puts the widget at a rectangle. If it moved or changed size
+		// both where it was and where it is now are redrawn.
+		void place(const unsigned short x, const unsigned short y,
+		const unsigned short w, const unsigned short h) {
+			if(x == rx && y == ry && w == rw && h == rh) {
+				arrange(); // children may still have changed size
+				return;
+			}
+			invalidate();
+			rx = x; ry = y; rw = w; rh = h;
+			invalidate();
+			arrange();
+		}
+
+		// Draws the widget and its children, if any of it is being written
+		void render(CharBuffer &buf) {
+			if(rw == 0 || rh == 0 || !buf.overlaps(rx, ry, rw, rh)) return;
+			draw(buf);
+			for(unsigned int i=0; i<kids.size(); i++)
+				kids[i] -> render(buf);
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		const unsigned short posX() { return rx; }
+		const unsigned short posY() { return ry; }
+		const unsigned short width() { return rw; }
+		const unsigned short height() { return rh; }
+		const unsigned int childCt() { return kids.size(); }
+		Widget* child(const unsigned int i) { return i < kids.size() ? kids[i] : NULL; }
+};
+
+// The root of a widget tree, as a struct that can be added to a display.
+// It collects what the widgets mark, and redraws only that on flush().
+class UI : public CharStruct {
+	Widget *root;
+	bool needsLayout;
+	vector<unsigned short> marks; // x, y, w, h of every rectangle to redraw
+	unsigned int redrawCt; // rectangles redrawn, to check partial redraws
+
+	friend class Widget;
+
+	void mark(const unsigned short x, const unsigned short y,
+	const unsigned short w, const unsigned short h) {
+		if(w == 0 || h == 0) return;
+		// a rectangle inside of one already marked adds nothing
+		for(unsigned int i=0; i<marks.size(); i += 4)
+			if(x >= marks[i] && y >= marks[i+1]
+			&& x + w <= marks[i] + marks[i+2] && y + h <= marks[i+1] + marks[i+3])
+				return;
+		marks.push_back(x); marks.push_back(y);
+		marks.push_back(w); marks.push_back(h);
+	}
+
+	public:
+		UI(const unsigned short xPos, const unsigned short yPos)
+		: CharStruct(0, xPos, yPos) {
+			root = NULL;
+			needsLayout = true;
+			redrawCt = 0;
+		}
+
+		~UI() { delete root; }
+
+		// Sets the widget at the top of the tree, which the UI deletes
+		void setRoot(Widget *widget) {
+			if(root != NULL) {
+				mark(root -> rx, root -> ry, root -> rw, root -> rh);
+				delete root;
+			}
+			root = widget;
+			root -> parent = NULL;
+			root -> attach(this);
+			needsLayout = true;
+		}
+
+		Widget* getRoot() { return root; }
+
+		// Measures and places whatever changed size since the last layout
+		void layout() {
+			if(root == NULL || !needsLayout) return;
+			unsigned short w, h;
+			root -> size(w, h);
+			root -> place(xp, yp, w, h);
+			needsLayout = false;
+		}
+
+		// Lays out what changed and redraws what was marked on a display,
+		// then the display's next update() paints only those cells
+		void flush(CharDisplay &display) {
+			layout();
+			for(unsigned int i=0; i<marks.size(); i += 4)
+				display.redrawRect(marks[i], marks[i+1], marks[i+2], marks[i+3]);
+			redrawCt += marks.size() / 4;
+			marks.clear();
+		}
+
+		// overrides for CharStruct funcs
+
+		void write(CharBuffer &buf) override {
+			layout();
+			if(root != NULL) root -> render(buf);
+		}
+
+		Cell charAt(const unsigned short x, const unsigned short y) override { return 0; }
+
+		bool inColl(const unsigned short x, const unsigned short y) override { return false; }
+
+		bool bounds(unsigned short &x, unsigned short &y,
+		unsigned short &w, unsigned short &h) override {
+			x = xp; y = yp;
+			w = root != NULL ? root -> rw : 0;
+			h = root != NULL ? root -> rh : 0;
+			return true;
+		}
+
+		const char* type() override { return "UI"; }
+
+		// getter methods
+		const unsigned int redraws() { return redrawCt; }
+		const unsigned int marked() { return marks.size() / 4; }
+};
+
+inline void Widget::invalidate(const unsigned short x, const unsigned short y,
+const unsigned short wd, const unsigned short ht) {
+	if(ui != NULL) ui -> mark(rx + x, ry + y, wd, ht);
+}
+
+inline void Widget::remeasure() {
+	for(Widget *w = this; w != NULL; w = w -> parent)
+		w -> measured = false;
+	if(ui != NULL) ui -> needsLayout = true;
+}
+
+// =======
+// Widgets
+// =======
+
+// A line of text
+class Label : public Widget {
+	vector<Cell> text;
+	Cell style;
+
+	protected:
+		void measure(unsigned short &w, unsigned short &h) override {
+			w = text.size(); h = 1;
+		}
+
+		void draw(CharBuffer &buf) override {
+			buf.cells(rx, ry, text.data(), rw < text.size() ? rw : text.size());
+			if(rw > text.size())
+				buf.hrun(rx + text.size(), ry, rw - text.size(), CELL_BLANK);
+		}
+
+	public:
+		Label(const string &str, const Cell textStyle = 0) {
+			style = textStyle;
+			uiCells(str, style, text);
+		}
+
+		void setText(const string &str) {
+			const unsigned short before = text.size();
+			uiCells(str, style, text);
+			if(text.size() != before) remeasure();
+			invalidate();
+		}
+};
+
+// A box around its children, which are stacked top to bottom inside of it
+class Panel : public Widget {
+	vector<Cell> title;
+	bool border;
+
+	protected:
+		void measure(unsigned short &w, unsigned short &h) override {
+			w = title.size() + 2; h = 0;
+			for(unsigned int i=0; i<kids.size(); i++) {
+				unsigned short cw, ch;
+				kids[i] -> size(cw, ch);
+				if(cw > w) w = cw;
+				h += ch;
+			}
+			if(border) { w += 2; h += 2; }
+		}
+
+		void arrange() override {
+			const unsigned short in = border ? 1 : 0;
+			unsigned short y = ry + in;
+			for(unsigned int i=0; i<kids.size(); i++) {
+				unsigned short cw, ch;
+				kids[i] -> size(cw, ch);
+				kids[i] -> place(rx + in, y, rw - 2 * in, ch);
+				y += ch;
+			}
+		}
+
+		void draw(CharBuffer &buf) override {
+			buf.fill(rx, ry, rw, rh, CELL_BLANK);
+			if(!border || rw < 2 || rh < 2) return;
+			buf.put(rx, ry, 0x250C);
+			buf.put(rx + rw - 1, ry, 0x2510);
+			buf.put(rx, ry + rh - 1, 0x2514);
+			buf.put(rx + rw - 1, ry + rh - 1, 0x2518);
+			buf.hrun(rx + 1, ry, rw - 2, 0x2500);
+			buf.hrun(rx + 1, ry + rh - 1, rw - 2, 0x2500);
+			buf.vrun(rx, ry + 1, rh - 2, 0x2502);
+			buf.vrun(rx + rw - 1, ry + 1, rh - 2, 0x2502);
+			const unsigned short n = title.size() + 2 < rw ? title.size() : 0;
+			if(n > 0) buf.cells(rx + 1, ry, title.data(), n);
+		}
+
+	public:
+		Panel(const string &titleText = "", const bool bordered = true) {
+			border = bordered;
+			uiCells(titleText, 0, title);
+		}
+};
+
+// Rows of text that scroll, with one of them selected
+class List : public Widget {
+	protected:
+		vector<vector<Cell>> items;
+		unsigned short rows; // rows shown at once
+		unsigned short top; // the first item shown
+		int selected; // -1 for none
+		unsigned short widest;
+
+		void measure(unsigned short &w, unsigned short &h) override {
+			w = widest;
+			h = items.size() < rows ? items.size() : rows;
+		}
+
+		void drawRow(CharBuffer &buf, const unsigned short row) {
+			const unsigned int i = top + row;
+			const Cell mark = ((int)i == selected) ? CELL_REVERSE : 0;
+			if(i >= items.size()) {
+				buf.hrun(rx, ry + row, rw, CELL_BLANK);
+				return;
+			}
+			const vector<Cell> &it = items[i];
+			for(unsigned short x=0; x<rw; x++)
+				buf.put(rx + x, ry + row, (x < it.size() ? it[x] : CELL_BLANK) | mark);
+		}
+
+		void draw(CharBuffer &buf) override {
+			for(unsigned short r=0; r<rh; r++)
+				if(buf.overlaps(rx, ry + r, rw, 1)) drawRow(buf, r);
+		}
+
+	public:
+		// rowsShown - how many items are shown at once, the rest scroll
+		List(const unsigned short rowsShown) {
+			rows = rowsShown;
+			top = 0;
+			selected = -1;
+			widest = 0;
+		}
+
+		// Adds an item, returns its index
+		unsigned int addItem(const string &text) {
+			items.emplace_back();
+			uiCells(text, 0, items.back());
+			if(items.back().size() > widest) widest = items.back().size();
+			if(items.size() <= rows || items.back().size() == widest) remeasure();
+			else invalidate();
+			return items.size() - 1;
+		}
+
+		// Selects an item, scrolling to it. Only the rows that changed are
+		// redrawn, or the whole list if it had to scroll.
+		void select(const int index) {
+			if(index < -1 || index >= (int)items.size() || index == selected) return;
+			const int old = selected;
+			selected = index;
+			if(index == -1) {
+				if(old >= top && old < top + rh) invalidate(0, old - top, rw, 1);
+				return;
+			}
+			if(index < top || index >= top + rows) {
+				top = index < top ? index : index - rows + 1;
+				invalidate();
+				return;
+			}
+			if(old >= top && old < top + rh) invalidate(0, old - top, rw, 1);
+			invalidate(0, index - top, rw, 1);
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		const int selection() { return selected; }
+		const unsigned int itemCt() { return items.size(); }
+		const unsigned short firstShown() { return top; }
+};
+
+// A list that the arrow keys move through and enter picks from
+class Menu : public List {
+	function<void(unsigned int)> picked;
+
+	public:
+		Menu(const unsigned short rowsShown) : List(rowsShown) { selected = 0; }
+
+		// Called with the index of the item picked, as well as onSelect
+		void onPick(const function<void(unsigned int)> &fn) { picked = fn; }
+
+		// Takes a key, returns true if the menu used it.
+		// Arrow keys are the last byte of their escape sequence.
+		bool key(const char k) {
+			switch(k) {
+				case 65: // up
+					if(selected > 0) select(selected - 1);
+					return true;
+				case 66: // down
+					if(selected + 1 < (int)items.size()) select(selected + 1);
+					return true;
+				case 10: case 13: // enter
+					if(selected < 0) return false;
+					if(picked) picked(selected);
+					return onSelect(selected);
+			}
+			return false;
+		}
+
+		// Return true if option operation was performed successfully
+		// Return false if it failed
+		virtual bool onSelect(const unsigned int option) { return true; }
+};
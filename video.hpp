@@ -0,0 +1,584 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include "engine.hpp"
+#include "palette.hpp"
+using namespace std;
+
+// =========================================
+// Video to ASCII
+// ----------------------------------------
+// Plays stills and video on a display as
+// text. Frames are read raw, as PGM or PPM
+// stills (one after another works as a video,
+// such as ffmpeg's image2pipe) or as Y4M
+// video, from a file or a pipe.
+//
+// Each frame is shrunk to one pixel per cell
+// with a box filter, averaging every pixel
+// that falls in the cell, and the average
+// brightness picks a glyph from a ramp. With
+// color on, the average color picks the
+// nearest terminal color as well, dithered,
+// see palette.hpp.
+//
+// Reading runs on one thread and shrinking
+// and picking glyphs on another, handing
+// frames along in small queues of buffers
+// that are reused, so the game thread only
+// copies finished cells into a VideoLayer.
+//
+//   VideoLayer * screen = new VideoLayer(0, 0, 200, 60);
+//   display.addStruct(screen);
+//   VideoPipeline video("clip.y4m", 200, 60, true);
+//   loop.every(1000 / video.fps(), [&]() {
+//       if(video.next(*screen)) { display.writeStructs(); loop.redraw(); }
+//   });
+// =========================================
+
+// A frame as it was read
+struct VideoFrame {
+	enum Format { GRAY, RGB, YUV };
+	Format format;
+	unsigned short w, h;
+	unsigned short cw, ch; // the size of the U and V planes of a YUV frame
+	vector<uint8_t> data; // rows of pixels, or the Y, U and V planes one after another
+};
+
+// Reads PGM, PPM and Y4M frames from a file or a pipe
+class VideoReader {
+	int fd;
+	bool owned; // whether the fd is closed along with the reader
+	const atomic<bool>* stopping; // set to give up waiting on a pipe
+	uint8_t buf[1 << 16];
+	size_t at, len; // what is left of buf
+	bool y4m; // whether the stream is Y4M, after its header
+	unsigned short yw, yh, ycw, ych; // the Y4M frame size, and its chroma planes'
+	bool yMono;
+	atomic<double> rate; // set by whichever thread reads, asked for by any
+
+	// Fills buf, waiting for a pipe. Returns false at the end or when stopping.
+	bool fill() {
+		while(true) {
+			if(stopping != NULL && stopping -> load(memory_order_relaxed)) return false;
+			pollfd p = {fd, POLLIN, 0};
+			if(poll(&p, 1, 100) == 0) continue;
+			const ssize_t n = ::read(fd, buf, sizeof(buf));
+			if(n < 0 && errno == EINTR) continue;
+			if(n <= 0) return false;
+			at = 0; len = n;
+			return true;
+		}
+	}
+
+	bool byte(uint8_t &c) {
+		if(at == len && !fill()) return false;
+		c = buf[at++];
+		return true;
+	}
+
+	bool bytes(uint8_t* out, size_t n) {
+		while(n > 0) {
+			if(at == len && !fill()) return false;
+			const size_t k = len - at < n ? len - at : n;
+			memcpy(out, buf + at, k);
+			at += k; out += k; n -= k;
+		}
+		return true;
+	}
+
+	// the rest of a line, without the newline
+	bool line(string &out) {
+		out.clear();
+		uint8_t c = 0;
+		while(byte(c) && c != '\n') out += (char)c;
+		return c == '\n';
+	}
+
+	// a number in a PNM header, skipping whitespace and comments
+	bool number(unsigned int &n) {
+		uint8_t c;
+		do {
+			if(!byte(c)) return false;
+			if(c == '#') while(c != '\n') if(!byte(c)) return false;
+		} while(c == ' ' || c == '\t' || c == '\r' || c == '\n');
+		if(c < '0' || c > '9') return false;
+		n = 0;
+		while(c >= '0' && c <= '9') {
+			n = n * 10 + (c - '0');
+			if(!byte(c)) return false;
+		}
+		return true; // the whitespace after it is used up
+	}
+
+	// the value of a Y4M header field such as W640, or 0
+	static unsigned int field(const string &header, const char key) {
+		for(size_t i=0; i<header.size(); i++)
+			if(header[i] == key && (i == 0 || header[i-1] == ' '))
+				return atoi(header.c_str() + i + 1);
+		return 0;
+	}
+
+	// Takes the frame size, chroma planes and rate from a Y4M header line
+	bool parseY4m(const string &header) {
+		yw = field(header, 'W');
+		yh = field(header, 'H');
+		if(yw == 0 || yh == 0) return false;
+		const size_t f = header.find(" F");
+		unsigned int num = 0, den = 0;
+		if(f != string::npos && sscanf(header.c_str() + f + 2, "%u:%u", &num, &den) == 2 && num > 0 && den > 0)
+			rate.store((double)num / den, memory_order_relaxed);
+		const size_t c = header.find(" C");
+		const string chroma = c == string::npos ? "420" : header.substr(c + 2, 3);
+		yMono = chroma == "mon";
+		ycw = chroma == "444" ? yw : (yw + 1) / 2;
+		ych = chroma == "444" || chroma == "422" ? yh : (yh + 1) / 2;
+		return true;
+	}
+
+	public:
+		// path - a file, or - for standard input
+		VideoReader(const char* path) {
+			owned = !(path[0] == '-' && path[1] == 0);
+			fd = owned ? open(path, O_RDONLY | O_CLOEXEC) : fileno(stdin);
+			stopping = NULL;
+			at = 0; len = 0;
+			y4m = false;
+			yw = 0; yh = 0; ycw = 0; ych = 0;
+			yMono = false;
+			rate.store(0, memory_order_relaxed);
+		}
+
+		~VideoReader() { if(owned && fd >= 0) close(fd); }
+
+		// Gives up waiting on a pipe once flag is set, see VideoPipeline
+		void setStopFlag(const atomic<bool>* flag) { stopping = flag; }
+
+		// Reads the next frame, reusing its buffer. Returns false at the end
+		// of the stream or if the stream isn't one that can be read.
+		bool read(VideoFrame &frame) {
+			if(fd < 0) return false;
+			uint8_t m[2];
+			if(y4m) {
+				string tag;
+				if(!line(tag) || tag.compare(0, 5, "FRAME") != 0) return false;
+			} else {
+				if(!bytes(m, 2)) return false;
+				if(m[0] == 'Y' && m[1] == 'U') {
+					string rest;
+					if(!line(rest) || rest.compare(0, 7, "V4MPEG2") != 0) return false;
+					y4m = true;
+					if(!parseY4m(rest.substr(7))) return false;
+					return read(frame);
+				}
+			}
+			if(y4m) {
+				frame.format = yMono ? VideoFrame::GRAY : VideoFrame::YUV;
+				frame.w = yw; frame.h = yh;
+				frame.cw = ycw; frame.ch = ych;
+				const size_t n = (size_t)yw * yh + (yMono ? 0 : 2 * (size_t)ycw * ych);
+				frame.data.resize(n);
+				return bytes(frame.data.data(), n);
+			}
+			// PGM or PPM, binary and 8 bits a sample
+			if(m[0] != 'P' || (m[1] != '5' && m[1] != '6')) return false;
+			unsigned int w, h, maxval;
+			if(!number(w) || !number(h) || !number(maxval)) return false;
+			if(w == 0 || h == 0 || w > 65535 || h > 65535 || maxval == 0 || maxval > 255) return false;
+			frame.format = m[1] == '5' ? VideoFrame::GRAY : VideoFrame::RGB;
+			frame.w = w; frame.h = h;
+			frame.cw = 0; frame.ch = 0;
+			const size_t n = (size_t)w * h * (m[1] == '5' ? 1 : 3);
+			frame.data.resize(n);
+			if(!bytes(frame.data.data(), n)) return false;
+			if(maxval != 255)
+				for(size_t i=0; i<n; i++) frame.data[i] = frame.data[i] * 255 / maxval;
+			return true;
+		}
+
+		// Frames per second of a Y4M stream once its first frame is read,
+		// or 0 if the stream doesn't say
+		const double fps() { return rate.load(memory_order_relaxed); }
+		// whether the file could be opened
+		const bool good() { return fd >= 0; }
+};
+
+// Picks the glyph for a brightness with a lookup table worked out up front,
+// and the terminal colors for a row of RGB colors with a Quantizer
+class GlyphMap {
+	Cell byLuma[256];
+	Quantizer palette;
+
+	public:
+		// ramp - glyphs from darkest to brightest, as UTF-8
+		// colorCt - the colors the terminal has, see detectColors
+		GlyphMap(const char* ramp = " .:-=+*#%@", const unsigned short colorCt = detectColors())
+		: palette(colorCt) {
+			setRamp(ramp);
+		}
+
+		void setRamp(const char* ramp) {
+			vector<uint32_t> glyphs;
+			const size_t n = strlen(ramp);
+			size_t i = 0;
+			while(i < n) glyphs.push_back(utf8Decode(ramp, n, i));
+			if(glyphs.empty()) glyphs.push_back(' ');
+			for(unsigned int v=0; v<256; v++)
+				byLuma[v] = cellOf(glyphs[v * glyphs.size() / 256]);
+		}
+
+		Cell glyph(const uint8_t luma) const { return byLuma[luma]; }
+
+		// Colors row y of n cells with n RGB colors, dithered
+		void colorRow(const uint8_t* rgb, Cell* row, const size_t n, const unsigned short y) const {
+			palette.colorCells(rgb, row, n, 0, y, true);
+		}
+};
+
+// Shrinks frames to a grid of cells by averaging the pixels under each cell
+class FrameScaler {
+	unsigned short ow, oh;
+	bool color;
+	// the columns [xb[c], xe[c]) each cell covers, in Y and in chroma pixels
+	vector<unsigned int> xb, xe, cxb, cxe;
+	vector<uint32_t> sumY, sumU, sumV; // a row of cells' sums
+	vector<uint8_t> rgb; // a row of cells' colors
+	unsigned short lastW, lastH, lastCw; // the frame size the bounds were worked out for
+
+	// Sums pixels [begin[c], end[c]) of a row of one sample each into sums
+	static void sumRow(const uint8_t* row, const unsigned int* begin, const unsigned int* end,
+	const unsigned short cells, uint32_t* sums) {
+		for(unsigned short c=0; c<cells; c++) {
+			uint32_t s = 0;
+			for(unsigned int x=begin[c]; x<end[c]; x++) s += row[x];
+			sums[c] += s;
+		}
+	}
+
+	void bounds(const VideoFrame &f) {
+		if(f.w == lastW && f.h == lastH && f.cw == lastCw && !xb.empty()) return;
+		xb.resize(ow); xe.resize(ow); cxb.resize(ow); cxe.resize(ow);
+		// each cell worked out on its own, so one narrower than a pixel
+		// still takes the pixel it lands on, and cells can share pixels
+		const auto span = [this](const unsigned int c, const unsigned int w,
+		unsigned int &b, unsigned int &e) {
+			b = (unsigned long)c * w / ow;
+			if(b > w - 1) b = w - 1;
+			e = (unsigned long)(c + 1) * w / ow;
+			if(e < b + 1) e = b + 1;
+		};
+		for(unsigned int c=0; c<ow; c++) {
+			span(c, f.w, xb[c], xe[c]);
+			span(c, f.cw ? f.cw : 1, cxb[c], cxe[c]);
+		}
+		lastW = f.w; lastH = f.h; lastCw = f.cw;
+	}
+
+	public:
+		// width, height - the size in cells to shrink frames to
+		// withColor - whether cells get the frame's colors too
+		FrameScaler(const unsigned short width, const unsigned short height, const bool withColor) {
+			ow = width; oh = height;
+			color = withColor;
+			sumY.assign(ow, 0); sumU.assign(ow, 0); sumV.assign(ow, 0);
+			rgb.assign(3 * (size_t)ow, 0);
+			lastW = 0; lastH = 0; lastCw = 0;
+		}
+
+		// Writes width by height cells for a frame, row by row
+		void scale(const VideoFrame &f, const GlyphMap &glyphs, Cell* out) {
+			if(f.w == 0 || f.h == 0) return;
+			bounds(f);
+			const uint8_t* px = f.data.data();
+			for(unsigned short r=0; r<oh; r++) {
+				unsigned int y0 = (unsigned long)r * f.h / oh, y1 = (unsigned long)(r + 1) * f.h / oh;
+				if(y1 <= y0) y1 = y0 + 1 <= f.h ? y0 + 1 : f.h;
+				fill(sumY.begin(), sumY.end(), 0);
+				fill(sumU.begin(), sumU.end(), 0);
+				fill(sumV.begin(), sumV.end(), 0);
+				unsigned int area = 0; // pixels in a cell, per column count below
+				Cell* row = out + (size_t)r * ow;
+				if(f.format == VideoFrame::RGB) {
+					for(unsigned int y=y0; y<y1; y++) {
+						const uint8_t* p = px + (size_t)y * f.w * 3;
+						for(unsigned short c=0; c<ow; c++) {
+							uint32_t sr = 0, sg = 0, sb = 0;
+							for(unsigned int x=xb[c]; x<xe[c]; x++) {
+								sr += p[3*x]; sg += p[3*x+1]; sb += p[3*x+2];
+							}
+							sumY[c] += sr; sumU[c] += sg; sumV[c] += sb;
+						}
+					}
+					for(unsigned short c=0; c<ow; c++) {
+						area = (y1 - y0) * (xe[c] - xb[c]);
+						const uint8_t R = sumY[c] / area, G = sumU[c] / area, B = sumV[c] / area;
+						row[c] = glyphs.glyph((77 * R + 150 * G + 29 * B) >> 8);
+						rgb[3*c] = R; rgb[3*c+1] = G; rgb[3*c+2] = B;
+					}
+					if(color) glyphs.colorRow(rgb.data(), row, ow, r);
+					continue;
+				}
+				for(unsigned int y=y0; y<y1; y++)
+					sumRow(px + (size_t)y * f.w, xb.data(), xe.data(), ow, sumY.data());
+				const bool chroma = f.format == VideoFrame::YUV && color;
+				unsigned int cy0 = 0, cy1 = 0;
+				if(chroma) {
+					const uint8_t* U = px + (size_t)f.w * f.h;
+					const uint8_t* V = U + (size_t)f.cw * f.ch;
+					cy0 = (unsigned long)r * f.ch / oh; cy1 = (unsigned long)(r + 1) * f.ch / oh;
+					if(cy1 <= cy0) cy1 = cy0 + 1 <= f.ch ? cy0 + 1 : f.ch;
+					for(unsigned int y=cy0; y<cy1; y++) {
+						sumRow(U + (size_t)y * f.cw, cxb.data(), cxe.data(), ow, sumU.data());
+						sumRow(V + (size_t)y * f.cw, cxb.data(), cxe.data(), ow, sumV.data());
+					}
+				}
+				for(unsigned short c=0; c<ow; c++) {
+					area = (y1 - y0) * (xe[c] - xb[c]);
+					const uint8_t luma = sumY[c] / area;
+					if(!chroma) {
+						row[c] = glyphs.glyph(luma);
+						rgb[3*c] = luma; rgb[3*c+1] = luma; rgb[3*c+2] = luma;
+						continue;
+					}
+					// BT.601 video range to RGB
+					const unsigned int carea = (cy1 - cy0) * (cxe[c] - cxb[c]);
+					const int Y = (luma - 16) * 298, U = (int)(sumU[c] / carea) - 128,
+						V = (int)(sumV[c] / carea) - 128;
+					const int R = (Y + 409 * V + 128) >> 8,
+						G = (Y - 100 * U - 208 * V + 128) >> 8,
+						B = (Y + 516 * U + 128) >> 8;
+					const auto clamp8 = [](const int v) { return (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v); };
+					row[c] = glyphs.glyph(clamp8((Y + 128) >> 8));
+					rgb[3*c] = clamp8(R); rgb[3*c+1] = clamp8(G); rgb[3*c+2] = clamp8(B);
+				}
+				if(color) glyphs.colorRow(rgb.data(), row, ow, r);
+			}
+		}
+};
+
+// A bounded queue of reused buffers between one thread that fills them
+// and one that empties them
+template<class T>
+class Handoff {
+	vector<T> slots;
+	size_t head, count;
+	bool closed;
+	mutex m;
+	condition_variable cv;
+
+	public:
+		Handoff(const size_t n) : slots(n) {
+			head = 0; count = 0;
+			closed = false;
+		}
+
+		// The next buffer to fill, waiting for one to come free,
+		// or NULL once the queue is closed
+		T* claim() {
+			unique_lock<mutex> lock(m);
+			cv.wait(lock, [this]() { return closed || count < slots.size(); });
+			return closed ? NULL : &slots[(head + count) % slots.size()];
+		}
+
+		// Hands the claimed buffer to the other thread
+		void push() {
+			{
+				lock_guard<mutex> lock(m);
+				count++;
+			}
+			cv.notify_all();
+		}
+
+		// The oldest filled buffer, or NULL if there is none. With wait, waits
+		// for one, and only returns NULL once the queue is closed and empty.
+		T* peek(const bool wait) {
+			unique_lock<mutex> lock(m);
+			if(wait) cv.wait(lock, [this]() { return closed || count > 0; });
+			return count > 0 ? &slots[head] : NULL;
+		}
+
+		// Gives the oldest filled buffer back to be filled again
+		void pop() {
+			{
+				lock_guard<mutex> lock(m);
+				head = (head + 1) % slots.size();
+				count--;
+			}
+			cv.notify_all();
+		}
+
+		// No more buffers will be filled. What was filled can still be taken.
+		void close() {
+			{
+				lock_guard<mutex> lock(m);
+				closed = true;
+			}
+			cv.notify_all();
+		}
+
+		bool finished() {
+			lock_guard<mutex> lock(m);
+			return closed && count == 0;
+		}
+};
+
+// A grid of cells that video is shown on
+class VideoLayer : public CharStruct {
+	unsigned short wd, ht;
+	vector<Cell> cells;
+
+	public:
+		VideoLayer(const unsigned int collision,
+		const unsigned short xPos, const unsigned short yPos,
+		const unsigned short width, const unsigned short height)
+		: CharStruct(collision, xPos, yPos) {
+			wd = width; ht = height;
+			cells.assign((size_t)wd * ht, 0);
+		}
+
+		// Copies in a frame of width by height cells
+		void show(const Cell* frame) {
+			cellCopy(cells.data(), frame, cells.size());
+			touch();
+		}
+
+		// overrides for CharStruct funcs
+
+		// Only the rows and columns inside of the region being written are copied
+		void write(CharBuffer &buf) override {
+			if(!buf.overlaps(xp, yp, wd, ht)) return;
+			int x0, y0, x1, y1;
+			buf.region(x0, y0, x1, y1);
+			const unsigned int
+				c0 = x0 > xp ? x0 - xp : 0, c1 = x1 - xp < wd ? x1 - xp : wd,
+				r0 = y0 > yp ? y0 - yp : 0, r1 = y1 - yp < ht ? y1 - yp : ht;
+			for(unsigned int r=r0; r<r1; r++)
+				buf.cells(xp + c0, yp + r, cells.data() + (size_t)r * wd + c0, c1 - c0);
+		}
+
+		Cell charAt(const unsigned short x, const unsigned short y) override {
+			const unsigned short gx = x - xp, gy = y - yp;
+			if(gx >= wd || gy >= ht) return 0;
+			return cells[(size_t)gy * wd + gx];
+		}
+
+		bool bounds(unsigned short &x, unsigned short &y,
+		unsigned short &w, unsigned short &h) override {
+			x = xp; y = yp; w = wd; h = ht;
+			return true;
+		}
+
+		const char* type() override { return "VideoLayer"; }
+		CharStruct* clone() override { return new VideoLayer(*this); }
+
+		// getter methods
+		const unsigned short width() { return wd; }
+		const unsigned short height() { return ht; }
+
+	protected:
+		void assign(CharStruct &from) override { *this = (VideoLayer&)from; }
+};
+
+// Reads, shrinks and maps frames to glyphs on two threads of its own,
+// a few frames ahead of the ones being shown
+class VideoPipeline {
+	// cells for a frame, ready to show
+	struct CellFrame {
+		vector<Cell> cells;
+	};
+
+	VideoReader reader;
+	FrameScaler scaler;
+	GlyphMap glyphs;
+	unsigned short w, h;
+	Handoff<VideoFrame> raw;
+	Handoff<CellFrame> done;
+	atomic<bool> stopping;
+	atomic<unsigned long long> readCt;
+	thread decoder, mapper;
+
+	void decode() {
+		while(true) {
+			VideoFrame* f = raw.claim();
+			if(f == NULL || !reader.read(*f)) break;
+			raw.push();
+			readCt++;
+		}
+		raw.close();
+	}
+
+	void map() {
+		while(true) {
+			VideoFrame* f = raw.peek(true);
+			if(f == NULL) break;
+			CellFrame* c = done.claim();
+			if(c == NULL) break;
+			c -> cells.resize((size_t)w * h);
+			scaler.scale(*f, glyphs, c -> cells.data());
+			raw.pop();
+			done.push();
+		}
+		done.close();
+	}
+
+	public:
+		// path - a file, or - for standard input
+		// width, height - the size in cells to show frames at
+		// color - whether cells get the video's colors
+		// ramp - glyphs from darkest to brightest
+		VideoPipeline(const char* path, const unsigned short width, const unsigned short height,
+		const bool color = false, const char* ramp = " .:-=+*#%@")
+		: reader(path), scaler(width, height, color), glyphs(ramp),
+		raw(3), done(3), stopping(false), readCt(0) {
+			w = width; h = height;
+			reader.setStopFlag(&stopping);
+			decoder = thread(&VideoPipeline::decode, this);
+			mapper = thread(&VideoPipeline::map, this);
+		}
+
+		~VideoPipeline() {
+			stopping = true;
+			raw.close();
+			done.close();
+			decoder.join();
+			mapper.join();
+		}
+
+		// Shows the next frame on a layer the same size as the pipeline's
+		// frames. Returns false if it isn't ready yet, or there are no more.
+		bool next(VideoLayer &layer) {
+			CellFrame* c = done.peek(false);
+			if(c == NULL) return false;
+			if(layer.width() == w && layer.height() == h) layer.show(c -> cells.data());
+			done.pop();
+			return true;
+		}
+
+		// ============
+		// Getter funcs
+		// ============
+
+		// whether every frame has been shown
+		const bool finished() { return done.finished(); }
+		// frames read so far
+		const unsigned long long framesRead() { return readCt; }
+		// the video's frame rate, or 30 if it doesn't say or hasn't started yet
+		const double fps() {
+			const double rate = reader.fps();
+			return rate > 0 ? rate : 30;
+		}
+		const bool good() { return reader.good(); }
+};
@@ -0,0 +1,216 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <sys/resource.h>
+#include "allocs.hpp"
+#include "ascii.hpp"
+#include "engine.hpp"
+#include "jobs.hpp"
+using namespace std;
+
+
+// A benchmark of a whole game, start to finish, for checking that a
+// change to the engine doesn't make frames slower.
+//
+//   xbench [frames] [map width] [map height] [walls] [entities] [p99 budget ms]
+//
+// It plays a Wanderwall-style game with no terminal: a player walks a
+// walled map along a script while entities wander it, planned on the job
+// system. The display follows the player, redraws and draws to ncurses
+// every frame, and ncurses writes to /dev/null. Every frame is timed from
+// input to update().
+//
+// It prints frames per second, the median, 99th percentile and slowest
+// frame time, and the most memory the process used. Given a budget, it
+// exits with 1 if the 99th percentile went over it, so it can gate a
+// build. The same arguments always play the same game.
+
+// Something that wanders the map on its own
+struct Entity {
+	CollChar * chr;
+	unsigned int seed; // xorshift state, one each so they plan in parallel
+	unsigned short nx, ny; // where it moves to this frame
+};
+
+class BenchGame {
+	ASCIIWindow * window;
+	CharDisplay * display;
+	CollChar * player;
+	vector<Entity> entities;
+	unsigned short mapWd, mapHt;
+	short scrolledX, scrolledY; // how far the display is scrolled
+	unsigned int seed; // for building the map and the player's script
+	char heading; // the arrow key the script is holding down
+	JobSystem jobs;
+	JobCounter planned;
+
+	unsigned int rand() {
+		seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+		return seed;
+	}
+
+	// a random cell of the map that nothing collides with
+	void freeCell(unsigned short &x, unsigned short &y) {
+		do {
+			x = 1 + rand() % (mapWd - 2);
+			y = 1 + rand() % (mapHt - 2);
+		} while(display -> hasCollCode(x, y, 0x00000001));
+	}
+
+	// Picks a random step for an entity that doesn't walk into a wall
+	void plan(Entity &e) {
+		e.seed ^= e.seed << 13; e.seed ^= e.seed >> 17; e.seed ^= e.seed << 5;
+		unsigned short tx = e.chr -> posX(), ty = e.chr -> posY();
+		e.nx = tx; e.ny = ty;
+		switch(e.seed % 5) {
+			case 0: ty--; break;
+			case 1: ty++; break;
+			case 2: tx++; break;
+			case 3: tx--; break;
+			default: return; // stay put
+		}
+		if(!display -> hasCollCode(tx, ty, 0x00000001)) { e.nx = tx; e.ny = ty; }
+	}
+
+	public:
+		BenchGame(const unsigned short mapWidth, const unsigned short mapHeight,
+		const unsigned int walls, const unsigned int entityCt) {
+			window = new ASCIIWindow(80, 24);
+			if(!window -> buildHeadless()) {
+				fprintf(stderr, "couldn't build a headless window\n");
+				exit(2);
+			}
+			display = new CharDisplay(80, 22, 0, 2, window);
+			display -> setMaxBacklog(0); // /dev/null never backs up
+			mapWd = mapWidth < 8 ? 8 : mapWidth;
+			mapHt = mapHeight < 8 ? 8 : mapHeight;
+			scrolledX = 0; scrolledY = 0;
+			seed = 0x2545F491u;
+			heading = 'C';
+
+			display -> addStruct(new Box(0x00000001, '#', 0, 0, false, mapWd, mapHt));
+			for(unsigned int i=0; i<walls; i++) {
+				const bool vertical = rand() & 1;
+				const unsigned short len = 3 + rand() % 13;
+				Line * wall = new Line(0x00000001, '0', len,
+					1 + rand() % (mapWd - 2), 1 + rand() % (mapHt - 2), vertical);
+				wall -> setCell(vertical ? 0x2502 : 0x2500);
+				display -> addStruct(wall);
+			}
+			unsigned short x, y;
+			freeCell(x, y);
+			player = new CollChar(0x10000000, '@', x, y);
+			player -> setCell(cellOf('@', paletteOf(BYLW)));
+			display -> addStruct(player);
+			for(unsigned int i=0; i<entityCt; i++) {
+				freeCell(x, y);
+				Entity e = {new CollChar(0x00000002, 'o', x, y), 0x9E3779B9u * (i + 1), x, y};
+				e.chr -> setCell(cellOf('o', paletteOf(BGRN)));
+				entities.push_back(e);
+				display -> addStruct(e.chr);
+			}
+			jobs.joinBefore(*display);
+		}
+
+		~BenchGame() {
+			jobs.endFrame();
+			delete display;
+			window -> close();
+			delete window;
+		}
+
+		// Plays one frame: the script's key, the entities' moves, following
+		// the player with the display, and drawing it all
+		void frame(const unsigned int n) {
+			// the script turns every few frames, as if a key was pressed
+			if(n % 12 == 0) heading = 'A' + rand() % 4;
+			unsigned short x = player -> posX(), y = player -> posY();
+			switch(heading) {
+				case 'A': y--; break;
+				case 'B': y++; break;
+				case 'C': x++; break;
+				case 'D': x--; break;
+			}
+			if(!display -> hasCollCode(x, y, 0x00000001)) {
+				player -> setX(x);
+				player -> setY(y);
+			}
+
+			for(unsigned int i=0; i<entities.size(); i++)
+				jobs.run([this, i]() { plan(entities[i]); }, planned);
+			jobs.runFrame([this]() {
+				for(unsigned int i=0; i<entities.size(); i++) {
+					entities[i].chr -> setX(entities[i].nx);
+					entities[i].chr -> setY(entities[i].ny);
+				}
+			}, &planned);
+
+			// keep the player in the middle of the display
+			const short wantX = display -> width() / 2 - player -> posX(),
+				wantY = display -> height() / 2 - player -> posY();
+			display -> scrollX(wantX - scrolledX);
+			display -> scrollY(wantY - scrolledY);
+			scrolledX = wantX; scrolledY = wantY;
+
+			display -> redrawStructs();
+			window -> writeAt(0, 0, "===xbench===");
+			display -> update();
+		}
+};
+
+// The frame time at percentile p of frame times sorted fastest first
+double percentile(const vector<double> &sorted, const double p) {
+	size_t i = (size_t)ceil(p / 100.0 * sorted.size());
+	if(i > 0) i--;
+	return sorted[i];
+}
+
+int main(int argc, char** argv) {
+	const unsigned int frames = argc > 1 ? atoi(argv[1]) : 2000;
+	const unsigned short mapWd = argc > 2 ? atoi(argv[2]) : 200;
+	const unsigned short mapHt = argc > 3 ? atoi(argv[3]) : 60;
+	const unsigned int walls = argc > 4 ? atoi(argv[4]) : 150;
+	const unsigned int entityCt = argc > 5 ? atoi(argv[5]) : 100;
+	const double budget = argc > 6 ? atof(argv[6]) : 0;
+	if(frames == 0) {
+		fprintf(stderr, "usage: xbench [frames] [map width] [map height] "
+			"[walls] [entities] [p99 budget ms]\n");
+		return 2;
+	}
+
+	BenchGame * game = new BenchGame(mapWd, mapHt, walls, entityCt);
+	vector<double> times; // milliseconds per frame
+	times.reserve(frames);
+	// catches frames that allocate, when built with -DASCII_COUNT_ALLOCS
+	AllocMeter allocs;
+	const auto start = chrono::steady_clock::now();
+	for(unsigned int i=0; i<frames; i++) {
+		const auto t0 = chrono::steady_clock::now();
+		allocs.begin();
+		game -> frame(i);
+		allocs.end();
+		const auto t1 = chrono::steady_clock::now();
+		times.push_back(chrono::duration<double, milli>(t1 - t0).count());
+	}
+	const double total = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	delete game;
+
+	sort(times.begin(), times.end());
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	const double p99 = percentile(times, 99);
+	printf("map %ux%u, %u walls, %u entities\n", mapWd, mapHt, walls, entityCt);
+	printf("%u frames in %.3f s, %.1f frames per second\n", frames, total, frames / total);
+	printf("frame time: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+		percentile(times, 50), p99, times.back());
+	printf("peak memory: %ld KB\n", usage.ru_maxrss);
+	allocs.report(stdout);
+	if(budget > 0 && p99 > budget) {
+		printf("p99 is over the budget of %.3f ms\n", budget);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,79 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include "ascii.hpp"
+#include "automata.hpp"
+#include "engine.hpp"
+#include "jobs.hpp"
+#include "loop.hpp"
+using namespace std;
+
+
+// A big cellular automaton, stepped on every core and looked at through
+// the display.
+//
+//   xlife [size] [rule] [ms per step]
+//
+// The grid is size by size cells, 4096 if not given, and the rule is
+// Conway's Life unless another is given, such as B2/S/C3. The arrow keys
+// look around the grid, space pauses and q quits.
+
+int main(int argc, char** argv) {
+	const unsigned short size = argc > 1 ? atoi(argv[1]) : 4096;
+	const char* rule = argc > 2 ? argv[2] : "B3/S23";
+	const unsigned int ms = argc > 3 ? atoi(argv[3]) : 50;
+
+	ASCIIWindow * window = new ASCIIWindow(80, 24);
+	window -> build();
+	window -> cursVis(0);
+	CharDisplay display(80, 23, 0, 1, window);
+	JobSystem jobs;
+	Automaton * life = new Automaton(0x00000001, 0, 0, size, size, rule, &jobs);
+	life -> setGlyph(1, cellOf('#', paletteOf(BGRN)));
+	if(life -> stateCt() > 2) life -> setGlyph(2, cellOf('*', paletteOf(BRED)));
+	life -> randomize(30, 1);
+	display.addStruct(life); // the display deletes it
+	// start in the middle of the grid
+	display.scrollX(-(short)(size / 2));
+	display.scrollY(-(short)(size / 2));
+
+	EventLoop loop(window);
+	bool paused = false;
+	double stepMs = 0;
+	char hud[80];
+	loop.onKeys([&](const char* keys, const unsigned int n) {
+		for(unsigned int i=0; i<n; i++) {
+			switch(keys[i]) {
+				case 'q': loop.stop(); break;
+				case ' ': paused = !paused; break;
+				// the letters of the arrow keys' escape sequences
+				case 'A': display.scrollY(8); break;
+				case 'B': display.scrollY(-8); break;
+				case 'C': display.scrollX(-8); break;
+				case 'D': display.scrollX(8); break;
+			}
+		}
+		loop.redraw();
+	});
+	loop.every(ms, [&]() {
+		if(paused) return;
+		const auto start = chrono::steady_clock::now();
+		life -> step();
+		stepMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		display.redrawStructs();
+		loop.redraw();
+	});
+	unsigned int retry = 0;
+	loop.onFrame([&]() {
+		const int n = snprintf(hud, sizeof(hud), "gen %-8llu step %6.2f ms  %s  %ux%u %s",
+			life -> generation(), stepMs, rule, size, size, paused ? "paused" : "      ");
+		window -> writeAt(0, 0, string_view(hud, n < (int)sizeof(hud) ? n : sizeof(hud) - 1));
+		if(!display.update() && retry == 0)
+			retry = loop.after(5, [&]() { retry = 0; loop.redraw(); });
+	});
+	loop.run();
+
+	window -> close();
+	delete window;
+	return 0;
+}
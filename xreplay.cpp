@@ -0,0 +1,100 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include "ascii.hpp"
+#include "record.hpp"
+using namespace std;
+
+
+// Plays back a session recorded with a Recorder.
+//
+//   xreplay session.aefd [speed]
+//
+// Space pauses, the left and right arrow keys jump back and
+// forward five seconds, + and - change the speed, and q quits.
+
+struct Replay {
+	Playback rec;
+	ASCIIWindow * window;
+	double speed; // recording seconds per real second
+	bool paused, running;
+	uint64_t at; // where in the recording playback is, in microseconds
+
+	Replay(const double playSpeed) {
+		window = NULL;
+		speed = playSpeed;
+		paused = false; running = true;
+		at = 0;
+	}
+
+	~Replay() {
+		if(window == NULL) return;
+		window -> close();
+		delete window;
+	}
+
+	bool open(const string &path) {
+		if(!rec.load(path)) return false;
+		// one line under the recording for the status
+		window = new ASCIIWindow(rec.width(), rec.height() + 1);
+		window -> build();
+		window -> cursVis(0);
+		window -> initRealTime();
+		return true;
+	}
+
+	// Takes the keys pressed since the last frame
+	void input() {
+		char key;
+		while((key = window -> getKey()) != -1) {
+			switch(key) {
+				case ' ': paused = !paused; break;
+				case 'q': running = false; break;
+				case '+': speed *= 2; break;
+				case '-': speed /= 2; break;
+				case 67: at += 5000000; break; // right
+				case 68: at = at > 5000000 ? at - 5000000 : 0; break; // left
+			}
+		}
+		if(at > rec.duration()) at = rec.duration();
+	}
+
+	void draw() {
+		for(unsigned short y=0; y<rec.height(); y++)
+			window -> writeCellsNR(0, y, rec.cells() + y * rec.width(), rec.width());
+		char status[96];
+		snprintf(status, sizeof(status), "%s %6.1fs / %.1fs  x%-5g",
+			paused ? "||" : "> ", at / 1e6, rec.duration() / 1e6, speed);
+		string line = status;
+		line.resize(rec.width(), ' ');
+		window -> writeAt(0, rec.height(), line);
+	}
+
+	void run() {
+		const chrono::milliseconds tick(16);
+		while(running) {
+			input();
+			rec.seek(at);
+			draw();
+			this_thread::sleep_for(tick);
+			if(!paused && at < rec.duration())
+				at += (uint64_t)(16000 * speed);
+		}
+	}
+};
+
+int main(int argc, char** argv) {
+	if(argc < 2) {
+		fprintf(stderr, "usage: %s recording [speed]\n", argv[0]);
+		return 1;
+	}
+	Replay replay(argc > 2 ? atof(argv[2]) : 1.0);
+	if(!replay.open(argv[1])) {
+		fprintf(stderr, "could not read %s\n", argv[1]);
+		return 1;
+	}
+	replay.run();
+	return 0;
+}
@@ -0,0 +1,89 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include "ascii.hpp"
+#include "engine.hpp"
+#include "jobs.hpp"
+#include "loop.hpp"
+#include "particles.hpp"
+using namespace std;
+
+
+// Fireworks and rain, up to a hundred thousand particles at once.
+//
+//   xsparks [particles]
+//
+// A firework goes off every so often and rain falls the whole time,
+// until the pool is full. Space sets one off where the last one was,
+// r turns the rain on and off and q quits.
+
+int main(int argc, char** argv) {
+	const size_t capacity = argc > 1 ? atoi(argv[1]) : 100000;
+
+	ASCIIWindow * window = new ASCIIWindow(80, 24);
+	window -> build();
+	window -> cursVis(0);
+	CharDisplay display(80, 23, 0, 1, window);
+	JobSystem jobs;
+	ParticleSystem * sparks = new ParticleSystem(capacity, &jobs);
+	sparks -> setGravity(0, 12);
+	sparks -> setDrag(0.8);
+	sparks -> setArea(0, 0, 80, 23);
+	display.addStruct(sparks); // the display deletes it
+
+	const Cell colors[] = {
+		cellOf('*', paletteOf(BYLW)), cellOf('*', paletteOf(BRED)),
+		cellOf('+', paletteOf(BCYN)), cellOf('o', paletteOf(BMGT)),
+		cellOf('.', paletteOf(BGRN))
+	};
+	const Cell drop = cellOf('|', paletteOf(BLU));
+	unsigned int seed = 0x9E3779B9u, shot = 0;
+	float lastX = 40, lastY = 8;
+	const auto rand = [&]() { seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5; return seed; };
+	const auto firework = [&](const float x, const float y) {
+		sparks -> burst(x, y, capacity / 40 + 50, 30, 2.5, colors[shot++ % 5]);
+	};
+
+	EventLoop loop(window);
+	bool raining = true;
+	double stepMs = 0;
+	char hud[80];
+	loop.onKeys([&](const char* keys, const unsigned int n) {
+		for(unsigned int i=0; i<n; i++) {
+			switch(keys[i]) {
+				case 'q': loop.stop(); break;
+				case ' ': firework(lastX, lastY); break;
+				case 'r': raining = !raining; break;
+			}
+		}
+		loop.redraw();
+	});
+	loop.every(400, [&]() {
+		lastX = 10 + rand() % 60;
+		lastY = 3 + rand() % 10;
+		firework(lastX, lastY);
+	});
+	loop.every(16, [&]() {
+		if(raining)
+			for(unsigned int i=0; i<capacity / 200 + 1; i++)
+				sparks -> spawn((rand() % 8000) / 100.0f, 0, -2, 20 + rand() % 10, 3, drop);
+		const auto start = chrono::steady_clock::now();
+		sparks -> step(0.016);
+		stepMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		display.redrawStructs();
+		loop.redraw();
+	});
+	unsigned int retry = 0;
+	loop.onFrame([&]() {
+		const int n = snprintf(hud, sizeof(hud), "%7zu / %zu particles  step %6.3f ms  %s",
+			sparks -> count(), sparks -> capacity(), stepMs, raining ? "rain" : "    ");
+		window -> writeAt(0, 0, string_view(hud, n < (int)sizeof(hud) ? n : sizeof(hud) - 1));
+		if(!display.update() && retry == 0)
+			retry = loop.after(5, [&]() { retry = 0; loop.redraw(); });
+	});
+	loop.run();
+
+	window -> close();
+	delete window;
+	return 0;
+}
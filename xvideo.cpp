@@ -0,0 +1,92 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "ascii.hpp"
+#include "engine.hpp"
+#include "loop.hpp"
+#include "video.hpp"
+using namespace std;
+
+
+// Plays a video or a still as text.
+//
+//   xvideo <file, or - for a pipe> [width] [height] [color]
+//
+// Frames are Y4M, or PGM or PPM stills one after another, so ffmpeg can
+// feed it anything:
+//
+//   ffmpeg -i clip.mp4 -f yuv4mpegpipe - | ./xvideo - 200 60 color
+//
+// Y4M plays at its own frame rate, anything else at 30 frames per second.
+// Space pauses and q quits, typed on the terminal even when the video
+// comes down a pipe.
+
+int main(int argc, char** argv) {
+	if(argc < 2) {
+		fprintf(stderr, "usage: xvideo <file, or - for a pipe> [width] [height] [color]\n");
+		return 2;
+	}
+	const unsigned short wd = argc > 2 ? atoi(argv[2]) : 80;
+	const unsigned short ht = argc > 3 ? atoi(argv[3]) : 23;
+	const bool color = argc > 4 && strcmp(argv[4], "color") == 0;
+	VideoPipeline video(argv[1], wd, ht, color);
+	if(!video.good()) {
+		fprintf(stderr, "couldn't open %s\n", argv[1]);
+		return 1;
+	}
+
+	ASCIIWindow * window = new ASCIIWindow(wd, ht + 1);
+	// a pipe is on stdin, so keys come from the terminal itself
+	if(strcmp(argv[1], "-") == 0) {
+		if(!window -> buildOn("/dev/tty")) {
+			fprintf(stderr, "couldn't open the terminal for keys\n");
+			delete window;
+			return 1;
+		}
+	} else window -> build();
+	window -> cursVis(0);
+	CharDisplay display(wd, ht, 0, 1, window);
+	VideoLayer * screen = new VideoLayer(0, 0, 0, wd, ht);
+	display.addStruct(screen); // the display deletes it
+
+	EventLoop loop(window);
+	bool paused = false;
+	unsigned long long shown = 0;
+	char hud[80];
+	loop.onKeys([&](const char* keys, const unsigned int n) {
+		for(unsigned int i=0; i<n; i++) {
+			if(keys[i] == 'q') loop.stop();
+			else if(keys[i] == ' ') paused = !paused;
+		}
+		loop.redraw();
+	});
+	// checks often, and shows a frame once it's due, so a pipe that
+	// starts late or a rate that isn't a whole number of ms still plays right
+	const auto start = chrono::steady_clock::now();
+	double due = 0;
+	loop.every(5, [&]() {
+		const double now = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		if(paused || now < due) return;
+		if(video.next(*screen)) {
+			shown++;
+			due += 1000 / video.fps();
+			if(due < now) due = now; // don't race to catch up after a stall
+			display.redrawStructs();
+			loop.redraw();
+		} else if(video.finished()) loop.stop();
+	});
+	unsigned int retry = 0;
+	loop.onFrame([&]() {
+		const int n = snprintf(hud, sizeof(hud), "frame %-8llu %5.2f fps  %s",
+			shown, video.fps(), paused ? "paused" : "      ");
+		window -> writeAt(0, 0, string_view(hud, n < (int)sizeof(hud) ? n : sizeof(hud) - 1));
+		if(!display.update() && retry == 0)
+			retry = loop.after(5, [&]() { retry = 0; loop.redraw(); });
+	});
+	loop.run();
+
+	window -> close();
+	delete window;
+	return 0;
+}
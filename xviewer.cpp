@@ -0,0 +1,101 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+#include "ascii.hpp"
+#include "broadcast.hpp"
+using namespace std;
+
+
+// Watches a game that is being broadcast with a Broadcaster.
+//
+//   xviewer /tmp/game.sock
+//   xviewer 7000
+//
+// The address is a Unix domain socket path or a TCP port on
+// this machine. Press q to stop watching.
+
+struct Viewer {
+	int fd;
+	ASCIIWindow * window;
+	unsigned short w, h;
+	vector<uint8_t> in; // bytes received but not decoded yet
+	vector<Cell> screen;
+	FrameDelta frame;
+	bool headed; // whether the stream header has been read
+
+	Viewer() { fd = -1; window = NULL; w = 0; h = 0; headed = false; }
+
+	~Viewer() {
+		if(fd != -1) close(fd);
+		if(window == NULL) return;
+		window -> close();
+		delete window;
+	}
+
+	// Decodes every whole frame received so far.
+	// Returns false if the stream is broken.
+	bool decode() {
+		const uint8_t* p = in.data();
+		const uint8_t* end = p + in.size();
+		if(!headed) {
+			if(!decodeHeader(p, end, w, h)) return in.size() < 16;
+			headed = true;
+			screen.assign(w * h, CELL_BLANK);
+			window = new ASCIIWindow(w, h);
+			window -> build();
+			window -> cursVis(0);
+			window -> initRealTime();
+		}
+		size_t len;
+		const uint8_t* at = p;
+		while(frameLength(at, end, len)) {
+			if(!decodeFrame(at, len, frame)) return false;
+			applyFrame(frame, screen.data(), w, h);
+			at += len;
+			p = at;
+		}
+		in.erase(in.begin(), in.begin() + (p - in.data()));
+		return true;
+	}
+
+	void draw() {
+		for(unsigned short y=0; y<h; y++)
+			window -> writeCellsNR(0, y, screen.data() + y * w, w);
+	}
+
+	void run() {
+		uint8_t buf[65536];
+		while(true) {
+			pollfd pfd = {fd, POLLIN, 0};
+			poll(&pfd, 1, 16);
+			if(pfd.revents & POLLIN) {
+				const ssize_t n = read(fd, buf, sizeof(buf));
+				if(n <= 0) break; // the game ended
+				in.insert(in.end(), buf, buf + n);
+				if(!decode()) break;
+				if(window != NULL) draw();
+			}
+			// getKey refreshes the window too
+			if(window != NULL && window -> getKey() == 'q') break;
+		}
+	}
+};
+
+int main(int argc, char** argv) {
+	if(argc < 2) {
+		fprintf(stderr, "usage: %s socket-path|port\n", argv[0]);
+		return 1;
+	}
+	Viewer viewer;
+	viewer.fd = broadcastSocket(argv[1], false);
+	if(viewer.fd == -1) {
+		fprintf(stderr, "could not connect to %s\n", argv[1]);
+		return 1;
+	}
+	viewer.run();
+	return 0;
+}
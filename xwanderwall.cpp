@@ -2,7 +2,15 @@
 #include <iostream>
 #include <thread>
 #include <linux/input.h>
+#include "allocs.hpp"
 #include "engine.hpp"
+#include "broadcast.hpp"
+#include "jobs.hpp"
+#include "loop.hpp"
+#include "present.hpp"
+#include "record.hpp"
+#include "snapshot.hpp"
+#include "staticshape.hpp"
 using namespace std;
 
 
@@ -15,7 +23,33 @@ using namespace std;
 // I mostly use just to test the engine, and oh boy there
 // are so many things I have to fix
 //
-// Press ESC to prompt the user to quit.
+// Press ESC to prompt the user to quit, and u to take back
+// the last move. Taking a move back puts the critters back too.
+//
+// Run as xwanderwall [ms per frame] [recording] [broadcast] [thread]
+// to record the maze to a file that xreplay can play back, and to let
+// others watch with xviewer. Give - to skip the recording or the
+// broadcast. Giving thread draws the terminal on its own thread, so a
+// slow terminal doesn't slow the critters down.
+//
+// A few critters wander the maze as well. They plan their
+// moves on the job system's threads every frame.
+
+// A pillar in the maze, baked at compile time
+struct Pillar {
+	static constexpr const char art[] =
+		"┌──┐\n"
+		"│██│\n"
+		"└──┘";
+};
+
+// Something that wanders the maze on its own
+struct Critter {
+	CollChar * chr;
+	unsigned int seed; // xorshift state, one per critter so they plan in parallel
+	unsigned short nx, ny; // where it moves to this frame
+};
+
 struct WanderwallGame {
 	// default terminal window is 80x24
 	ASCIIWindow * window = new ASCIIWindow(80, 24);	
@@ -24,6 +58,9 @@ struct WanderwallGame {
 	unsigned short px, py, // player x and y position
 		mpWd, mpHt; // maximum travelable map bounds
 	bool running;
+	char lastKey; // the last key typed, shown on the HUD
+	char hud[48]; // where HUD fields are formatted
+	Presenter * presenter = NULL; // draws on its own thread, if it was asked for
 	unsigned char mode; // 0 for main menu, 1 for game, 2 for pause
 
 	// All the structs of the game
@@ -33,7 +70,14 @@ struct WanderwallGame {
 	Box * surroundWorld = new Box(0x00000001, '0', false, mpWd, mpHt);
 	Line * line1 = new Line(0x00000001, '0', 5, 2, 1, true);
 	Line * line2 = new Line(0x00000001, '0', 5, 1, 7, false);
+	StaticStruct<Pillar> * pillar = new StaticStruct<Pillar>(0x00000001, 12, 3);
 	CollChar * player = new CollChar(0x10000000, 'A', px, py);
+	vector<Critter> critters;
+
+	// runs the frame's game logic on every core
+	JobSystem jobs;
+	JobCounter planned; // critters that are done planning this frame
+	History history; // the maze before each move, for taking moves back
 
 	// ========================
 	// Initialization functions
@@ -61,73 +105,106 @@ struct WanderwallGame {
 		mpWd = 100, mpHt = 50;
 		
 		// Initialize structures
+		line1 -> setCell(0x2502); // box drawing vertical
+		line2 -> setCell(0x2500); // box drawing horizontal
+		player -> setCell(cellOf('A', paletteOf(BYLW)));
 		display.addStruct(surroundWorld);
 		display.addStruct(line1);
 		display.addStruct(line2);
+		display.addStruct(pillar);
 		display.addStruct(player);
+		const unsigned short spawns[6][2] = {
+			{5, 4}, {40, 8}, {60, 15}, {20, 18}, {70, 5}, {33, 12}};
+		for(unsigned int i=0; i<6; i++) {
+			Critter c = {new CollChar(0x00000002, 'o', spawns[i][0], spawns[i][1]),
+				0x9E3779B9u * (i + 1), spawns[i][0], spawns[i][1]};
+			c.chr -> setCell(cellOf('o', paletteOf(BGRN)));
+			critters.push_back(c);
+			display.addStruct(c.chr);
+		}
+		// finish the frame's jobs before anything is drawn
+		jobs.joinBefore(display);
 		display.writeStructs();
 		display.update();
 		
 		running = true;
-		mode = 0;
+		mode = 1;
+		lastKey = 0;
 		return true;
 	}
 
 	// Destructs the Wanderwall game.
 	// This is called as soon as the object is destroyed.
 	bool end() {
+		// the render thread lets go of the window first
+		delete presenter;
 		// destroy the window
 		window -> close();
 		delete window;
 		return true;
 	}
 	
+	// Draws the terminal on its own thread from now on.
+	// Keys have to be read without the window after this.
+	void presentOnThread() {
+		window -> initRealTime();
+		presenter = new Presenter(window);
+	}
+
 	// =============
 	// Frame Methods
 	// =============
 
-	// Called every frame.
-	// This method is called by the thread
-	const void run() {
-	
-		// First get the input
-		char input = parseKey();
-		
-		if(input == 27) { // escape key
-			window -> exitRealTime(); // exit real time to wait for confirmation
-			window -> writeAt(0, 1, "Quit? [Y/N]             ");
-			char conf = window -> getKey();
-			if(conf == 'y') running = false;
+	// Called by the event loop with the keys typed since it last woke.
+	// Returns true if the screen has to be redrawn.
+	bool onKeys(const char* keys, const unsigned int n) {
+		// only the last key counts, an arrow key is ESC [ and a letter
+		const char input = keys[n-1];
+		lastKey = input;
+
+		if(mode == 2) { // waiting for the quit confirmation
+			if(input == 'y') running = false;
 			else {
-				window -> initRealTime(); // resume realtime if not confirmed
-				window -> writeAt(0, 1, "                        ");
+				hudText(0, 1, "                        ");
+				mode = 1;
+			}
+			return true;
+		}
+		if(input == 27) { // escape key
+			hudText(0, 1, "Quit? [Y/N]             ");
+			mode = 2;
+			return true; // to show the prompt
+		}
+		if(input == 'u') {
+			jobs.endFrame(); // the critters' moves are part of the turn
+			if(history.undo(display)) {
+				px = player -> posX();
+				py = player -> posY();
 			}
+			return true;
 		}
-		else { // Normal running
-			bool change = tryMove(player, input);
-			// updateDisp(change, input); // This only updates if screen changed
-			updateDisp(true, input); // This always updates even if no screen change
+		if(input >= 65 && input <= 68) {
+			jobs.endFrame();
+			history.save(display);
 		}
-	}	
+		tryMove(player, input);
+		return true; // the HUD shows the key even if the player didn't move
+	}
+
+	// Called by the event loop every refresh, moves the critters
+	void tick() {
+		if(mode != 2) moveCritters();
+	}
+
+	// Called by the event loop when something changed.
+	// Returns false if the terminal was too backed up to take the frame.
+	bool frame() {
+		if(mode == 2) return show(); // keep the quit prompt up
+		return updateDisp(true, lastKey);
+	}
 	
 	// 
 	private:
-		// This function always returns the last ASCII key in the value
-		char parseKey() {
-			// nextKey is the next key and gets consumed every operation
-			// essentially this means that nextKey always ends at -1,
-			// while key is the actual key character value that gets returned
-			char nextKey = window -> getKey(), 
-				key = 0;
-			// runs through every char value in the buffer
-			while(nextKey != -1) {
-				key = nextKey;
-				nextKey = window -> getKey();
-			}
-			
-			return key;
-		}
-		
 		//char* detectKeys() {
 			// TODO: Actually write this
 			// If no key is pressed then return NULL
@@ -168,26 +245,82 @@ struct WanderwallGame {
 			} return (person -> setX(px) || person -> setY(py));
 		}
 
+		// Plans every critter's move in parallel, then moves them all
+		// in one job once every plan is in. Planning only reads the
+		// display, so the plans can't see a half moved maze. The moves
+		// are joined by the display before it draws.
+		void moveCritters() {
+			for(unsigned int i=0; i<critters.size(); i++)
+				jobs.run([this, i]() { plan(critters[i]); }, planned);
+			jobs.runFrame([this]() {
+				for(unsigned int i=0; i<critters.size(); i++) {
+					critters[i].chr -> setX(critters[i].nx);
+					critters[i].chr -> setY(critters[i].ny);
+				}
+			}, &planned);
+		}
+
+		// Picks a random step for a critter that doesn't walk into a wall
+		void plan(Critter &c) {
+			c.seed ^= c.seed << 13; c.seed ^= c.seed >> 17; c.seed ^= c.seed << 5;
+			const unsigned short x = c.chr -> posX(), y = c.chr -> posY();
+			c.nx = x; c.ny = y;
+			unsigned short tx = x, ty = y;
+			switch(c.seed % 5) {
+				case 0: ty--; break;
+				case 1: ty++; break;
+				case 2: tx++; break;
+				case 3: tx--; break;
+				default: return; // stay put
+			}
+			if(tx < display.width() && ty < display.height()
+			&& !display.hasCollCode(tx, ty, 0x00000001)) { c.nx = tx; c.ny = ty; }
+		}
+
+		// Formats a HUD field into the line buffer and writes it,
+		// so drawing the HUD doesn't build strings every frame
+		template<typename... Args>
+		void hudField(const unsigned short x, const unsigned short y,
+		const char* format, Args... args) {
+			const int n = snprintf(hud, sizeof(hud), format, args...);
+			if(n > 0) hudText(x, y, string_view(hud, n < (int)sizeof(hud) ? n : sizeof(hud) - 1));
+		}
+
+		// Writes HUD text on the window, or on the render thread's next frame
+		void hudText(const unsigned short x, const unsigned short y, const string_view text) {
+			if(presenter != NULL) presenter -> text(x, y, text);
+			else window -> writeAt(x, y, text);
+		}
+
+		// Sends the display and the HUD to the terminal, or to the render
+		// thread. Returns false if the terminal was too backed up to take it.
+		bool show() {
+			if(presenter == NULL) return display.update();
+			presenter -> draw(display);
+			presenter -> publish();
+			return true;
+		}
+
 		// Update the display
 		/* change - Whether the screen changed since last frame/operation
-		 * display - The reference to the display to update
-		 * window - The pointer to the ASCII window to write information on*/
-		void updateDisp(const bool change, const char in) {
+		 * in - The last key typed, shown on the HUD
+		 * Returns false if the terminal was too backed up to take it*/
+		bool updateDisp(const bool change, const char in) {
 			// whether player position has changed or not
 			if(change) display.redrawStructs();
-			display.update(); // update char screen
 			// print Wonderwall of course
-			window -> writeAt(0, 0, "===Wanderwall===");
+			hudText(0, 0, "===Wanderwall===");
 			// print player coords
-			string coords = "X:"+to_string(px)+" Y:"+to_string(py);
-			window -> writeAt(0, 1, "Player Pos: "+coords);
+			hudField(0, 1, "Player Pos: X:%-3u Y:%-3u", px, py);
 		
 			// debug
-			window -> writeAt(20, 0, "DB: ");
-			window -> writeAt(24, 0, "WID "+to_string(display.width()));
-			window -> writeAt(24, 1, "HGT "+to_string(display.height()));
-			window -> writeAt(30, 0, "CAT "+to_string(display.charAt(px, py+2)));
-			window -> writeAt(30, 1, "KEY "+to_string(in));
+			hudText(20, 0, "DB: ");
+			hudField(24, 0, "WID %u", display.width());
+			hudField(24, 1, "HGT %u", display.height());
+			hudField(30, 0, "CAT %-20llu", (unsigned long long)display.charAt(px, py));
+			hudField(30, 1, "KEY %-4d", in);
+
+			return show(); // update char screen, and the HUD with it
 		}
 
 };
@@ -196,31 +329,85 @@ struct WanderwallGame {
 // Out-of-class methods
 // ====================
 
-// This is called by the main thread every frame
-const void update(WanderwallGame* wg, const unsigned short refreshRate) {
-	while(wg -> running) {
-		wg -> run();
-		//unsigned short refresh = (refreshRate > 20) ? refreshRate : 20;
-		this_thread::sleep_for(chrono::milliseconds(refreshRate));
-	}
-}
-
 int main(int argc, char** argv) {
-	// the game refreshes every *this* amount of milliseconds
+	// the critters move every *this* amount of milliseconds,
+	// the player moves as soon as a key is pressed
 	unsigned short refRate;
-	// if no additional arguments refresh every 125 ms (8 fps)
-	// otherwise refresh at an interval defined by user
+	// if no additional arguments move every 125 ms (8 fps)
+	// otherwise move at an interval defined by user
 	if(argc == 1) refRate = 125;
 	else refRate = atoi(argv[1]);
 	
 	// one game instance
 	WanderwallGame * game = new WanderwallGame();
+	Recorder * rec = NULL;
+	Broadcaster * cast = NULL;
+	if(argc > 2 && string(argv[2]) != "-") {
+		rec = new Recorder(argv[2], game -> display.width(), game -> display.height());
+		game -> display.addFrameSink(rec);
+	}
+	if(argc > 3 && string(argv[3]) != "-") {
+		cast = new Broadcaster(argv[3], game -> display.width(), game -> display.height());
+		game -> display.addFrameSink(cast);
+	}
 	
-	// main thread
-	thread main(update, game, refRate);
-	main.join();
+	// sleep until a key is pressed or the critters are due to move
+	EventLoop loop(game -> window);
+	// times every key from being read to being on the screen
+	LatencyTrace trace;
+	const bool traced = argc > 5 && string(argv[5]) == "latency";
+	if(traced) {
+		game -> window -> setTrace(&trace, true);
+		loop.setTrace(&trace);
+	}
+	if(argc > 4 && string(argv[4]) == "thread") {
+		game -> presentOnThread();
+		loop.setRawKeys(true);
+	}
+	loop.onKeys([&](const char* keys, const unsigned int n) {
+		if(game -> onKeys(keys, n)) loop.redraw();
+		if(!game -> running) loop.stop();
+	});
+	// catches steps that allocate, when built with -DASCII_COUNT_ALLOCS
+	AllocMeter allocs;
+	loop.every(refRate, [&]() {
+		allocs.begin();
+		game -> tick();
+		allocs.end();
+		loop.redraw();
+	});
+	// a frame held back for a slow terminal is tried again shortly,
+	// with whatever changed in the meantime
+	unsigned int retry = 0;
+	loop.onFrame([&]() {
+		allocs.begin();
+		const bool shown = game -> frame();
+		allocs.end();
+		if(!shown && retry == 0)
+			retry = loop.after(5, [&]() { retry = 0; loop.redraw(); });
+	});
+	loop.run();
 	
 	// end process
+	if(rec != NULL) {
+		game -> display.removeFrameSink(rec);
+		delete rec;
+	}
+	if(cast != NULL) {
+		game -> display.removeFrameSink(cast);
+		delete cast;
+	}
+	const unsigned long long held = game -> display.held();
+	const unsigned long long skipped = game -> presenter != NULL ? game -> presenter -> skipped() : 0;
 	delete game;
+	if(held > 0) fprintf(stderr, "%llu frames held back for the terminal\n", held);
+	if(skipped > 0) fprintf(stderr, "%llu frames skipped by the render thread\n", skipped);
+	if(traced) {
+		const LatencyHistogram h = trace.histogram();
+		fprintf(stderr, "key to screen: %llu keys, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+			(unsigned long long)h.count(), h.percentile(50) / 1000.0,
+			h.percentile(99) / 1000.0, h.max() / 1000.0);
+	}
+	allocs.report(stderr);
 	return 0;
 }